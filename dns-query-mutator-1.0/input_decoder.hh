@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2017-2018 by the University of Southern California
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef INPUT_DECODER_HH
+#define INPUT_DECODER_HH
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <streambuf>
+#include <zlib.h>
+#include <lzma.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define INPUT_CODEC_NONE  0x0000U
+#define INPUT_CODEC_GZIP  0x0001U
+#define INPUT_CODEC_XZ    0x0002U
+#define INPUT_CODEC_ZSTD  0x0004U
+
+// input decoder reads a file or stdin ('-') on its own thread, ahead
+// of the reader, and decompresses it when it starts with the magic of
+// gzip, xz or zstd; xz is decoded by several threads when the file has
+// several blocks. it is a streambuf, so an istream on it reads the
+// decoded bytes
+
+class InputDecoder : public std::streambuf {
+public:
+  InputDecoder(std::string);
+  ~InputDecoder();
+  static unsigned int detect(std::string);
+  static const char *codec_name(unsigned int);
+  unsigned int get_codec() { return codec; }
+
+protected:
+  int_type underflow();
+
+private:
+  int fd = -1;
+  bool is_stdin = false;
+  unsigned int codec = INPUT_CODEC_NONE;
+  std::string path;
+  std::string head;                //bytes read to detect the codec
+  std::string in_buf;              //compressed input
+  std::string *out = NULL;         //chunk being decoded into
+  size_t out_len = 0;
+  std::string *cur = NULL;         //chunk being read by the caller
+
+  //decoder thread -> caller
+  std::deque<std::string *> chunks;
+  std::vector<std::string *> spare; //chunks read, for reuse
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool ended = false;              //decoder thread is done
+  bool stopping = false;           //caller is gone
+  bool frame_open = false;         //input ends inside a gzip or zstd frame
+  std::thread th;
+
+  z_stream zs;
+  lzma_stream ls = LZMA_STREAM_INIT;
+#ifdef HAVE_ZSTD
+  ZSTD_DCtx *zds = NULL;
+#endif
+
+  static unsigned int codec_of(const char *, size_t);
+  size_t read_in(char *, size_t);
+  void decode_loop();
+  bool decode(const char *, size_t, bool);
+  bool push_out();
+};
+
+#endif //INPUT_DECODER_HH
@@ -68,7 +68,7 @@ void InputStream::init(string fn, string ft, bool vb)
       trace_cleanup();
       err(1, "cannot start trace");
     }
-  } else if (!is_stdin) { //not read from stdin: open input file
+  } else if (!is_stdin && InputDecoder::detect(fn) == INPUT_CODEC_NONE) { //plain input file
     if (input_format & INPUT_STREAM_TEXT) {
       ifs.open(fn);
     } else if (input_format & INPUT_STREAM_RAW) {
@@ -76,6 +76,12 @@ void InputStream::init(string fn, string ft, bool vb)
     }
     if (!ifs.is_open())
       err(1, "cannot open input file");
+    input.rdbuf(ifs.rdbuf());
+  } else { //stdin or compressed file: decoded by its own thread
+    dec = new InputDecoder(fn);
+    input.rdbuf(dec);
+    if (verbose)
+      warnx("input %s compression: %s", fn.c_str(), InputDecoder::codec_name(dec->get_codec()));
   }
 }
 
@@ -83,6 +89,8 @@ InputStream::~InputStream()
 {
   if (input_format & INPUT_STREAM_TRACE)
     trace_cleanup();
+  else if (dec)
+    delete dec;
   else if (!is_stdin && ifs.is_open())
     ifs.close();
 }
@@ -124,16 +132,9 @@ trace_replay::DNSMsg *InputStream::get()
 
 bool InputStream::read_bytes (char *buf, size_t n)
 {
-  if (is_stdin) {
-    if (n != fread((void *)buf, 1, n, stdin)) {
-      warn("[warn] fail to read stdin");
-      return false;
-    }
-  } else {
-    if (!ifs.read(buf, n)) {
-      warn("[warn] fail to read file");
-      return false;
-    }
+  if (!input.read(buf, n)) {
+    warn("[warn] fail to read %s", (is_stdin ? "stdin" : "file"));
+    return false;
   }
   return true;
 }
@@ -184,7 +185,7 @@ trace_replay::DNSMsg *InputStream::get_from_text()
   string line;
   do {
     line.clear();
-    if (!getline((is_stdin ? (cin):(ifs)), line))
+    if (!getline(input, line))
       return NULL;
   } while (line.empty() || line == "\n" || line[0] == '#');
   return process_line(line);
@@ -27,8 +27,10 @@
 #define INPUT_STREAM_HH
 
 #include "dns_msg.pb.h"
+#include "input_decoder.hh"
 #include <string>
 #include <fstream>
+#include <istream>
 #include "libtrace.h"
 #include <unordered_map>
 
@@ -50,6 +52,8 @@ private:
   bool is_stdin;    
   unsigned int input_format;
   std::ifstream ifs;
+  InputDecoder *dec = NULL;   //stdin or compressed file
+  std::istream input{NULL};
 
   void init(std::string, std::string, bool);
   
@@ -48,6 +48,7 @@ void usage(const char *comm) {
     comm << " [-i FORMAT:FILE] [-o FORMAT:FILE]\n"
     "         [-l] [-h] [-v] [-V]\n"
     " -i/--input FORMAT:FILE    input file, use '-' as FILE to read from stdin\n"
+    "                           gzip, xz or zstd input is decompressed\n"
     "                           format and file separated by colon like FORMAT:PATH\n"
     "                           accepted format: trace, text, raw\n"
     "                           e.g. trace:test.pcap, text:test.fsdb, raw:test.raw\n"
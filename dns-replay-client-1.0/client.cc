@@ -22,12 +22,18 @@
 #include <csignal>
 //#include <cstdint>
 #include <climits>
+#include <cmath>
 #include "global_var.h"
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <fstream>
+#include <sstream>
+#include <endian.h>
 
 #include <event2/listener.h>
 #include <event2/bufferevent_ssl.h>
@@ -38,6 +44,7 @@
 
 #include "dns_util.hh"
 #include "utility.hh"
+#include "check.hh"
 #include "dns_msg.pb.h"
 using namespace std;
 
@@ -45,6 +52,14 @@ using namespace std;
 #define MIN_BUF_SIZE    64
 
 #define UDP_READ_TIMEOUT 60
+#define MAX_TX_TS_WAIT   10000 //queries per udp socket waiting for a send timestamp
+
+//udp buffer sizing from the expected rate: kernel memory per datagram
+//(skb truesize, not payload) times the burst to absorb
+#define UDP_RCV_TRUESIZE 2048
+#define UDP_SND_TRUESIZE 1024
+#define UDP_BUF_SECONDS  0.2
+#define RING_READ_MAX    (256 * 1024) //bytes taken from the shared memory ring per callback
 
 struct cb_arg_t
 {
@@ -52,6 +67,7 @@ struct cb_arg_t
   void *a;    // the additional argument to pass
   void *e;    // additional argument to pass (event pointer?)
   long long unsigned int c;//query count
+  std::string key; //query record waiting for the send timestamp
 };
 
 void copy_ts (struct timeval *a, struct timeval *b)
@@ -78,30 +94,66 @@ void fill_addr(struct sockaddr_in *addr, const char *ip, int port)
   addr->sin_port = htons(port);
 }
 
-DNSClient::DNSClient(string c, string g, int t, string s_ip, int s_port, int fd, uint32_t skt_unify, uint32_t opt, bool nw)
+/*
+  parse the server list of -s: IP:PORT[@WEIGHT] separated by commas
+*/
+void parse_targets(string s, vector<target_t> &v)
+{
+  vector<string> items;
+  str_split(s, items, ',', true);
+  for (string &e : items) {
+    target_t t;
+    string addr = e, ip, port;
+    size_t found = e.find_first_of('@');
+    if (found != string::npos) {
+      addr = e.substr(0, found);
+      check_gt0(e.substr(found + 1), "server weight");
+      t.weight = stoi(e.substr(found + 1));
+    }
+    str_split(addr, ip, port, ':');
+    check_str(ip, "server ip");
+    check_gt0(port, "server port");
+    fill_addr(&t.addr, ip.c_str(), stoi(port));
+    t.name = ip + ":" + port;
+    v.push_back(t);
+  }
+}
+
+DNSClient::DNSClient(string c, string g, int t, vector<target_t> tg, int fd, uint32_t skt_unify, uint32_t o, bool nw,
+		     client_opt_t co)
 {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
   
   my_pid = getpid();
-  server_port = s_port;
   time_out = t;
-  server_ip = s_ip;
+  targets = tg;
   conn_type = c;
   manager_fd = fd;
   msg_buffer.clear();
   num_query = 0;
   socket_unify = skt_unify;
-  output_option = opt;
+  output_option = o;
+  opt = co;
   non_wait = nw;
   nagle_option = g;
-  fill_addr(&server_addr, server_ip.c_str(), server_port);
+  parse_msg = new trace_replay::DNSMsg();
 
   //check input
-  if (server_port < 0) log_err("server port must be > 0"); 
+  if (targets.empty()) log_err("no server to replay to");
   if (time_out < 0) log_err("time out value must be >= 0");
-  if (server_ip.length() == 0) log_err("server IP is invalid");
+  if (server_policy_set.find(opt.server_policy) == server_policy_set.end()) log_err("server policy is invalid");
+  if (opt.udp_pool < 1) log_err("udp socket pool must be >= 1");
+  if (opt.expected_qps < 0 || opt.udp_rcvbuf < 0 || opt.udp_sndbuf < 0) log_err("udp buffer options must be >= 0");
+  if (udp_pool_policy_set.find(opt.udp_pool_policy) == udp_pool_policy_set.end()) log_err("udp pool policy is invalid");
   if (conn_set.find(conn_type) == conn_set.end()) log_err("connection type is invalid");
   if (manager_fd <= 0) log_err("manager fd is invalid");
+  if (opt.stats_interval < 0) log_err("stats interval must be >= 0");
+  if (opt.conn_rate < 0) log_err("connection rate must be >= 0");
+  if (opt.conn_burst < 1) log_err("connection burst must be >= 1");
+  if (opt.conn_queue < 0) log_err("connection wait queue must be >= 0");
+  if (opt.tls_helpers < 0) log_err("number of tls helpers must be >= 0");
+  if (opt.ktls && opt.tls_helpers == 0) //the switch to kernel tls is done by a helper
+    opt.tls_helpers = 1;
 
   if (conn_type == "tls") {
     init_ssl();
@@ -117,11 +169,31 @@ DNSClient::~DNSClient()
     close(it.first);
     event_free(it.second);
   }
-  if (unified_udp_fd != -1) {
-    close(unified_udp_fd);
+  for (target_t &tg : targets) {
+    for (int fd : tg.udp_fds) {
+      close(fd);
+    }
+    for (struct event *ev : tg.udp_read_events) {
+      event_free(ev);
+    }
+  }
+  if (stats_event) {
+    event_free(stats_event);
+  }
+  if (pending_event) {
+    event_free(pending_event);
   }
-  if (unified_udp_read_event) {
-    event_free(unified_udp_read_event);
+  if (parse_msg) {
+    delete parse_msg;
+  }
+  if (conn_pace_event) {
+    event_free(conn_pace_event);
+  }
+  if (tls_pool) {
+    delete tls_pool;
+  }
+  if (tls_pool_event) {
+    event_free(tls_pool_event);
   }
   if (ssl_ctx) {
     SSL_CTX_free(ssl_ctx);
@@ -140,6 +212,17 @@ SSL_CTX *DNSClient::get_ssl_ctx()
 {
   if (!ssl_ctx) {
     ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+    if (ssl_ctx && opt.ktls) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+      //the kernel passes only application data to a plain read, so
+      //tls 1.3 post-handshake messages (session tickets) would break
+      //the stream: stay with tls 1.2
+      SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+      SSL_CTX_set_max_proto_version(ssl_ctx, TLS1_2_VERSION);
+#else
+      LOG(LOG_WARN, "[%d] [warn] openssl has no kernel tls support\n", my_pid);
+#endif
+    }
   }
   if (!ssl_ctx) {
     ERR_print_errors_fp (stderr);
@@ -180,6 +263,7 @@ static void signal_cb(evutil_socket_t sig, short what, void *ctx)
   LOG(LOG_INFO, "[%d] Max pending event: %llu\n", getpid(), (static_cast<DNSClient *>(ctx))->get_pending_event_max());
   LOG(LOG_INFO, "[%d] Number of timer:   %llu\n", getpid(), (static_cast<DNSClient *>(ctx))->get_num_timer());
   LOG(LOG_INFO, "[%d] Number of notimer: %llu\n", getpid(), (static_cast<DNSClient *>(ctx))->get_num_notimer());
+  (static_cast<DNSClient *>(ctx))->log_stats();
 }
 
 /*
@@ -215,26 +299,92 @@ void DNSClient::start()
   bufferevent_setcb(manager_bev, &DNSClient::manager_read_cb_helper, NULL, &DNSClient::manager_event_cb_helper, this);
   bufferevent_enable(manager_bev, EV_READ|EV_WRITE);
 
-  //check if unified udp socket is used
+  //queries may come over a shared memory ring instead; the socket
+  //still carries the output back to the manager
+  if (opt.ring) {
+    ring_event = event_new(base, opt.ring->get_notify_fd(), EV_READ|EV_PERSIST, &DNSClient::ring_read_cb_helper, this);
+    assert(ring_event != NULL);
+    if (event_add(ring_event, NULL) < 0)
+      log_err("cannot add shared memory ring event");
+    event_active(ring_event, EV_READ, 0); //the manager may have been first
+  }
+
+  //check if unified udp socket is used: a pool per target, each
+  //socket on its own source port so that the server spreads them
   if (socket_unify & SOCKET_UNIFY_UDP) {
-    if ((unified_udp_fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
-	log_err("socket");
-    LOG(LOG_DBG, "[%d] unified_udp_fd [%d]\n", my_pid, unified_udp_fd);
-    if (evutil_make_socket_nonblocking(unified_udp_fd) < 0) {
-      evutil_closesocket(unified_udp_fd);
-      log_err("evutil_make_socket_nonblocking fails: unified_udp_fd");
+    for (unsigned int t = 0; t < targets.size(); t++) {
+      target_t &tg = targets[t];
+      for (int i = 0; i < opt.udp_pool; i++) {
+	int unified_udp_fd = -1;
+	if ((unified_udp_fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+	  log_err("socket");
+	LOG(LOG_DBG, "[%d] unified_udp_fd [%d]\n", my_pid, unified_udp_fd);
+	if (evutil_make_socket_nonblocking(unified_udp_fd) < 0) {
+	  evutil_closesocket(unified_udp_fd);
+	  log_err("evutil_make_socket_nonblocking fails: unified_udp_fd");
+	}
+	if (connect (unified_udp_fd, (struct sockaddr *)&tg.addr, sizeof(tg.addr)) < 0)
+	  log_err("connect");
+	LOG(LOG_DBG, "[%d] create unified_udp_fd [%d] for %s\n", my_pid, unified_udp_fd, tg.name.c_str());
+	tg.udp_fds.push_back(unified_udp_fd);
+	unified_fd2target[unified_udp_fd] = t;
+	setup_udp_socket(unified_udp_fd, true);
+
+	struct event *ev = event_new(base, unified_udp_fd, EV_READ|EV_PERSIST, &DNSClient::server_udp_read_cb_helper, this);
+	assert(ev != NULL);
+	if (event_add(ev, NULL) < 0){
+	  event_free(ev);
+	  log_err("cannot add unified_udp_read_event");
+	} else
+	  log_dbg("done unified_udp_read_event");
+	tg.udp_read_events.push_back(ev);
+      }
     }
-    if (connect (unified_udp_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-      log_err("connect");
-    LOG(LOG_DBG, "[%d] create unified_udp_fd [%d]\n", my_pid, unified_udp_fd);
-
-    unified_udp_read_event = event_new(base, unified_udp_fd, EV_READ|EV_PERSIST, &DNSClient::server_udp_read_cb_helper, this);
-    assert(unified_udp_read_event != NULL);
-    if (event_add(unified_udp_read_event, NULL) < 0){
-      event_free(unified_udp_read_event);
-      log_err("cannot add unified_udp_read_event");
-    } else
-      log_dbg("done unified_udp_read_event");
+  }
+
+  //timer for the queries waiting for their send time
+  pending_event = evtimer_new(base, &DNSClient::pending_timer_cb_helper, this);
+  assert(pending_event != NULL);
+
+  //retry timer for udp queries without response
+  if (opt.udp_retry_ms > 0) {
+    udp_retry_q.resize(opt.udp_retries + 1);
+    udp_retry_event = evtimer_new(base, &DNSClient::udp_retry_cb_helper, this);
+    assert(udp_retry_event != NULL);
+  }
+
+  //pacing timer for new tcp/tls connections
+  if (opt.conn_rate > 0) {
+    conn_pace_event = evtimer_new(base, &DNSClient::conn_pace_cb_helper, this);
+    assert(conn_pace_event != NULL);
+  }
+
+  //helper threads for tls handshakes
+  if (conn_type == "tls" && opt.tls_helpers > 0) {
+    int nagle_flag = -1;
+    if (nagle_option == "disable" || nagle_option == "enable")
+      nagle_flag = (nagle_option == "disable" ? 1 : 0);
+    if (!get_ssl_ctx())
+      log_err("cannot create ssl context");
+    tls_pool = new TlsHandshakePool(ssl_ctx, opt.tls_helpers, nagle_flag, time_out, opt.ktls);
+    int notify_fd = tls_pool->start();
+    tls_pool_event = event_new(base, notify_fd, EV_READ|EV_PERSIST, &DNSClient::tls_pool_cb_helper, this);
+    assert(tls_pool_event != NULL);
+    if (event_add(tls_pool_event, NULL) < 0)
+      log_err("cannot add tls handshake pool event");
+  }
+
+  //host udp counters count from the start of the replay
+  if (opt.sample_snmp && !read_snmp_udp(&snmp_rcvbuf_last, &snmp_sndbuf_last))
+    LOG(LOG_WARN, "[%d] [warn] cannot read udp counters from /proc/net/snmp\n", my_pid);
+
+  //periodic response stats
+  if (opt.stats_interval > 0) {
+    struct timeval stats_tv = {opt.stats_interval, 0};
+    stats_event = event_new(base, -1, EV_PERSIST, &DNSClient::stats_timer_cb_helper, this);
+    assert(stats_event != NULL);
+    if (event_add(stats_event, &stats_tv) < 0)
+      log_err("cannot add stats event");
   }
   
   //start event loop
@@ -242,6 +392,8 @@ void DNSClient::start()
   event_base_dispatch(base);
 
   //clean up
+  if (tls_pool)
+    tls_pool->stop();
   if (manager_bev)
     bufferevent_free(manager_bev);
   if (signal_event)
@@ -311,55 +463,95 @@ void DNSClient::manager_read_cb(struct bufferevent *bev)
   bufferevent_read(bev, data, len);
   msg_buffer.append(reinterpret_cast<const char*>(data), len);
   delete[] data;
+  read_manager_msgs();
+}
 
+/*
+  helper of ring_read_cb
+*/
+void DNSClient::ring_read_cb_helper(evutil_socket_t fd, short which, void *ctx)
+{
+  (static_cast<DNSClient *>(ctx))->ring_read_cb();
+}
+
+/*
+  read from the shared memory ring of the manager, a slice at a time so
+  that timers are not held up by a full ring
+*/
+void DNSClient::ring_read_cb()
+{
+  uint64_t v;
+  if (read(opt.ring->get_notify_fd(), &v, sizeof(v)) == -1 && errno != EAGAIN)
+    log_err("read shared memory ring eventfd");
+  size_t n = opt.ring->get(msg_buffer, RING_READ_MAX);
+  read_manager_msgs();
+  if (n == RING_READ_MAX || !opt.ring->idle())
+    event_active(ring_event, EV_READ, 0);
+}
+
+/*
+  a query from the manager has left this worker (sent or dropped): the
+  manager may send another one
+*/
+void DNSClient::grant_credit()
+{
+  if (opt.credit)
+    shm_credit_grant(opt.credit);
+}
+
+/*
+  handle the complete messages from the manager in msg_buffer
+*/
+void DNSClient::read_manager_msgs()
+{
   //there might be multiple queries (raw binary) in this buffer
-  while(msg_buffer.size() > sizeof(uint32_t)) {
-    uint8_t *d = (uint8_t *)(msg_buffer.data());
+  size_t pos = 0;
+  while(msg_buffer.size() - pos > sizeof(uint32_t)) {
+    uint8_t *d = (uint8_t *)(msg_buffer.data()) + pos;
     uint32_t sz = 0;
     memcpy(&sz, d, sizeof(uint32_t));
     sz = ntohl(sz);
-    uint32_t left = msg_buffer.size() - sizeof(uint32_t);
+    bool sync = (sz & FRAME_SYNC); //raw input passed through by the manager
+    sz &= ~FRAME_SYNC;
+    uint32_t left = msg_buffer.size() - pos - sizeof(uint32_t);
     d += sizeof(uint32_t);
     
     if (sz > left) { //not enought data left
       break;
     }
 
-    //creat a new message which should be deleted after query is sent
-    //in callback function
-    trace_replay::DNSMsg *msg = new trace_replay::DNSMsg();
-    assert(msg);
+    //parse into the reused message; queries for the future are copied
+    //to the pending queue, only queries sent now get their own message
+    trace_replay::DNSMsg *msg = parse_msg;
+    msg->Clear();
     msg->ParseFromArray(d, sz);
-    
-    //reset the dns id
-    //set_random_id(qraw->raw);
-    //LOG(LOG_DBG, "[%d] set random id [%u]\n", my_pid, get_id(qraw->raw));
-
-    //string raw = msg->raw();
-    //print_dns_pkt((uint8_t*)raw.data(), raw.size());
-    
-    //printf("clientts:%ld.%06ld\n", qraw->ts.tv_sec, qraw->ts.tv_usec);
-    //qraw->print();
-    //print_dns_pkt(qraw.raw, qraw.len);
-
-    msg_buffer = msg_buffer.substr(sz + sizeof(uint32_t)); //assign msg_buffer for the rest of data 
+    pos += sz + sizeof(uint32_t);
 
     struct timeval q_ts = {0, 0};
     q_ts.tv_sec = msg->seconds();
     q_ts.tv_usec = msg->microseconds();
 
     struct timeval now_ts = {0, 0};
-    //evutil_gettimeofday(&now_ts, NULL);
 
     //check if it is for sync time
-    if (msg->sync_time()) { //sync time message from manager
+    if (sync || msg->sync_time()) { //sync time message from manager
       log_dbg("recv sync_time from manager");
-      if (evutil_timerisset(&start_trace_ts))
-	log_err("recv sync_time msg but trace start time is set!");
+      if (evutil_timerisset(&start_trace_ts)) {
+	//the start instant of a synchronized start, after the preload
+	if (!msg->has_start_time() || msg->start_time() <= 0 || evutil_timerisset(&start_real_ts))
+	  log_err("recv sync_time msg but trace start time is set!");
+	set_start(msg->start_time());
+	pending_schedule();
+	continue;
+      }
       copy_ts(&start_trace_ts, &q_ts);
-      recheck_now_ts(&now_ts);
-      copy_ts(&start_real_ts, &now_ts);
-      delete msg;
+      if (msg->has_start_time()) { //0: queries wait for the start instant
+	if (msg->start_time() > 0)
+	  set_start(msg->start_time());
+      } else {
+	recheck_now_ts(&now_ts);
+	copy_ts(&start_real_ts, &now_ts);
+      }
       continue;
     }
     if (!evutil_timerisset(&start_trace_ts))
@@ -373,87 +565,659 @@ void DNSClient::manager_read_cb(struct bufferevent *bev)
     num_query += 1;
     LOG(LOG_DBG, "[%d] query [%llu] from mananger\n", my_pid, num_query);
 
-    //set a timer event to send the query in the future; we only setup
-    //a timer event here, create connection and send will be done when
-    //the event is activated
-    struct timeval tv = {0, 0};
-    struct timeval diff_time = {0, 0};                  //time to trace start time
-    struct timeval process_time = {0, 0};               //trace processing time so far
-    
-    evutil_timersub(&q_ts,   &start_trace_ts, &diff_time);
+    //queue the query to send it in the future; create connection and
+    //send will be done when the pending timer fires
+    struct timeval due = {0, 0};
+    pending_due(&q_ts, &due);
     recheck_now_ts(&now_ts);
-    evutil_timersub(&now_ts, &start_real_ts,  &process_time);
-
-    //not log this for now, since timer might be sensitive
-    //LOG(LOG_DBG, "[%d] diff_time %ld.%06ld\n", my_pid, diff_time.tv_sec, diff_time.tv_usec);
-    //LOG(LOG_DBG, "[%d] process_time %ld.%06ld\n", my_pid, process_time.tv_sec, process_time.tv_usec);
-    
-    evutil_timersub(&diff_time, &process_time, &tv);    //the timer time
 
-    //do NOT add shift_ts here since scheduling timer event might be
-    //way before the actual query. shift_ts is computed by using the
-    //time difference for the actual query. So, adding shift_ts might
-    //not be correct, although we need a method to catch up queries.
-    //evutil_timeradd(&tv, &shift_ts, &tv);             //time shift; this may not work
+    //do NOT add shift_ts here since scheduling the query might be way
+    //before the actual query. shift_ts is computed by using the time
+    //difference for the actual query.
     
-    if (non_wait || tv.tv_sec < 0) { //send the query immediately
-      //tv.tv_sec = 0;
-      //tv.tv_usec = 0;
+    if (evutil_timerisset(&start_real_ts) &&
+	(non_wait || (!evutil_timercmp(&due, &now_ts, >) && !pending_overdue(&now_ts)))) { //send the query immediately
       LOG(LOG_DBG, "[%d] time<0 => send the query[%lld] now\n", my_pid, num_query);
-      send_query((void *)msg, num_query);
+      send_query((void *)(new trace_replay::DNSMsg(*msg)), num_query);
+      grant_credit();
       num_notimer += 1;
       continue;
     }
-    
-    cb_arg_t *ctx = new cb_arg_t; //we need to delete this after query is sent in callback function
-    ctx->obj = (void *)this;
-    ctx->a = (void *)msg;
-    ctx->c = num_query;
-    
-    LOG(LOG_DBG, "[%d] set up a timer event in %ld.%06ld s for query [%llu]\n", my_pid, tv.tv_sec, tv.tv_usec, num_query);
-
-    struct event *ev = evtimer_new(base, &DNSClient::send_query_helper, (void *)ctx);
-    ctx->e = (void *)ev;
-    assert(ev != NULL);
 
-    //recheck timestamp
-    evutil_timerclear(&process_time);
-    evutil_timerclear(&tv);
-    recheck_now_ts(&now_ts);
-    evutil_timersub(&now_ts, &start_real_ts,  &process_time);
-    evutil_timersub(&diff_time, &process_time, &tv);
-    if (tv.tv_sec < 0) {//send the query immediately
-      event_free(ev);
-      delete ctx;
-      LOG(LOG_DBG, "[%d] time<0 => send the query[%lld] now\n", my_pid, num_query);
-      send_query((void *)msg, num_query);
-      num_notimer += 1;
+    if (msg->raw().size() > UINT16_MAX) {
+      LOG(LOG_ERR, "[%d] query of %lu bytes is too long, drop it\n", my_pid, msg->raw().size());
+      grant_credit();
       continue;
     }
+    uint16_t flags = (msg->tcp() ? PENDING_TCP : 0) | (msg->ipv4() ? PENDING_IPV4 : 0);
+    pending.push(q_ts, num_query, msg->src_ip(), flags, msg->raw());
+    if (pending.front().num == num_query) //due before the queries already queued
+      pending_schedule();
 
-    if (evtimer_add(ev, &tv) < 0) {
-      event_free(ev);
-      log_err("fail to add timer event");
-    }
     num_timer += 1;
     num_pending_event += 1;
     if (num_pending_event > num_pending_event_max)
       num_pending_event_max = num_pending_event;
   }
+  msg_buffer.erase(0, pos);
+}
+
+/*
+  replay starts at the given instant, microseconds since the epoch
+*/
+void DNSClient::set_start(int64_t us)
+{
+  start_real_ts.tv_sec = us / 1000000;
+  start_real_ts.tv_usec = us % 1000000;
+  struct timeval now_ts, lead = {0, 0};
+  recheck_now_ts(&now_ts);
+  if (evutil_timercmp(&start_real_ts, &now_ts, >))
+    evutil_timersub(&start_real_ts, &now_ts, &lead);
+  LOG(LOG_INFO, "[%d] replay starts in %ld.%06ld seconds with %lu queries waiting\n", my_pid,
+      (long)lead.tv_sec, (long)lead.tv_usec, pending.size());
+}
+
+/*
+  real time to send a query of the given trace time
+*/
+void DNSClient::pending_due(const struct timeval *q_ts, struct timeval *due)
+{
+  struct timeval diff_time = {0, 0};                    //time to trace start time
+  evutil_timersub(q_ts, &start_trace_ts, &diff_time);
+  evutil_timeradd(&start_real_ts, &diff_time, due);
+}
+
+/*
+  whether the first queued query is due; a query due now waits behind it
+*/
+bool DNSClient::pending_overdue(const struct timeval *now_ts)
+{
+  if (pending.empty())
+    return false;
+  struct timeval due;
+  pending_due(&pending.front().ts, &due);
+  return !evutil_timercmp(&due, now_ts, >);
+}
+
+/*
+  arm the pending timer for the queued query due first
+*/
+void DNSClient::pending_schedule()
+{
+  if (pending.empty() || !evutil_timerisset(&start_real_ts))
+    return;
+  struct timeval due, now_ts, tv = {0, 0};
+  pending_due(&pending.front().ts, &due);
+  recheck_now_ts(&now_ts);
+  if (evutil_timercmp(&due, &now_ts, >))
+    evutil_timersub(&due, &now_ts, &tv);
+  if (evtimer_add(pending_event, &tv) < 0)
+    log_err("fail to add pending timer");
+}
+
+/*
+  helper of pending_timer_cb
+*/
+void DNSClient::pending_timer_cb_helper(evutil_socket_t fd, short which, void *ctx)
+{
+  assert(which & EV_TIMEOUT);
+  (static_cast<DNSClient *>(ctx))->pending_timer_cb();
+}
+
+/*
+  send all queued queries that are due, then wait for the next one
+*/
+void DNSClient::pending_timer_cb()
+{
+  struct timeval due, now_ts;
+  recheck_now_ts(&now_ts);
+  while (!pending.empty()) {
+    const pending_rec_t &r = pending.front();
+    pending_due(&r.ts, &due);
+    if (evutil_timercmp(&due, &now_ts, >)) {
+      recheck_now_ts(&now_ts); //sending may have taken a while
+      if (evutil_timercmp(&due, &now_ts, >))
+	break;
+    }
+
+    //the send path still works on a message; it lives only until the
+    //query is on the wire
+    trace_replay::DNSMsg *msg = new trace_replay::DNSMsg();
+    assert(msg);
+    msg->set_seconds(r.ts.tv_sec);
+    msg->set_microseconds(r.ts.tv_usec);
+    msg->set_tcp(r.flags & PENDING_TCP);
+    msg->set_ipv4(r.flags & PENDING_IPV4);
+    msg->set_src_ip(pending.front_src());
+    msg->set_raw((const char *)pending.front_raw(), r.len);
+    long long unsigned int num = r.num;
+    pending.pop();
+    num_pending_event -= 1;
+    send_query((void *)msg, num);
+    grant_credit();
+  }
+  pending_schedule();
+}
+
+/*
+  replay sequence tag as 16 hex digits: run id, worker, counter
+*/
+static string seq_str(uint64_t seq)
+{
+  char b[17];
+  snprintf(b, sizeof(b), "%016llx", (unsigned long long)seq);
+  return b;
+}
+
+/*
+  add the next replay sequence number of this worker to a query as an
+  EDNS option: run id (16 bits), worker (16 bits) and counter (32 bits)
+*/
+uint64_t DNSClient::tag_query(string &q)
+{
+  seq_counter += 1;
+  uint64_t seq = ((uint64_t)(opt.seq_run & 0xFFFF) << 48) | ((uint64_t)(opt.worker_id & 0xFFFF) << 32) | seq_counter;
+  uint64_t be = htobe64(seq);
+  if (!add_edns_option(q, EDNS_SEQ_OPTION, string((const char *)&be, sizeof(be)))) {
+    LOG(LOG_DBG, "[%d] cannot add sequence tag to query\n", my_pid);
+    return 0;
+  }
+  return seq;
+}
+
+/*
+  remember when a query is sent so that its response can be matched
+*/
+query_rec_t *DNSClient::add_query_rec(string &key, int t, uint64_t seq)
+{
+  query_rec_t *qr = new query_rec_t;
+  assert(qr);
+  evutil_gettimeofday(&qr->ts, NULL);
+  evutil_timersub(&qr->ts, &cur_retry_lat, &qr->ts); //a tcp fallback starts with its udp query
+  evutil_timerclear(&qr->tx_ts);
+  qr->conn_wait = cur_conn_wait;
+  qr->target = t;
+  qr->seq = seq;
+  evutil_timerclear(&qr->write_ts);
+  evutil_timerclear(&qr->ready_ts);
+  qr->connect_us = qr->handshake_us = 0;
+  query_table[key] = qr;
+  return qr;
+}
+
+/*
+  wait for the response of a udp query, retry it when it does not come
+*/
+void DNSClient::udp_retry_add(const string &key, int tries)
+{
+  udp_retry_t r;
+  double ms = opt.udp_retry_ms * pow(opt.udp_backoff, tries);
+  struct timeval wait = {(long)(ms / 1000), (long)(fmod(ms, 1000.0) * 1000)};
+  evutil_gettimeofday(&r.due, NULL);
+  evutil_timeradd(&r.due, &wait, &r.due);
+  r.key = key;
+  r.tries = tries;
+  bool first = true;
+  for (auto &q : udp_retry_q)
+    if (!q.empty()) {
+      first = false;
+      break;
+    }
+  udp_retry_q[tries].push_back(r);
+  if (first)
+    udp_retry_schedule();
+}
+
+/*
+  arm the retry timer for the earliest query of all queues
+*/
+void DNSClient::udp_retry_schedule()
+{
+  struct timeval *due = NULL;
+  for (auto &q : udp_retry_q)
+    if (!q.empty() && (!due || evutil_timercmp(&q.front().due, due, <)))
+      due = &q.front().due;
+  if (!due)
+    return;
+  struct timeval now, tv = {0, 0};
+  evutil_gettimeofday(&now, NULL);
+  if (evutil_timercmp(due, &now, >))
+    evutil_timersub(due, &now, &tv);
+  if (evtimer_add(udp_retry_event, &tv) < 0)
+    log_err("fail to add udp retry timer");
+}
+
+/*
+  helper of udp_retry_cb
+*/
+void DNSClient::udp_retry_cb_helper(evutil_socket_t fd, short which, void *ctx)
+{
+  assert(which & EV_TIMEOUT);
+  (static_cast<DNSClient *>(ctx))->udp_retry_cb();
+}
+
+/*
+  retry the due queries that are still waiting for a response, or give
+  them up after the last retry
+*/
+void DNSClient::udp_retry_cb()
+{
+  struct timeval now;
+  evutil_gettimeofday(&now, NULL);
+  for (auto &q : udp_retry_q) {
+    while (!q.empty() && !evutil_timercmp(&q.front().due, &now, >)) {
+      udp_retry_t r = q.front();
+      q.pop_front();
+      auto it = query_table.find(r.key);
+      //answered, or the key now belongs to another query
+      if (it == query_table.end() || it->second->udp_fd < 0 || it->second->tries != r.tries)
+	continue;
+      query_rec_t *qr = it->second;
+      if (r.tries >= opt.udp_retries || !udp_retry_send(qr)) {
+	LOG(LOG_DBG, "[%d] no response for query %u, give up\n", my_pid, get_id((uint8_t *)qr->raw.data()));
+	add_stat(&replay_stats_t::udp_giveup, 1);
+	delete qr;
+	query_table.erase(it);
+	continue;
+      }
+      qr->tries += 1;
+      udp_retry_add(r.key, qr->tries);
+    }
+  }
+  udp_retry_schedule();
+}
+
+/*
+  send a query again on the socket of its first send, as a stub
+  resolver does. Return false if the socket is gone.
+*/
+bool DNSClient::udp_retry_send(query_rec_t *qr)
+{
+  int fd = qr->udp_fd;
+  if (!unified_fd2target.count(fd)) {
+    auto it = src2udpfd.find(qr->udp_src);
+    if (it == src2udpfd.end() || it->second != fd)
+      return false;
+  }
+  if (output_option & OUTPUT_TIMING)
+    record_message_time((uint8_t *)qr->raw.data(), qr->raw.size(), key_src(qr->udp_src));
+  add_stat(&replay_stats_t::udp_retries, 1);
+  if (send(fd, qr->raw.data(), qr->raw.size(), 0) == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+      err(1, "send fails");
+    add_stat(&replay_stats_t::udp_tx_drops, 1);
+    return true;
+  }
+  if (opt.kernel_ts)
+    udp_tx_seq[fd]++; //the timestamp of the first send is kept
+  return true;
+}
+
+/*
+  a udp response came: count it as answered at first try or after
+  retries. Without latency output nothing else needs the record.
+*/
+void DNSClient::udp_retry_done(const string &key)
+{
+  auto it = query_table.find(key);
+  if (it == query_table.end() || it->second->udp_fd < 0)
+    return;
+  add_stat(it->second->tries ? &replay_stats_t::udp_retry_ok : &replay_stats_t::udp_first_ok, 1);
+  if (!(output_option & OUTPUT_LATENCY)) {
+    delete it->second;
+    query_table.erase(it);
+  } else {
+    it->second->udp_fd = -1; //no more retries
+  }
+}
+
+/*
+  add tokens for the time passed since the last refill
+*/
+void DNSClient::conn_pace_refill()
+{
+  struct timeval now, diff;
+  evutil_gettimeofday(&now, NULL);
+  if (!evutil_timerisset(&conn_token_ts)) {
+    conn_tokens = opt.conn_burst;
+  } else {
+    evutil_timersub(&now, &conn_token_ts, &diff);
+    conn_tokens += (diff.tv_sec + diff.tv_usec / 1000000.0) * opt.conn_rate;
+    if (conn_tokens > opt.conn_burst)
+      conn_tokens = opt.conn_burst;
+  }
+  copy_ts(&conn_token_ts, &now);
+}
+
+/*
+  decide if the query may open a new connection now; otherwise keep it
+  in the wait queue (or drop it if the queue is full) and return false.
+  Queries of a source that is already waiting join that source.
+*/
+bool DNSClient::conn_pace_admit(void *arg, bool use_tls)
+{
+  trace_replay::DNSMsg *msg = (trace_replay::DNSMsg *)arg;
+  if (conn_token_held) { //granted by conn_pace_cb
+    conn_token_held = false;
+    return true;
+  }
+
+  auto it = conn_wait.find(msg->src_ip());
+  if (it == conn_wait.end()) {
+    conn_pace_refill();
+    if (conn_wait_src.empty() && conn_tokens >= 1.0) {
+      conn_tokens -= 1.0;
+      return true;
+    }
+  }
+
+  if (num_conn_wait >= (size_t)opt.conn_queue) {
+    LOG(LOG_DBG, "[%d] connection wait queue is full, drop query from %s\n", my_pid, msg->src_ip().c_str());
+    add_stat(&replay_stats_t::conn_dropped, 1);
+    delete msg;
+    return false;
+  }
+
+  conn_wait_t w;
+  w.msg = arg;
+  w.use_tls = use_tls;
+  evutil_gettimeofday(&w.ts, NULL);
+  w.retry_lat = cur_retry_lat;
+  if (it == conn_wait.end()) {
+    conn_wait_src.push_back(msg->src_ip());
+    conn_wait[msg->src_ip()].push_back(w);
+  } else {
+    it->second.push_back(w);
+  }
+  num_conn_wait += 1;
+  add_stat(&replay_stats_t::conn_paced, 1);
+  conn_pace_schedule();
+  return false;
+}
+
+/*
+  arm the pacing timer for the next token
+*/
+void DNSClient::conn_pace_schedule()
+{
+  if (conn_wait_src.empty() || evtimer_pending(conn_pace_event, NULL))
+    return;
+  double wait = (conn_tokens >= 1.0) ? 0.0 : (1.0 - conn_tokens) / opt.conn_rate;
+  struct timeval tv = {(time_t)wait, (suseconds_t)((wait - (time_t)wait) * 1000000)};
+  if (evtimer_add(conn_pace_event, &tv) < 0)
+    log_err("fail to add connection pacing timer");
+}
+
+void DNSClient::conn_pace_cb_helper(evutil_socket_t fd, short which, void *ctx)
+{
+  (static_cast<DNSClient *>(ctx))->conn_pace_cb();
+}
+
+/*
+  open connections for waiting sources while there are tokens; queries
+  behind the first one of a source reuse its new connection
+*/
+void DNSClient::conn_pace_cb()
+{
+  conn_pace_refill();
+  while (!conn_wait_src.empty() && conn_tokens >= 1.0) {
+    string ip = conn_wait_src.front();
+    conn_wait_src.pop_front();
+    vector<conn_wait_t> v;
+    v.swap(conn_wait[ip]);
+    conn_wait.erase(ip);
+    conn_tokens -= 1.0;
+
+    struct timeval now;
+    evutil_gettimeofday(&now, NULL);
+    for (unsigned int i = 0; i < v.size(); i++) {
+      num_conn_wait -= 1;
+      evutil_timersub(&now, &v[i].ts, &cur_conn_wait);
+      add_stat(&replay_stats_t::conn_wait_us, cur_conn_wait.tv_sec * 1000000ULL + cur_conn_wait.tv_usec);
+      //the first query takes the token, unless an earlier query of
+      //this source connected in the meantime
+      conn_token_held = (i == 0 && src2bev.find(ip) == src2bev.end());
+      cur_retry_lat = v[i].retry_lat;
+      send_query_tcp(v[i].msg, v[i].use_tls);
+      conn_token_held = false;
+    }
+    evutil_timerclear(&cur_conn_wait);
+    evutil_timerclear(&cur_retry_lat);
+  }
+  conn_pace_schedule();
+}
+
+/*
+  keep track of a new server connection and start reading from it
+*/
+void DNSClient::register_server_bev(struct bufferevent *bev, string &ip)
+{
+  src2bev.insert(make_pair(ip, bev)); //insert to map
+  bev2src.insert(make_pair(bev, ip)); //insert to map
+  server_msg_buffer.insert(make_pair(bev, ""));
+
+  if (time_out > 0) {
+    struct timeval read_to = {time_out, 0}; //setup timeout
+    LOG(LOG_DBG, "[%d] set read timeout %ld.%06ld\n", my_pid, read_to.tv_sec, read_to.tv_usec);
+    bufferevent_set_timeouts(bev, &read_to, NULL);
+  } else { //no time out when <= 0
+    LOG(LOG_DBG, "[%d] NOT set read timeout\n", my_pid);
+  }
+  
+  bufferevent_setcb(bev, &DNSClient::server_read_cb_helper, NULL, &DNSClient::server_event_cb_helper, this);
+  bufferevent_enable(bev, EV_READ|EV_WRITE);
+
+  //follow the connection and the queries written to it
+  if (opt.conn_detail) {
+    conn_rec_t &c = bev2conn[bev];
+    evutil_gettimeofday(&c.start, NULL);
+    cb_arg_t *arg = new cb_arg_t;
+    arg->obj = (void *)this;
+    arg->a = (void *)bev;
+    c.cb_arg = arg;
+    evbuffer_add_cb(bufferevent_get_output(bev), &DNSClient::conn_output_cb_helper, arg);
+  }
+}
+
+/*
+  a query of len bytes is given to a connection: remember where it ends
+  in the output so that we see when it is written
+*/
+void DNSClient::conn_note_write(struct bufferevent *bev, size_t len, const string &key)
+{
+  auto it = bev2conn.find(bev);
+  if (it == bev2conn.end())
+    return;
+  conn_rec_t &c = it->second;
+  c.queries += 1;
+  c.appended += len;
+  if (!key.empty())
+    c.unwritten.push_back(make_pair(c.appended, key));
+}
+
+void DNSClient::conn_output_cb_helper(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *ctx)
+{
+  if (info->n_deleted == 0)
+    return;
+  cb_arg_t *arg = (cb_arg_t *)ctx;
+  (static_cast<DNSClient *>(arg->obj))->conn_output_cb((struct bufferevent *)arg->a, info->n_deleted);
+}
+
+/*
+  bytes were written to the connection: the queries that are now fully
+  written get their write time and the split of their wait for the
+  connection setup
+*/
+void DNSClient::conn_output_cb(struct bufferevent *bev, size_t n)
+{
+  auto cit = bev2conn.find(bev);
+  if (cit == bev2conn.end())
+    return;
+  conn_rec_t &c = cit->second;
+  c.written += n;
+
+  struct timeval now;
+  evutil_gettimeofday(&now, NULL);
+  //data goes out only on a ready connection, even if its event
+  //callback has not run yet
+  if (!evutil_timerisset(&c.connected))
+    c.connected = now;
+  if (!evutil_timerisset(&c.ready))
+    c.ready = now;
+
+  while (!c.unwritten.empty() && c.unwritten.front().first <= c.written) {
+    auto qit = query_table.find(c.unwritten.front().second);
+    c.unwritten.pop_front();
+    if (qit == query_table.end())
+      continue;
+    query_rec_t *qr = qit->second;
+    struct timeval d;
+    qr->write_ts = now;
+    qr->connect_us = qr->handshake_us = 0;
+    if (evutil_timercmp(&c.connected, &qr->ts, >)) {
+      evutil_timersub(&c.connected, &qr->ts, &d);
+      qr->connect_us = d.tv_sec * 1000000ULL + d.tv_usec;
+    }
+    struct timeval hs_start = evutil_timercmp(&c.connected, &qr->ts, >) ? c.connected : qr->ts;
+    if (evutil_timercmp(&c.ready, &hs_start, >)) {
+      evutil_timersub(&c.ready, &hs_start, &d);
+      qr->handshake_us = d.tv_sec * 1000000ULL + d.tv_usec;
+    }
+    qr->ready_ts = evutil_timercmp(&c.ready, &qr->ts, >) ? c.ready : qr->ts;
+  }
+}
+
+/*
+  write one line with the events of a closing connection
+*/
+void DNSClient::conn_close(struct bufferevent *bev, const char *reason)
+{
+  auto it = bev2conn.find(bev);
+  if (it == bev2conn.end())
+    return;
+  conn_rec_t &c = it->second;
+  evbuffer_remove_cb(bufferevent_get_output(bev), &DNSClient::conn_output_cb_helper, c.cb_arg);
+  delete (cb_arg_t *)c.cb_arg;
+
+  struct timeval now, d;
+  evutil_gettimeofday(&now, NULL);
+  auto us = [&d](const struct timeval &a, const struct timeval &b) -> long long {
+    if (!evutil_timerisset(&a) || !evutil_timerisset(&b))
+      return -1;
+    evutil_timersub(&a, &b, &d);
+    return d.tv_sec * 1000000LL + d.tv_usec;
+  };
+  string ip = bev2src.count(bev) ? bev2src[bev] : "0";
+  string tmp = "#conn " + to_string(my_pid) + " " + to_string(now.tv_sec) + " src=" + key_src(ip);
+  tmp += " server=" + targets[key_target(ip)].name;
+  tmp += " connect_us=" + to_string(us(c.connected, c.start));
+  tmp += " handshake_us=" + to_string(us(c.ready, c.connected));
+  tmp += " duration_us=" + to_string(us(now, c.start));
+  tmp += " queries=" + to_string(c.queries) + " close=" + reason + "\n";
+  if (output_option != OUTPUT_NONE) {
+    if (bufferevent_write(manager_bev, tmp.data(), tmp.size()) == -1)
+      log_err("conn_close: bufferevent_write fails");
+  } else {
+    LOG(LOG_DBG, "[%d] %s", my_pid, tmp.c_str());
+  }
+  bev2conn.erase(it);
+}
+
+/*
+  queue a tls query until a helper has a session for its source; the
+  first query of a source submits the handshake. Time already spent
+  waiting for a paced connection is carried over.
+*/
+void DNSClient::tls_offload_wait(void *arg)
+{
+  trace_replay::DNSMsg *msg = (trace_replay::DNSMsg *)arg;
+  string ip = msg->src_ip();
+  conn_wait_t w;
+  w.msg = arg;
+  w.use_tls = true;
+  evutil_gettimeofday(&w.ts, NULL);
+  evutil_timersub(&w.ts, &cur_conn_wait, &w.ts);
+  evutil_timerclear(&w.retry_lat);
+
+  auto it = tls_wait.find(ip);
+  if (it != tls_wait.end()) {
+    it->second.push_back(w);
+    return;
+  }
+  tls_wait[ip].push_back(w);
+  tls_pool->submit(ip, targets[key_target(ip)].addr);
+  add_stat(&replay_stats_t::conn_new, 1);
+}
+
+void DNSClient::tls_pool_cb_helper(evutil_socket_t fd, short which, void *ctx)
+{
+  (static_cast<DNSClient *>(ctx))->tls_pool_cb(fd);
 }
 
 /*
-  helper of send_query
+  collect finished handshakes: wrap each session in a bufferevent and
+  send the queries that waited for it
 */
-void DNSClient::send_query_helper(evutil_socket_t fd, short which, void *ctx)
+void DNSClient::tls_pool_cb(evutil_socket_t fd)
 {
-  assert(which & EV_TIMEOUT);
-  cb_arg_t *arg = (cb_arg_t *)ctx;
-  struct event *ev = (struct event *)(arg->e);
-  event_free(ev); //free this timer event, release memory
-  (static_cast<DNSClient *>(arg->obj))->num_pending_event -= 1;
-  (static_cast<DNSClient *>(arg->obj))->send_query(arg->a, arg->c);
-  delete arg;
+  uint64_t n = 0;
+  if (read(fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+    log_err("read tls handshake pool notification");
+
+  tls_job_t job;
+  while (tls_pool->get_result(job)) {
+    vector<conn_wait_t> v;
+    auto it = tls_wait.find(job.src_ip);
+    if (it != tls_wait.end()) {
+      v.swap(it->second);
+      tls_wait.erase(it);
+    }
+
+    if (!job.ok) {
+      add_stat(&replay_stats_t::tls_failed, 1);
+      LOG(LOG_DBG, "[%d] tls handshake for %s fails, drop %lu queries\n", my_pid, job.src_ip.c_str(), v.size());
+      for (conn_wait_t &w : v)
+	delete (trace_replay::DNSMsg *)w.msg;
+      continue;
+    }
+
+    struct timeval connect_tv, handshake_tv;
+    evutil_timersub(&job.connected, &job.start, &connect_tv);
+    evutil_timersub(&job.done, &job.connected, &handshake_tv);
+    add_stat(&replay_stats_t::tls_done, 1);
+    add_stat(&replay_stats_t::tls_connect_us, connect_tv.tv_sec * 1000000ULL + connect_tv.tv_usec);
+    add_stat(&replay_stats_t::tls_handshake_us, handshake_tv.tv_sec * 1000000ULL + handshake_tv.tv_usec);
+
+    struct bufferevent *bev = NULL;
+    if (job.ktls) {
+      //the kernel encrypts and decrypts: free the session without a
+      //shutdown (the socket stays open) and use a plain bufferevent
+      SSL_free(job.ssl);
+      bev = bufferevent_socket_new(base, job.fd, BEV_OPT_CLOSE_ON_FREE);
+      add_stat(&replay_stats_t::ktls_on, 1);
+    } else {
+      bev = bufferevent_openssl_socket_new(base, job.fd, job.ssl, BUFFEREVENT_SSL_OPEN,
+					   BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS);
+      if (opt.ktls)
+	add_stat(&replay_stats_t::ktls_fallback, 1);
+    }
+    assert(bev);
+    register_server_bev(bev, job.src_ip);
+    if (bev2conn.count(bev)) {
+      conn_rec_t &c = bev2conn[bev];
+      c.start = job.start;
+      c.connected = job.connected;
+      c.ready = job.done;
+    }
+
+    struct timeval now;
+    evutil_gettimeofday(&now, NULL);
+    for (conn_wait_t &w : v) {
+      evutil_timersub(&now, &w.ts, &cur_conn_wait);
+      send_query_tcp(w.msg, true);
+    }
+    evutil_timerclear(&cur_conn_wait);
+  }
 }
 
 /*
@@ -474,6 +1238,24 @@ void DNSClient::send_query_tcp(void *arg, bool use_tls)
   log_dbg(log_msg.c_str());
   
   trace_replay::DNSMsg *msg = (trace_replay::DNSMsg *)arg;
+
+  //a handshake of this source is already with a helper: the query waits
+  //for its session, without a token of its own
+  if (use_tls && tls_pool && tls_wait.count(msg->src_ip())) {
+    tls_offload_wait(arg);
+    return;
+  }
+
+  //a new connection is needed: wait for a token if connections are paced
+  if (opt.conn_rate > 0 && src2bev.find(msg->src_ip()) == src2bev.end() &&
+      !conn_pace_admit(arg, use_tls))
+    return;
+
+  //the tls handshake is done by a helper thread: wait for the session
+  if (use_tls && tls_pool && src2bev.find(msg->src_ip()) == src2bev.end()) {
+    tls_offload_wait(arg);
+    return;
+  }
   
   uint16_t raw_len = msg->raw().size();
   uint8_t *raw = new uint8_t[raw_len];
@@ -485,10 +1267,11 @@ void DNSClient::send_query_tcp(void *arg, bool use_tls)
     return;
   }
 
-  string qname = get_query_rr_str(raw, raw_len);
-  if (qname.length() == 0) {
+  dns_hdr_t qh = dns_hdr_t(); //left zero by a query shorter than a header
+  bool has_q = parse_dns_hdr(raw, raw_len, &qh) && qh.qend > 0 && qh.qdcount > 0;
+  if (!has_q) {
     LOG(LOG_ERR, "[%d] [NOQNAME]\n", my_pid);
-    //If qname is empty, it is probably because the packet is
+    //If there is no question, it is probably because the packet is
     //malformed.  But we should still send it anyway; we do not put it
     //in the record for matching responses
     /*delete[] raw;
@@ -501,12 +1284,23 @@ void DNSClient::send_query_tcp(void *arg, bool use_tls)
   //existing one
   do {
     set_random_id(raw);
-    key = to_string(get_id(raw)) + " " + qname;
-  } while(query_table.find(key) != query_table.end());
-
-  key = fmt_str(key, " ");
-
-  LOG(LOG_DBG, "[%d] get key: %s\n", my_pid, key.c_str());
+    if (has_q)
+      key = msg_key(raw, &qh);
+  } while(has_q && query_table.find(key) != query_table.end());
+
+  if (has_q)
+    LOG(LOG_DBG, "[%d] get key: %u %s\n", my_pid, get_id(raw), question_str(raw, raw_len, &qh).c_str());
+
+  //tag the query with the replay sequence number
+  uint64_t seq = 0;
+  if (opt.seq_run >= 0) {
+    string q((const char *)raw, raw_len);
+    seq = tag_query(q);
+    delete[] raw;
+    raw_len = q.size();
+    raw = new uint8_t[raw_len];
+    memcpy(raw, q.data(), raw_len);
+  }
 
   //append the length at the beginning to make a tcp payload
   uint16_t tcp_raw_len = raw_len + sizeof(uint16_t);
@@ -530,16 +1324,15 @@ void DNSClient::send_query_tcp(void *arg, bool use_tls)
     LOG(LOG_DBG, "[%d] found fd [%d] for %s\n", my_pid, fd, msg->src_ip().c_str());
 
     //log query timing
-    if (qname.length() != 0 && (output_option & OUTPUT_LATENCY)) {
-      struct timeval *qt = new struct timeval;
-      evutil_gettimeofday(qt, NULL);
-      query_table[key] = qt;
-    }
+    if (has_q && (output_option & OUTPUT_LATENCY))
+      add_query_rec(key, key_target(ip), seq);
     
     //log timing
     if (output_option & OUTPUT_TIMING)
-      record_message_time(tcp_raw+2, tcp_raw_len-2, ip);
+      record_message_time(tcp_raw+2, tcp_raw_len-2, key_src(ip));
     
+    if (opt.conn_detail)
+      conn_note_write(bev, tcp_raw_len, (has_q && (output_option & OUTPUT_LATENCY)) ? key : "");
     if (bufferevent_write(bev, tcp_raw, tcp_raw_len) == -1) {
       log_err("send_query_tcp: bufferevent_write fails");
     }
@@ -550,14 +1343,11 @@ void DNSClient::send_query_tcp(void *arg, bool use_tls)
 
   //log query timing, we should log the query time HERE since we want
   //to include the tcp handshake time
-  if (qname.length() != 0 && (output_option & OUTPUT_LATENCY)) {
-    struct timeval *qt = new struct timeval;
-    evutil_gettimeofday(qt, NULL);
-    query_table[key] = qt;
-  }
+  if (has_q && (output_option & OUTPUT_LATENCY))
+    add_query_rec(key, key_target(ip), seq);
   //log timing
   if (output_option & OUTPUT_TIMING)
-    record_message_time(tcp_raw+2, tcp_raw_len-2, ip);
+    record_message_time(tcp_raw+2, tcp_raw_len-2, key_src(ip));
   
   //not found, create one
   if (use_tls) {
@@ -569,14 +1359,10 @@ void DNSClient::send_query_tcp(void *arg, bool use_tls)
     bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);//new bufferevent
   }
   assert(bev);
-  src2bev.insert(make_pair(ip, bev)); //insert to map
-  bev2src.insert(make_pair(bev, ip)); //insert to map
-  server_msg_buffer.insert(make_pair(bev, ""));
+  add_stat(&replay_stats_t::conn_new, 1);
   
-  if (bufferevent_socket_connect(bev, (struct sockaddr *)&server_addr, sizeof(server_addr))<0) {
-    src2bev.erase(ip);
-    bev2src.erase(bev);
-    server_msg_buffer.erase(bev);
+  struct sockaddr_in *addr = &targets[key_target(ip)].addr;
+  if (bufferevent_socket_connect(bev, (struct sockaddr *)addr, sizeof(*addr))<0) {
     bufferevent_free(bev);
     log_err("bufferevent_socket_connect fails");
   }
@@ -594,22 +1380,15 @@ void DNSClient::send_query_tcp(void *arg, bool use_tls)
     LOG(LOG_DBG, "[%d] %s nagle for fd[%d]\n", my_pid, nagle_option.c_str(), nagle_fd);
   }
 
-  if (time_out > 0) {
-    struct timeval read_to = {time_out, 0}; //setup timeout
-    LOG(LOG_DBG, "[%d] set read timeout %ld.%06ld\n", my_pid, read_to.tv_sec, read_to.tv_usec);
-    bufferevent_set_timeouts(bev, &read_to, NULL);
-  } else { //no time out when <= 0
-    LOG(LOG_DBG, "[%d] NOT set read timeout\n", my_pid);
-  }
-  
-  bufferevent_setcb(bev, &DNSClient::server_read_cb_helper, NULL, &DNSClient::server_event_cb_helper, this);
-  bufferevent_enable(bev, EV_READ|EV_WRITE);
+  register_server_bev(bev, ip);
 
   log_msg = "bufferevent write, send to server via ";
   log_msg += use_tls ? "TLS":"TCP";
   log_dbg(log_msg.c_str());
 
   //this will work even if before connected
+  if (opt.conn_detail)
+    conn_note_write(bev, tcp_raw_len, (has_q && (output_option & OUTPUT_LATENCY)) ? key : "");
   if (bufferevent_write(bev, tcp_raw, tcp_raw_len) == -1) { //where to bufferevent_write?
     log_err("send_query_tcp_2: bufferevent_write fails");
   }
@@ -626,14 +1405,15 @@ void DNSClient::server_udp_write_cb_helper(evutil_socket_t fd, short what, void
   struct event *ev = (struct event *)(arg->e);
   event_free(ev); //free the memory
   assert(what & EV_WRITE);
-  (static_cast<DNSClient *>(arg->obj))->server_udp_write_cb(fd, arg->a);
+  (static_cast<DNSClient *>(arg->obj))->server_udp_write_cb(fd, arg->a, arg->key);
   delete arg;
 }
 
 /*
-  server udp write callback
+  server udp write callback; key is the query record that takes the
+  send timestamp, empty if none does
 */
-void DNSClient::server_udp_write_cb(evutil_socket_t fd, void *ctx)
+void DNSClient::server_udp_write_cb(evutil_socket_t fd, void *ctx, const string &key)
 {
   // cb_arg_t *arg = (cb_arg_t *)ctx;
   // struct event *ev = (struct event *)(arg->e);
@@ -643,9 +1423,26 @@ void DNSClient::server_udp_write_cb(evutil_socket_t fd, void *ctx)
   LOG(LOG_DBG, "[%d] send to server by udp fd [%d]\n", my_pid, fd);
   trace_replay::DNSMsg *msg = (trace_replay::DNSMsg *)ctx;
   if (output_option & OUTPUT_TIMING)
-    record_message_time((uint8_t *)msg->raw().data(), msg->raw().size(), (udpfd2src.count(fd) ? udpfd2src[fd]:"0"));
-  if (send(fd, msg->raw().data(), msg->raw().size(), 0) == -1)
-    err(1, "send fails");
+    record_message_time((uint8_t *)msg->raw().data(), msg->raw().size(), (udpfd2src.count(fd) ? key_src(udpfd2src[fd]):"0"));
+  if (send(fd, msg->raw().data(), msg->raw().size(), 0) == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+      err(1, "send fails");
+    //full send buffer or device queue: lost here, not by the server
+    add_stat(&replay_stats_t::udp_tx_drops, 1);
+    delete msg;
+    return;
+  }
+
+  //remember which query gets the next send timestamp of this socket
+  if (opt.kernel_ts) {
+    uint32_t seq = udp_tx_seq[fd]++;
+    if (!key.empty()) {
+      auto &keys = udp_tx_keys[fd];
+      if (keys.size() >= MAX_TX_TS_WAIT) //timestamps do not come
+	keys.pop_front();
+      keys.push_back(make_pair(seq, key));
+    }
+  }
   delete msg; //query has been set, let's clean data
   //delete arg;
 }
@@ -681,6 +1478,9 @@ void DNSClient::server_udp_read_timeout_cb(evutil_socket_t fd)
   event_free(udp_read_event[fd]);
   close(fd);
   udp_read_event.erase(fd);
+  udp_tx_seq.erase(fd);
+  udp_tx_keys.erase(fd);
+  udp_ovfl.erase(fd);
   if (udpfd2src.find(fd) == udpfd2src.end()) {
     LOG(LOG_ERR, "[%d] error: fd=%d is not in udpfd2src map", my_pid, fd);
     return;
@@ -696,22 +1496,174 @@ void DNSClient::server_udp_read_timeout_cb(evutil_socket_t fd)
 void DNSClient::server_udp_read_cb(evutil_socket_t fd)
 {
   LOG(LOG_DBG, "[%d] receive from server by udp fd [%d]\n", my_pid, fd);
-  uint8_t *buf = new uint8_t[MAX_BUF_SIZE];//to delete after sending
-  assert(buf);
-  memset(buf, 0, MAX_BUF_SIZE);
+  uint8_t buf[MAX_BUF_SIZE];
   int b = -1;
-  b = recv(fd, buf, MAX_BUF_SIZE, 0);
-  if (b == -1)
+  if (opt.kernel_ts)
+    read_tx_ts(fd); //send timestamps also wake up the read event
+  b = recv_udp(fd, buf, MAX_BUF_SIZE);
+  if (b == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return;
     log_err("recv");
+  }
 
-  //xxx: only deal with latency for now
-  if (output_option & OUTPUT_LATENCY) {
-    sendto_manager(buf, b);
+  string ip = "0";
+  if (udpfd2src.count(fd)) {
+    ip = udpfd2src[fd];
+  } else if (unified_fd2target.count(fd)) { //unified socket of a target
+    ip = conn_key("0", unified_fd2target[fd]);
+  }
+  process_response(buf, b, ip, true);
+  evutil_timerclear(&cur_rx_ts);
+}
+
+/*
+  options of a new udp socket: drop counter, buffer sizes and kernel
+  timestamps. Buffers are sized from the expected rate only for
+  unified sockets, which carry a share of all queries of the worker.
+*/
+void DNSClient::setup_udp_socket(int fd, bool unified)
+{
+  int on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+    LOG(LOG_DBG, "[%d] cannot set SO_RXQ_OVFL on fd [%d]\n", my_pid, fd);
+
+  int rcvbuf = opt.udp_rcvbuf, sndbuf = opt.udp_sndbuf;
+  if (unified && opt.expected_qps > 0) {
+    double qps = (double)opt.expected_qps / (targets.size() * opt.udp_pool);
+    if (rcvbuf == 0)
+      rcvbuf = qps * UDP_RCV_TRUESIZE * UDP_BUF_SECONDS;
+    if (sndbuf == 0)
+      sndbuf = qps * UDP_SND_TRUESIZE * UDP_BUF_SECONDS;
+  }
+  if (rcvbuf > 0)
+    set_sock_buf(fd, SO_RCVBUF, rcvbuf);
+  if (sndbuf > 0)
+    set_sock_buf(fd, SO_SNDBUF, sndbuf);
+
+  if (opt.kernel_ts)
+    enable_kernel_ts(fd);
+}
+
+/*
+  set a socket buffer size, beyond net.core.[rw]mem_max if we are
+  allowed to; never shrink the default
+*/
+void DNSClient::set_sock_buf(int fd, int which, int size)
+{
+  int cur = 0;
+  socklen_t len = sizeof(cur);
+  getsockopt(fd, SOL_SOCKET, which, &cur, &len);
+  if (cur >= size) //the limit in use, twice the size set last
     return;
+  int force = (which == SO_RCVBUF ? SO_RCVBUFFORCE : SO_SNDBUFFORCE);
+  if (setsockopt(fd, SOL_SOCKET, force, &size, sizeof(size)) < 0 &&
+      setsockopt(fd, SOL_SOCKET, which, &size, sizeof(size)) < 0)
+    log_err("fail to set udp socket buffer");
+  getsockopt(fd, SOL_SOCKET, which, &cur, &len);
+  if (cur < size)
+    LOG(LOG_WARN, "[%d] [warn] udp %s buffer is %d bytes, not %d; raise net.core.%s\n", my_pid,
+	which == SO_RCVBUF ? "receive" : "send", cur, size, which == SO_RCVBUF ? "rmem_max" : "wmem_max");
+}
+
+/*
+  ask the kernel for software send and receive timestamps on a udp
+  socket; send timestamps carry the socket's send counter
+*/
+void DNSClient::enable_kernel_ts(int fd)
+{
+  int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+    SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID;
+#ifdef SOF_TIMESTAMPING_OPT_TSONLY
+  flags |= SOF_TIMESTAMPING_OPT_TSONLY;
+#endif
+  if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    log_err("fail to set SO_TIMESTAMPING");
+}
+
+/*
+  read the send timestamps from the socket error queue and put them in
+  the records of their queries
+*/
+void DNSClient::read_tx_ts(evutil_socket_t fd)
+{
+  auto kit = udp_tx_keys.find(fd);
+  char ctrl[512];
+  while (true) {
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_control = ctrl;
+    mh.msg_controllen = sizeof(ctrl);
+    if (recvmsg(fd, &mh, MSG_ERRQUEUE) == -1)
+      break;
+
+    struct timeval ts = {0, 0};
+    bool has_id = false;
+    uint32_t id = 0;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c != NULL; c = CMSG_NXTHDR(&mh, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_TIMESTAMPING) {
+	struct scm_timestamping *t = (struct scm_timestamping *)CMSG_DATA(c);
+	ts.tv_sec = t->ts[0].tv_sec;
+	ts.tv_usec = t->ts[0].tv_nsec / 1000;
+      } else if ((c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) ||
+		 (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR)) {
+	struct sock_extended_err *e = (struct sock_extended_err *)CMSG_DATA(c);
+	if (e->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+	  id = e->ee_data;
+	  has_id = true;
+	}
+      }
+    }
+    if (!has_id || !evutil_timerisset(&ts) || kit == udp_tx_keys.end())
+      continue;
+
+    //timestamps come in send order; queries without one are skipped
+    auto &keys = kit->second;
+    while (!keys.empty() && (int32_t)(keys.front().first - id) < 0)
+      keys.pop_front();
+    if (keys.empty() || keys.front().first != id)
+      continue;
+    auto it = query_table.find(keys.front().second);
+    if (it != query_table.end())
+      it->second->tx_ts = ts;
+    keys.pop_front();
   }
-  if (output_option & OUTPUT_TIMING)
-    record_message_time(buf, b, (udpfd2src.count(fd) ? udpfd2src[fd] : "0"));
-  delete[] buf;
+}
+
+/*
+  receive one datagram; keep its kernel receive time in cur_rx_ts and
+  count the datagrams the socket dropped since the last one
+*/
+int DNSClient::recv_udp(evutil_socket_t fd, uint8_t *buf, size_t len)
+{
+  char ctrl[512];
+  struct iovec iov = {buf, len};
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctrl;
+  mh.msg_controllen = sizeof(ctrl);
+  int b = recvmsg(fd, &mh, 0);
+  if (b == -1)
+    return b;
+
+  evutil_timerclear(&cur_rx_ts);
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c != NULL; c = CMSG_NXTHDR(&mh, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_TIMESTAMPING) {
+      struct scm_timestamping *t = (struct scm_timestamping *)CMSG_DATA(c);
+      cur_rx_ts.tv_sec = t->ts[0].tv_sec;
+      cur_rx_ts.tv_usec = t->ts[0].tv_nsec / 1000;
+    } else if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t drops = 0;
+      memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+      uint32_t &last = udp_ovfl[fd];
+      if (drops != last)
+	add_stat(&replay_stats_t::udp_rx_drops, (uint32_t)(drops - last));
+      last = drops;
+    }
+  }
+  return b;
 }
 
 /*
@@ -732,10 +1684,11 @@ void DNSClient::send_query_udp(void *arg)
     return;
   }
 
-  string qname = get_query_rr_str(raw, raw_len);
-  if (qname.length() == 0) {
+  dns_hdr_t qh = dns_hdr_t(); //left zero by a query shorter than a header
+  bool has_q = parse_dns_hdr(raw, raw_len, &qh) && qh.qend > 0 && qh.qdcount > 0;
+  if (!has_q) {
     LOG(LOG_ERR, "[%d] [NOQNAME]\n", my_pid);
-    //if qname empty, it is probably because the packet is
+    //if there is no question, it is probably because the packet is
     //malformed. But we should still send it anyway; we do not put it
     //in the record for matching responses.
     /*delete[] raw;
@@ -748,15 +1701,19 @@ void DNSClient::send_query_udp(void *arg)
   //existing one
   do {
     set_random_id(raw);
-    key = to_string(get_id(raw)) + " " + qname;
-  } while(query_table.find(key) != query_table.end());
-
-  key = fmt_str(key, " ");
+    if (has_q)
+      key = msg_key(raw, &qh);
+  } while(has_q && query_table.find(key) != query_table.end());
   //DBG("key: [%s]\n", key.c_str());
   //update raw data since we updated dns id
   msg->set_raw((const char *)raw, (int)raw_len);
   delete[] raw;
 
+  //tag the query with the replay sequence number
+  uint64_t seq = 0;
+  if (opt.seq_run >= 0)
+    seq = tag_query(*msg->mutable_raw());
+
   //print_dns_pkt(raw, raw_len);
 
   //get udp socket
@@ -768,7 +1725,7 @@ void DNSClient::send_query_udp(void *arg)
 
   if (socket_unify & SOCKET_UNIFY_UDP) { //unified udp sockets
     //set fd and later a write event
-    fd = unified_udp_fd;
+    fd = pick_udp_fd(key_target(ip), key_src(ip));
     log_dbg("unified udp sockets: set fd");
   } else if (src2udpfd.find(ip) != src2udpfd.end()) {//not unified and found
     fd = src2udpfd[ip];
@@ -786,10 +1743,12 @@ void DNSClient::send_query_udp(void *arg)
     //socket sockfd is of type SOCK_DGRAM, then addr is the address to
     //which datagrams are sent by default, and the only address from
     //which datagrams are received. => no connection -> no block?
-    if (connect (fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    struct sockaddr_in *addr = &targets[key_target(ip)].addr;
+    if (connect (fd, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
       cerr << "error: connect fails:" << errno << endl;
       log_err("failed to connect for new UDP socket");
     }
+    setup_udp_socket(fd, false);
     src2udpfd.insert(make_pair(ip, fd));
     udpfd2src.insert(make_pair(fd, ip));
     if (num_udp_fd_max < src2udpfd.size()) {
@@ -811,11 +1770,16 @@ void DNSClient::send_query_udp(void *arg)
     udp_read_event[fd] = server_read_ev;
   }
 
-  //log query timing
-  if (qname.length() != 0 && (output_option & OUTPUT_LATENCY)) {
-    struct timeval *qt = new struct timeval;
-    evutil_gettimeofday(qt, NULL);
-    query_table[key] = qt;
+  //log query timing; retried queries need the record as well
+  if (has_q && ((output_option & OUTPUT_LATENCY) || opt.udp_retry_ms > 0)) {
+    query_rec_t *qr = add_query_rec(key, key_target(ip), seq);
+    if (opt.udp_retry_ms > 0) {
+      qr->udp_fd = fd;
+      qr->udp_src = ip;
+      qr->raw = msg->raw();
+      add_stat(&replay_stats_t::udp_sent, 1);
+      udp_retry_add(key, 0);
+    }
   }
 
   //Need to log time in server_udp_write_cb
@@ -827,6 +1791,8 @@ void DNSClient::send_query_udp(void *arg)
   cb_arg_t *ctx = new cb_arg_t; // we need to delete this after query is sent in callback function
   ctx->a = arg;
   ctx->obj = (void *)this;
+  if (opt.kernel_ts && has_q && (output_option & OUTPUT_LATENCY))
+    ctx->key = key; //the key of the query record, not parsed again
   server_write_ev = event_new(base, fd, EV_WRITE, &DNSClient::server_udp_write_cb_helper, (void *)ctx);
   ctx->e = (void *)server_write_ev;
   assert(server_write_ev != NULL);
@@ -858,6 +1824,16 @@ void DNSClient::send_query(void *arg, long long unsigned int ct)
   LOG(LOG_DBG, "[%d] diff trace: %ld.%06ld\n", my_pid, diff_trace_ts.tv_sec, diff_trace_ts.tv_usec);
   LOG(LOG_DBG, "[%d] diff real: %ld.%06ld\n", my_pid, diff_real_ts.tv_sec, diff_real_ts.tv_usec);
   LOG(LOG_DBG, "[%d] time shift: %ld.%06ld\n", my_pid, shift_ts.tv_sec, shift_ts.tv_usec);
+  if (opt.credit) { //how late the query is, for the manager
+    int64_t shift_us = (int64_t)shift_ts.tv_sec * 1000000 + shift_ts.tv_usec;
+    opt.credit->lag_us.store(shift_us < 0 ? -shift_us : 0, memory_order_relaxed);
+  }
+
+  //pick the server; from here on src_ip is the connection key, so
+  //sockets and connections are per source and server
+  int t = pick_target(msg->src_ip());
+  msg->set_src_ip(conn_key(msg->src_ip(), t));
+  add_target_stat(t, &target_stats_t::queries, 1);
 
   //which type of socket?
   bool use_tcp = (conn_type == "tcp" || (conn_type == "adaptive" && msg->tcp()));
@@ -876,57 +1852,475 @@ void DNSClient::send_query(void *arg, long long unsigned int ct)
 }
 
 /*
-  send back to manager
+  handle one DNS response (without tcp length field) from the server:
+  classify it from the header and hand it to the configured output
+*/
+void DNSClient::process_response(uint8_t *buf, size_t len, string addr, bool udp)
+{
+  dns_hdr_t hdr;
+  bool valid = parse_dns_hdr(buf, len, &hdr);
+  classify_response(&hdr, len, valid);
+  string key = valid ? msg_key(buf, &hdr) : ""; //matches the query record
+  add_target_stat(key_target(addr), &target_stats_t::responses, 1);
+
+  if (output_option & OUTPUT_TIMING)
+    record_message_time(buf, len, key_src(addr));
+  if (udp && valid && opt.udp_retry_ms > 0)
+    udp_retry_done(key);
+  if (udp && valid && hdr.tc && opt.tc_fallback && tc_fallback(buf, len, &hdr, key, addr))
+    return; //the latency is logged with the tcp response
+  if (output_option & OUTPUT_LATENCY) {
+    if (!valid) {
+      LOG(LOG_ERR, "[%d] response of %lu bytes is too short\n", my_pid, len);
+      return;
+    }
+    sendto_manager(buf, len, &hdr, key, sample_keep(key, key_src(addr)));
+  }
+}
+
+/*
+  send the query of a truncated udp response again over tcp, as a stub
+  resolver would. With latency output the query record is moved to the
+  tcp query, so the latency covers both. Return false if the response
+  cannot be retried.
+*/
+bool DNSClient::tc_fallback(uint8_t *buf, size_t len, const dns_hdr_t *hdr, const string &key, const string &addr)
+{
+  string q;
+  if (!make_retry_query(buf, len, hdr, q))
+    return false;
+
+  struct timeval udp_lat = {0, 0};
+  if (output_option & OUTPUT_LATENCY) {
+    auto it = query_table.find(key);
+    if (it == query_table.end())
+      return false;
+    struct timeval now;
+    evutil_gettimeofday(&now, NULL);
+    evutil_timersub(&now, &it->second->ts, &udp_lat);
+    delete it->second;
+    query_table.erase(it);
+  }
+
+  trace_replay::DNSMsg *msg = new trace_replay::DNSMsg();
+  assert(msg);
+  msg->set_seconds(0);
+  msg->set_microseconds(0);
+  msg->set_tcp(true);
+  msg->set_ipv4(true);
+  msg->set_src_ip(addr);
+  msg->set_raw(q);
+  add_stat(&replay_stats_t::tc_fallback, 1);
+  LOG(LOG_DBG, "[%d] truncated response for %s, retry over tcp\n", my_pid, addr.c_str());
+
+  copy_ts(&cur_retry_lat, &udp_lat);
+  send_query_tcp((void *)msg, false);
+  evutil_timerclear(&cur_retry_lat);
+  return true;
+}
+
+/*
+  count a response in the interval and total stats
+*/
+void DNSClient::classify_response(const dns_hdr_t *h, size_t len, bool valid)
+{
+  for (replay_stats_t *st : {&interval_stats, &total_stats}) {
+    st->responses += 1;
+    st->bytes += len;
+    if (!valid || h->qend == 0) {
+      st->malformed += 1;
+      if (!valid)
+	continue;
+    }
+    st->rcode[h->rcode] += 1;
+    if (h->aa) st->aa += 1;
+    if (h->tc) st->tc += 1;
+    if (h->ra) st->ra += 1;
+    if (h->rcode == 0 && h->ancount == 0) st->nodata += 1;
+  }
+}
+
+/*
+  format stats as space separated key=value pairs
+*/
+string DNSClient::stats_str(const replay_stats_t &st)
+{
+  string r = "responses=" + to_string(st.responses) + " bytes=" + to_string(st.bytes);
+  uint64_t other = 0;
+  for (uint8_t i = 0; i < 16; i++) {
+    if (i == 0 || i == 1 || i == 2 || i == 3 || i == 5)
+      r += string(" ") + rcode_str(i) + "=" + to_string(st.rcode[i]);
+    else
+      other += st.rcode[i];
+  }
+  r += " OTHER=" + to_string(other);
+  r += " aa=" + to_string(st.aa) + " tc=" + to_string(st.tc) + " ra=" + to_string(st.ra);
+  r += " nodata=" + to_string(st.nodata) + " malformed=" + to_string(st.malformed);
+  if (opt.tc_fallback)
+    r += " tc_fallback=" + to_string(st.tc_fallback);
+  if (opt.kernel_ts)
+    r += " kernel_ts=" + to_string(st.kernel_ts);
+  if (conn_type == "udp" || conn_type == "adaptive")
+    r += " udp_rx_drops=" + to_string(st.udp_rx_drops) + " udp_tx_drops=" + to_string(st.udp_tx_drops);
+  if (opt.sample > 1) {
+    //upper bound in microseconds and count of the non-empty buckets
+    string h;
+    for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+      if (st.lat_hist[i] == 0)
+	continue;
+      h += (h.empty() ? "" : ",");
+      h += (i == LAT_HIST_BUCKETS - 1 ? string("inf") : to_string(1ULL << i)) + ":" + to_string(st.lat_hist[i]);
+    }
+    r += " sample_skipped=" + to_string(st.sample_skipped) + " lat_hist=" + (h.empty() ? "-" : h);
+  }
+  if (opt.udp_retry_ms > 0) {
+    r += " udp_sent=" + to_string(st.udp_sent) + " udp_retries=" + to_string(st.udp_retries);
+    r += " udp_first_ok=" + to_string(st.udp_first_ok) + " udp_retry_ok=" + to_string(st.udp_retry_ok);
+    r += " udp_giveup=" + to_string(st.udp_giveup);
+    char amp[32];
+    snprintf(amp, sizeof(amp), "%.3f", st.udp_sent ? (double)(st.udp_sent + st.udp_retries) / st.udp_sent : 0.0);
+    r += string(" udp_amplification=") + amp;
+  }
+  if (opt.sample_snmp)
+    r += " snmp_rcvbuf_errors=" + to_string(st.snmp_rcvbuf_errors) + " snmp_sndbuf_errors=" + to_string(st.snmp_sndbuf_errors);
+  r += " conn_new=" + to_string(st.conn_new);
+  if (opt.conn_rate > 0) {
+    r += " conn_paced=" + to_string(st.conn_paced) + " conn_dropped=" + to_string(st.conn_dropped);
+    r += " conn_wait_us=" + to_string(st.conn_wait_us);
+  }
+  if (tls_pool) {
+    r += " tls_done=" + to_string(st.tls_done) + " tls_failed=" + to_string(st.tls_failed);
+    r += " tls_connect_us=" + to_string(st.tls_connect_us) + " tls_handshake_us=" + to_string(st.tls_handshake_us);
+  }
+  if (opt.ktls)
+    r += " ktls_on=" + to_string(st.ktls_on) + " ktls_fallback=" + to_string(st.ktls_fallback);
+  return r;
+}
+
+void DNSClient::add_stat(uint64_t replay_stats_t::*f, uint64_t n)
+{
+  interval_stats.*f += n;
+  total_stats.*f += n;
+}
+
+/*
+  helper of stats_timer_cb
+*/
+void DNSClient::stats_timer_cb_helper(evutil_socket_t fd, short which, void *ctx)
+{
+  (static_cast<DNSClient *>(ctx))->stats_timer_cb();
+}
+
+/*
+  write the stats of the last interval as a comment line to the
+  output, or to the log without output file
+*/
+void DNSClient::stats_timer_cb()
+{
+  sample_snmp();
+  struct timeval t;
+  evutil_gettimeofday(&t, NULL);
+  string prefix = "#stats " + to_string(my_pid) + " " + to_string(t.tv_sec) + " ";
+  string tmp = prefix + stats_str(interval_stats) + "\n";
+  if (targets.size() > 1) {
+    for (target_t &tg : targets) {
+      tmp += prefix + "target=" + tg.name + " " + target_stats_str(tg.interval_stats) + "\n";
+      tg.interval_stats = target_stats_t();
+    }
+  }
+  if (output_option != OUTPUT_NONE) {
+    if (bufferevent_write(manager_bev, tmp.data(), tmp.size()) == -1)
+      log_err("stats_timer_cb: bufferevent_write fails");
+  } else {
+    LOG(LOG_INFO, "[%d] %s", my_pid, tmp.c_str());
+  }
+  interval_stats = replay_stats_t();
+}
+
+void DNSClient::log_stats()
+{
+  sample_snmp();
+  LOG(LOG_INFO, "[%d] Responses: %s\n", my_pid, stats_str(total_stats).c_str());
+  if (targets.size() > 1)
+    for (target_t &tg : targets)
+      LOG(LOG_INFO, "[%d] Target %s: %s\n", my_pid, tg.name.c_str(), target_stats_str(tg.total_stats).c_str());
+}
+
+/*
+  read RcvbufErrors and SndbufErrors of the Udp lines in /proc/net/snmp
+*/
+bool DNSClient::read_snmp_udp(uint64_t *rcvbuf, uint64_t *sndbuf)
+{
+  ifstream f("/proc/net/snmp");
+  string names, values;
+  while (getline(f, names)) {
+    if (names.compare(0, 4, "Udp:") != 0)
+      continue;
+    if (!getline(f, values))
+      return false;
+    istringstream n(names), v(values);
+    string name, value;
+    bool found = false;
+    while (n >> name && v >> value) {
+      if (name == "RcvbufErrors") {
+	*rcvbuf = stoull(value);
+	found = true;
+      } else if (name == "SndbufErrors") {
+	*sndbuf = stoull(value);
+      }
+    }
+    return found;
+  }
+  return false;
+}
+
+/*
+  add the host udp buffer errors since the last sample to the stats
+*/
+void DNSClient::sample_snmp()
+{
+  if (!opt.sample_snmp)
+    return;
+  uint64_t rcvbuf = 0, sndbuf = 0;
+  if (!read_snmp_udp(&rcvbuf, &sndbuf))
+    return;
+  add_stat(&replay_stats_t::snmp_rcvbuf_errors, rcvbuf - snmp_rcvbuf_last);
+  add_stat(&replay_stats_t::snmp_sndbuf_errors, sndbuf - snmp_sndbuf_last);
+  snmp_rcvbuf_last = rcvbuf;
+  snmp_sndbuf_last = sndbuf;
+}
+
+/*
+  choose the server for a query from the given source: 'hash' keeps a
+  source on one server (weights give the share of sources), 'rr' takes
+  the servers in turn and 'weight' does a smooth weighted round robin
+*/
+int DNSClient::pick_target(const string &src)
+{
+  if (targets.size() == 1)
+    return 0;
+
+  if (opt.server_policy == "rr") {
+    int t = rr_next;
+    rr_next = (rr_next + 1) % targets.size();
+    return t;
+  }
+
+  int total = 0;
+  for (target_t &tg : targets)
+    total += tg.weight;
+
+  if (opt.server_policy == "weight") {
+    int best = 0;
+    for (unsigned int i = 0; i < targets.size(); i++) {
+      targets[i].cur_weight += targets[i].weight;
+      if (targets[i].cur_weight > targets[best].cur_weight)
+	best = i;
+    }
+    targets[best].cur_weight -= total;
+    return best;
+  }
+
+  //hash: the same in all workers
+  int64_t h = hash_str(src) % total;
+  for (unsigned int i = 0; i < targets.size(); i++) {
+    h -= targets[i].weight;
+    if (h < 0)
+      return i;
+  }
+  return 0;
+}
+
+/*
+  choose a unified udp socket of the server for a query from the given
+  source: 'hash' keeps a source on one socket, 'rr' takes them in turn
+*/
+int DNSClient::pick_udp_fd(int t, const string &src)
+{
+  target_t &tg = targets[t];
+  if (tg.udp_fds.size() == 1)
+    return tg.udp_fds[0];
+  if (opt.udp_pool_policy == "rr") {
+    int fd = tg.udp_fds[tg.udp_next];
+    tg.udp_next = (tg.udp_next + 1) % tg.udp_fds.size();
+    return fd;
+  }
+  //the low bits of the hash pick the server, use the high ones here
+  return tg.udp_fds[(hash_str(src) >> 32) % tg.udp_fds.size()];
+}
+
+/*
+  key of the sockets and connections of a source to a server: the
+  source ip, followed by '|' and the server index with several servers
+*/
+string DNSClient::conn_key(const string &src, int t)
+{
+  if (targets.size() == 1)
+    return src;
+  return src + "|" + to_string(t);
+}
+
+string DNSClient::key_src(const string &key)
+{
+  return key.substr(0, key.find_first_of('|'));
+}
+
+int DNSClient::key_target(const string &key)
+{
+  size_t found = key.find_first_of('|');
+  if (found == string::npos)
+    return 0;
+  return atoi(key.c_str() + found + 1);
+}
+
+void DNSClient::add_target_stat(int t, uint64_t target_stats_t::*f, uint64_t n)
+{
+  targets[t].interval_stats.*f += n;
+  targets[t].total_stats.*f += n;
+}
+
+string DNSClient::target_stats_str(const target_stats_t &st)
+{
+  string r = "queries=" + to_string(st.queries) + " responses=" + to_string(st.responses);
+  r += " matched=" + to_string(st.matched) + " latency_us=" + to_string(st.latency_us);
+  return r;
+}
+
+/*
+  send back to manager; the query is matched and counted in any case,
+  the line is written only if keep (--sample)
 */
-void DNSClient::sendto_manager(uint8_t *buf, size_t len)
+void DNSClient::sendto_manager(uint8_t *buf, size_t len, const dns_hdr_t *hdr, const string &key, bool keep)
 {  
   //log response timing
   struct timeval rt;
   evutil_gettimeofday(&rt, NULL);
 
   //get query timing
-  string key = to_string(get_id(buf)) + " " + get_query_rr_str(buf, len);
-  delete[] buf;
-  key = fmt_str(key, " ");
-  //DBG("key: [%s]\n", key.c_str());
-  if (query_table.find(key) == query_table.end()) {
-    LOG(LOG_ERR, "[%d] response for [%s] has no query!\n", my_pid, key.c_str());
+  auto it = query_table.find(key);
+  if (it == query_table.end()) {
+    LOG(LOG_ERR, "[%d] response for [%u %s] has no query!\n", my_pid, hdr->id, question_str(buf, len, hdr).c_str());
     return;
   }
-  struct timeval *qt = query_table[key];
-
-  //get latency
-  struct timeval latency;
-  evutil_timersub(&rt, qt, &latency);
-  LOG(LOG_DBG, "[%d] latency %ld.%06ld for %s\n", my_pid, latency.tv_sec, latency.tv_usec, key.c_str());
+  query_rec_t *qr = it->second;
+
+  //get latency: from the kernel timestamps when both are known, the
+  //latency seen in user space is logged as well
+  struct timeval latency, user_latency;
+  evutil_timersub(&rt, &qr->ts, &user_latency);
+  if (evutil_timerisset(&cur_rx_ts) && evutil_timerisset(&qr->tx_ts)) {
+    evutil_timersub(&cur_rx_ts, &qr->tx_ts, &latency);
+    add_stat(&replay_stats_t::kernel_ts, 1);
+  } else {
+    latency = user_latency;
+  }
+  LOG(LOG_DBG, "[%d] latency %ld.%06ld for %u %s\n", my_pid, latency.tv_sec, latency.tv_usec, hdr->id, question_str(buf, len, hdr).c_str());
 
   //delete from query_table
-  query_table.erase(key);
-  delete qt;
+  query_table.erase(it);
+  long long conn_wait_us = qr->conn_wait.tv_sec * 1000000LL + qr->conn_wait.tv_usec;
+  int t = qr->target;
+  uint64_t seq = qr->seq;
+  int tries = qr->tries;
+  string detail;
+  if (opt.conn_detail) {
+    //connect, handshake, queue and server time; '-' for udp
+    if (evutil_timerisset(&qr->write_ts)) {
+      struct timeval queue, server;
+      evutil_timersub(&qr->write_ts, &qr->ready_ts, &queue);
+      evutil_timersub(&rt, &qr->write_ts, &server);
+      detail = " " + to_string(qr->connect_us) + " " + to_string(qr->handshake_us);
+      detail += " " + to_string(queue.tv_sec * 1000000LL + queue.tv_usec);
+      detail += " " + to_string(server.tv_sec * 1000000LL + server.tv_usec);
+    } else {
+      detail = " - - - -";
+    }
+  }
+  delete qr;
+  add_target_stat(t, &target_stats_t::matched, 1);
+  add_target_stat(t, &target_stats_t::latency_us, latency.tv_sec * 1000000ULL + latency.tv_usec);
+
+  //the histogram covers all queries, the line only the sampled ones
+  if (opt.sample > 1) {
+    uint64_t us = latency.tv_sec * 1000000ULL + latency.tv_usec;
+    int b = 0;
+    while (us > 0 && b < LAT_HIST_BUCKETS - 1) {
+      us >>= 1;
+      b += 1;
+    }
+    interval_stats.lat_hist[b] += 1;
+    total_stats.lat_hist[b] += 1;
+  }
+  if (!keep)
+    return;
 
-  //send back to manager
-  vector<string> v;
-  str_split(key, v);
-  bool first = true;
+  //send back to manager; the question is printed only for the lines
+  //that are written
   string tmp = to_string(latency.tv_sec) + " " + to_string(latency.tv_usec);
-  for (string e : v) {
-    if (first)
-      first = false;
-    else
-      tmp += (" " + e);
-  }
+  tmp += " " + question_str(buf, len, hdr);
+
+  //response classification from the header
+  tmp += string(" ") + rcode_str(hdr->rcode) + " " + hdr_flags_str(hdr);
+  tmp += " " + to_string(hdr->ancount) + " " + to_string(len);
+
+  //time waiting for a paced connection or a tls session, not part of
+  //the latency
+  if (opt.conn_rate > 0 || tls_pool)
+    tmp += " " + to_string(conn_wait_us);
+
+  //server that answered
+  if (targets.size() > 1)
+    tmp += " " + targets[t].name;
+
+  //latency seen in user space, with the queueing in this worker
+  if (opt.kernel_ts)
+    tmp += " " + to_string(user_latency.tv_sec * 1000000LL + user_latency.tv_usec);
+
+  //replay sequence tag of the query
+  if (opt.seq_run >= 0)
+    tmp += " " + seq_str(seq);
+
+  //tcp/tls breakdown
+  tmp += detail;
+
+  //udp retries sent before the response
+  if (opt.udp_retry_ms > 0)
+    tmp += " " + to_string(tries);
 
   //format string here, manager and commander does not format and just
   //log it
   tmp += "\n";
-  int l = tmp.size()+1;
-  char *d = new char[l];
-  memset(d, 0, l);
-  memcpy(d, tmp.c_str(), l-1);
-  if (bufferevent_write(manager_bev, d, l) == -1) {
+  if (bufferevent_write(manager_bev, tmp.data(), tmp.size()) == -1) {
     log_err("sendto_manager: bufferevent_write fails");
   }
-  delete[] d;
+}
+
+/*
+  whether the per-query output of a message is kept with --sample. The
+  choice hashes the query key (id and question wire bytes), the name
+  in it or the source, so a query and its response, or all queries of
+  a name or a source, are kept or left out together.
+*/
+bool DNSClient::sample_keep(const string &key, const string &src)
+{
+  if (opt.sample <= 1)
+    return true;
+  string k;
+  if (opt.sample_by == "src") {
+    k = src;
+  } else if (opt.sample_by == "qname") {
+    //the name labels follow the 2 id bytes of the key
+    size_t e = skip_dns_name((const uint8_t *)key.data(), key.size(), 2);
+    if (e > 2)
+      k = key.substr(2, e - 2);
+  } else {
+    k = key;
+  }
+  //salted, so that it does not follow the server choice by source hash
+  if (hash_str("sample " + k) % opt.sample == 0)
+    return true;
+  add_stat(&replay_stats_t::sample_skipped, 1);
+  return false;
 }
 
 /*
@@ -935,6 +2329,9 @@ void DNSClient::sendto_manager(uint8_t *buf, size_t len)
 */
 void DNSClient::record_message_time(uint8_t *data, size_t len, string addr) {
   LOG(LOG_DBG, "[%d] record_message_time: data len = %lu\n", my_pid, len);
+  dns_hdr_t hdr;
+  if (!sample_keep(parse_dns_hdr(data, len, &hdr) ? msg_key(data, &hdr) : "", addr))
+    return;
   //make a copy of the data
   uint8_t *buf = new uint8_t[len];
   memcpy(buf, data, len);
@@ -955,7 +2352,20 @@ void DNSClient::record_message_time(uint8_t *data, size_t len, string addr) {
   //log it
   string tms = to_string(t.tv_usec);
   string tms_full = string(6 - tms.length(), '0') + tms;
-  string tmp = addr + " " + to_string(t.tv_sec) + " " + tms_full + " " + key + "\n";
+  string tmp = addr + " " + to_string(t.tv_sec) + " " + tms_full + " " + key;
+
+  //replay sequence tag; servers do not have to echo it in responses
+  if (opt.seq_run >= 0) {
+    string tag;
+    uint64_t seq = 0;
+    if (get_edns_option(data, len, EDNS_SEQ_OPTION, tag) && tag.size() == sizeof(seq)) {
+      memcpy(&seq, tag.data(), sizeof(seq));
+      tmp += " " + seq_str(be64toh(seq));
+    } else {
+      tmp += " -";
+    }
+  }
+  tmp += "\n";
   if (bufferevent_write(manager_bev, tmp.data(), tmp.size()) == -1) {
     log_err("record_message_time: bufferevent_write fails");
   }
@@ -992,41 +2402,28 @@ void DNSClient::server_read_cb(struct bufferevent *bev)
   bufferevent_read(bev, data, len);
   // print_dns_pkt(data+2, len-2);
 
-  if (output_option & OUTPUT_TIMING) {
-    server_msg_buffer[bev].append(reinterpret_cast<const char*>(data), len);
-    while(server_msg_buffer[bev].size() > sizeof(uint16_t)) {
-      uint8_t *d = (uint8_t *)(server_msg_buffer[bev].data());
-      if (server_msg_buffer[bev].size() < 2) {
-	LOG(LOG_ERR, "[%d] error: server_msg_buffer[bev].size() < 2", my_pid);
-      }
-      uint16_t sz = 0;
-      memcpy(&sz, d, sizeof(sz));
-      sz = ntohs(sz);
-      uint16_t left = server_msg_buffer[bev].size() - sizeof(uint16_t);
-      if (sz > left) {
-	LOG(LOG_DBG,
-	    "[%d] read sz [%d] > left [%d], break! (server might send data and its length separately)\n",
-	    my_pid, sz, left);
-	break; //not enough data left
-      }
-      d += sizeof(uint16_t);
-      //uint8_t *buf = new uint8_t[sz];//to delete after sending
-      //memcpy(buf, d, sz);
-      //sendto_manager_time(buf, sz);
-      record_message_time(d, sz, (bev2src.count(bev) ? bev2src[bev] : "0"));
-      LOG(LOG_DBG, "[%d] trim server message: before[%lu]\n", my_pid, server_msg_buffer[bev].size());
-      server_msg_buffer[bev] = server_msg_buffer[bev].substr(sz + sizeof(uint16_t)); //assign msg_buffer for the rest of data
-      LOG(LOG_DBG, "[%d] trim server message: after[%lu]\n", my_pid, server_msg_buffer[bev].size());
-    }
-  }
+  server_msg_buffer[bev].append(reinterpret_cast<const char*>(data), len);
+  delete[] data;
 
-  if (output_option & OUTPUT_LATENCY) {//xxx: only deal with latency for now
-    //send back to manager
-    uint8_t *buf = new uint8_t[len-2];//to delete after sending
-    memcpy(buf, data+2, len-2);
-    sendto_manager(buf, len-2);
+  //there might be multiple responses, or part of one, in this buffer
+  while(server_msg_buffer[bev].size() > sizeof(uint16_t)) {
+    uint8_t *d = (uint8_t *)(server_msg_buffer[bev].data());
+    uint16_t sz = 0;
+    memcpy(&sz, d, sizeof(sz));
+    sz = ntohs(sz);
+    size_t left = server_msg_buffer[bev].size() - sizeof(uint16_t);
+    if (sz > left) {
+      LOG(LOG_DBG,
+	  "[%d] read sz [%d] > left [%lu], break! (server might send data and its length separately)\n",
+	  my_pid, sz, left);
+      break; //not enough data left
+    }
+    d += sizeof(uint16_t);
+    process_response(d, sz, (bev2src.count(bev) ? bev2src[bev] : "0"), false);
+    LOG(LOG_DBG, "[%d] trim server message: before[%lu]\n", my_pid, server_msg_buffer[bev].size());
+    server_msg_buffer[bev] = server_msg_buffer[bev].substr(sz + sizeof(uint16_t)); //assign msg_buffer for the rest of data
+    LOG(LOG_DBG, "[%d] trim server message: after[%lu]\n", my_pid, server_msg_buffer[bev].size());
   }
-  delete[] data;
 }
 
 /*
@@ -1049,6 +2446,14 @@ void DNSClient::server_event_cb(struct bufferevent *bev, short which)
   if (which & BEV_EVENT_CONNECTED) {
     LOG(LOG_DBG, "[%d] fd [%d] connected\n", my_pid, fd);
     //do we do bufferevent write here?
+    auto it = bev2conn.find(bev);
+    if (it != bev2conn.end() && !evutil_timerisset(&it->second.ready)) {
+      //for tls this is the end of the handshake; the tcp connect is
+      //not seen separately
+      evutil_gettimeofday(&it->second.ready, NULL);
+      if (!evutil_timerisset(&it->second.connected))
+	it->second.connected = (conn_type == "tls") ? it->second.start : it->second.ready;
+    }
   } else if (which & BEV_EVENT_TIMEOUT) {
     LOG(LOG_DBG, "[%d] fd [%d] timeout\n", my_pid, fd);
     //do we check the read buffer and extend the timeout here?
@@ -1062,6 +2467,8 @@ void DNSClient::server_event_cb(struct bufferevent *bev, short which)
   if (has_err) {
     string ip = bev2src[bev];
     LOG(LOG_DBG, "[%d] fd [%d] clean up bev for src %s\n", my_pid, fd, ip.c_str());
+    if (opt.conn_detail)
+      conn_close(bev, (which & BEV_EVENT_TIMEOUT) ? "timeout" : ((which & BEV_EVENT_EOF) ? "eof" : "error"));
     src2bev.erase(ip);
     bev2src.erase(bev);
     server_msg_buffer.erase(bev);
@@ -19,8 +19,14 @@
 #define CLIENT_HH
 
 #include "global_var.h"
+#include "dns_util.hh"
+#include "tls_pool.hh"
+#include "pending_queue.hh"
+#include "shm_ring.hh"
 #include <string>
 #include <set>
+#include <deque>
+#include <vector>
 #include <event2/event.h>
 #include <unordered_map>
 #include <netinet/in.h>
@@ -36,22 +42,186 @@
 #define OUTPUT_TIMING      0x0002U
 #define OUTPUT_ALL         0xFFFFU
 
+#define LAT_HIST_BUCKETS   25  //latency histogram: < 1us, [2^(i-1), 2^i) us, the last one open
+
+namespace trace_replay {
+  class DNSMsg;
+}
+
 const std::set<std::string> conn_set = {"udp", "tcp", "tls", "adaptive"};
+const std::set<std::string> server_policy_set = {"hash", "rr", "weight"};
+const std::set<std::string> udp_pool_policy_set = {"hash", "rr"};
+const std::set<std::string> sample_by_set = {"query", "qname", "src"};
+
+//per-target counters kept per stats interval and in total
+struct target_stats_t
+{
+  uint64_t queries = 0;
+  uint64_t responses = 0;
+  uint64_t matched = 0;     //responses matched to a query (latency output)
+  uint64_t latency_us = 0;  //total latency of the matched responses
+};
+
+//one server from -s
+struct target_t
+{
+  std::string name;         //IP:PORT
+  struct sockaddr_in addr;
+  int weight = 1;
+  int cur_weight = 0;       //smooth weighted round robin state
+  std::vector<int> udp_fds; //unified udp sockets (-u), one source port each
+  std::vector<struct event *> udp_read_events;
+  size_t udp_next = 0;      //round robin over udp_fds
+  target_stats_t interval_stats;
+  target_stats_t total_stats;
+};
+
+void parse_targets(std::string, std::vector<target_t> &);
+
+//optional worker features; the defaults keep the plain replay behavior
+struct client_opt_t
+{
+  int stats_interval = 0;   //seconds between stats lines, 0 means none
+  double conn_rate = 0.0;   //new tcp/tls connections per second, 0 means no pacing
+  int conn_burst = 1;       //connections that may be opened back to back
+  int conn_queue = 10000;   //queries that may wait for a paced connection
+  int tls_helpers = 0;      //threads doing tls handshakes, 0 means in the event loop
+  bool ktls = false;        //hand established tls sessions to the kernel
+  std::string server_policy = "hash"; //target of a query: hash, rr or weight
+  bool tc_fallback = false; //retry truncated udp responses over tcp
+  bool kernel_ts = false;   //udp latency from kernel send/receive timestamps
+  int udp_pool = 1;         //unified udp sockets per server (-u)
+  std::string udp_pool_policy = "hash"; //socket of a query: hash or rr
+  int expected_qps = 0;     //queries per second expected in a worker, sizes udp buffers
+  int udp_rcvbuf = 0;       //udp receive buffer in bytes, 0 means sized or default
+  int udp_sndbuf = 0;       //udp send buffer in bytes, 0 means sized or default
+  bool sample_snmp = false; //report host udp buffer errors (one worker does it)
+  int seq_run = -1;         //run id of the replay sequence tags, -1 means no tags
+  int worker_id = 0;        //index of the worker, part of the sequence tags
+  bool conn_detail = false; //tcp/tls latency breakdown and connection lines
+  int udp_retry_ms = 0;     //wait for a udp response before a retry, 0 means no retries
+  int udp_retries = 2;      //retries of a udp query before giving up
+  double udp_backoff = 2.0; //factor of the wait after each retry
+  int sample = 1;           //keep per-query output lines of 1 in sample queries
+  std::string sample_by = "query"; //what is hashed to pick them: query, qname or src
+  ShmRing *ring = NULL;     //queries from the manager over shared memory, NULL for the socket
+  shm_credit_t *credit = NULL; //queries taken from the manager and lag, NULL without --credits or --max-workers
+};
+
+//counters kept per stats interval and in total
+struct replay_stats_t
+{
+  //response classification
+  uint64_t responses = 0;
+  uint64_t bytes = 0;
+  uint64_t rcode[16] = {};
+  uint64_t aa = 0;
+  uint64_t tc = 0;
+  uint64_t ra = 0;
+  uint64_t nodata = 0;      //NOERROR with empty answer section
+  uint64_t malformed = 0;   //shorter than a header or bad question
+  uint64_t tc_fallback = 0; //truncated udp responses retried over tcp
+  uint64_t kernel_ts = 0;   //latencies from kernel timestamps
+
+  //responses lost in this host, not by the server
+  uint64_t udp_rx_drops = 0;       //dropped on full receive buffers of our sockets
+  uint64_t udp_tx_drops = 0;       //queries the kernel refused to send
+  uint64_t snmp_rcvbuf_errors = 0; //host wide Udp RcvbufErrors
+  uint64_t snmp_sndbuf_errors = 0; //host wide Udp SndbufErrors
+
+  //udp retries (--udp-retry)
+  uint64_t udp_sent = 0;     //udp queries sent the first time
+  uint64_t udp_retries = 0;  //retries sent
+  uint64_t udp_first_ok = 0; //answered before any retry
+  uint64_t udp_retry_ok = 0; //answered after one or more retries
+  uint64_t udp_giveup = 0;   //no response after the last retry
+
+  //sampled output (--sample): all matched latencies and the lines left out
+  uint64_t lat_hist[LAT_HIST_BUCKETS] = {};
+  uint64_t sample_skipped = 0;
+
+  //connection pacing
+  uint64_t conn_new = 0;    //tcp/tls connections opened
+  uint64_t conn_paced = 0;  //queries that waited for a connection token
+  uint64_t conn_dropped = 0;//queries dropped because the wait queue was full
+  uint64_t conn_wait_us = 0;//total wait of the paced queries
+
+  //tls handshakes done by helper threads
+  uint64_t tls_done = 0;
+  uint64_t tls_failed = 0;
+  uint64_t tls_connect_us = 0;   //total tcp connect time
+  uint64_t tls_handshake_us = 0; //total tls handshake time after connect
+  uint64_t ktls_on = 0;          //sessions moved to kernel tls
+  uint64_t ktls_fallback = 0;    //sessions kept in openssl
+};
+
+//query sent and waiting for its response
+struct query_rec_t
+{
+  struct timeval ts;        //time the query is sent
+  struct timeval conn_wait; //time it waited for a paced connection or a tls helper
+  int target;               //index of the server it is sent to
+  struct timeval tx_ts;     //kernel send time, zero if not known (--kernel-ts)
+  uint64_t seq;             //replay sequence tag, 0 if none
+
+  //tcp/tls breakdown (--conn-detail)
+  struct timeval write_ts;  //query written to the connection, zero if not yet
+  struct timeval ready_ts;  //connection ready for this query
+  uint64_t connect_us;      //part of the wait for the tcp connect
+  uint64_t handshake_us;    //part of the wait for the tls handshake
+
+  //udp retries (--udp-retry)
+  int udp_fd = -1;          //socket of the first send, -1 if not retried
+  int tries = 0;            //retries sent so far
+  std::string udp_src;      //connection key of the socket
+  std::string raw;          //query as sent
+};
+
+//a udp query to retry if it has no response when due
+struct udp_retry_t
+{
+  struct timeval due;
+  std::string key;          //query_table key
+  int tries;                //retries sent when it was scheduled
+};
+
+//events of a tcp/tls connection (--conn-detail)
+struct conn_rec_t
+{
+  struct timeval start = {0, 0};      //connect started
+  struct timeval connected = {0, 0};  //tcp connected
+  struct timeval ready = {0, 0};      //tls handshake done, or connected for tcp
+  uint64_t queries = 0;
+  uint64_t appended = 0;              //query bytes given to the bufferevent
+  uint64_t written = 0;               //query bytes drained from it
+  std::deque<std::pair<uint64_t, std::string> > unwritten; //end offset and key of queries
+  void *cb_arg = NULL;                //argument of the output buffer callback
+};
+
+//query waiting for a paced tcp/tls connection
+struct conn_wait_t
+{
+  void *msg;
+  bool use_tls;
+  struct timeval ts;        //time it started to wait
+  struct timeval retry_lat; //udp latency before a tcp fallback
+};
 
 class DNSClient{
 
 public:
-  DNSClient(std::string, std::string, int, std::string, int, int, uint32_t, uint32_t, bool);
+  DNSClient(std::string, std::string, int, std::vector<target_t>, int, uint32_t, uint32_t, bool,
+	    client_opt_t);
   ~DNSClient();
   void start();
   struct event_base *get_base();
   long long unsigned int get_pending_event_max();
   long long unsigned int get_num_timer();
   long long unsigned int get_num_notimer();
+  void log_stats();
 
 private:
   pid_t my_pid;
-  int server_port = -1;
   int time_out;
   int manager_fd = -1;
   bool non_wait = false;
@@ -64,39 +234,132 @@ private:
 
   uint32_t socket_unify = SOCKET_UNIFY_NONE;
   uint32_t output_option = OUTPUT_NONE;
-  int unified_udp_fd = -1;
-  struct event *unified_udp_read_event = NULL;
+  client_opt_t opt;
+  struct event *stats_event = NULL;
+
+  //queries waiting for their send time, fired by one timer
+  PendingQueue pending;
+  struct event *pending_event = NULL;
+  trace_replay::DNSMsg *parse_msg = NULL; //reused to parse manager messages
+  struct event *ring_event = NULL;        //shared memory ring has data (--shm-ring)
+
+  replay_stats_t interval_stats;
+  replay_stats_t total_stats;
+
+  //connection pacing: token bucket and the sources waiting for a token
+  double conn_tokens = 0.0;
+  bool conn_token_held = false;
+  size_t num_conn_wait = 0;
+  struct timeval conn_token_ts = {0, 0};
+  struct timeval cur_conn_wait = {0, 0};
+  struct timeval cur_retry_lat = {0, 0}; //udp latency of the tcp fallback being sent
+  struct timeval cur_rx_ts = {0, 0};     //kernel receive time of the response being processed
+
+  //kernel send timestamps: queries sent on each udp socket, by the
+  //socket's send counter, waiting for their timestamp
+  std::unordered_map<int, uint32_t> udp_tx_seq;
+  std::unordered_map<int, std::deque<std::pair<uint32_t, std::string> > > udp_tx_keys;
+
+  //kernel drop counters: last SO_RXQ_OVFL value of each udp socket and
+  //the last host udp counters
+  std::unordered_map<int, uint32_t> udp_ovfl;
+  uint64_t snmp_rcvbuf_last = 0;
+  uint64_t snmp_sndbuf_last = 0;
+  struct event *conn_pace_event = NULL;
+  std::deque<std::string> conn_wait_src;
+  std::unordered_map<std::string, std::vector<conn_wait_t> > conn_wait;
+
+  //tls handshake helpers and the queries waiting for their sessions
+  TlsHandshakePool *tls_pool = NULL;
+  struct event *tls_pool_event = NULL;
+  std::unordered_map<std::string, std::vector<conn_wait_t> > tls_wait;
 
   struct timeval start_trace_ts = {0, 0};
   struct timeval start_real_ts = {0, 0};
   struct timeval shift_ts = {0, 0};
 
-  struct sockaddr_in server_addr;
+  //servers to replay to; sockets and connections are kept per source
+  //and target, under the connection key of conn_key()
+  std::vector<target_t> targets;
+  size_t rr_next = 0;
+  uint32_t seq_counter = 0; //last replay sequence number of this worker
+  std::unordered_map<int, int> unified_fd2target; //unified udp fd and its server
+
+  //udp queries waiting for a retry, one queue per retry count: all
+  //entries of a queue wait equally long, so each is in due order
+  std::vector<std::deque<udp_retry_t> > udp_retry_q;
+  struct event *udp_retry_event = NULL;
   
   std::string conn_type;
   std::string nagle_option;
-  std::string server_ip;
   std::string msg_buffer;
 
   struct event_base *base;
   struct bufferevent *manager_bev;
 
-  std::unordered_map<std::string, int> src2udpfd;                //index by src ip and udp fd
-  std::unordered_map<int, std::string> udpfd2src;                //index by udp fd and src ip
+  std::unordered_map<std::string, int> src2udpfd;                //index by connection key and udp fd
+  std::unordered_map<int, std::string> udpfd2src;                //index by udp fd and connection key
   std::unordered_map<int, struct event *> udp_read_event;        //index by udp fd and server udp read event
-  std::unordered_map<std::string, struct bufferevent *> src2bev; //index by src ip and struct bufferevent *
-  std::unordered_map<struct bufferevent *, std::string> bev2src; //index by struct bufferevent * and src_ip
-  std::unordered_map<std::string, struct timeval *> query_table; //index by (dns-id + qname) and query time
+  std::unordered_map<std::string, struct bufferevent *> src2bev; //index by connection key and struct bufferevent *
+  std::unordered_map<struct bufferevent *, std::string> bev2src; //index by struct bufferevent * and connection key
+  std::unordered_map<std::string, query_rec_t *> query_table;    //index by (dns-id + qname) and query record
   std::unordered_map<struct bufferevent *, std::string> server_msg_buffer; //server tcp message buffer for each bev
+  std::unordered_map<struct bufferevent *, conn_rec_t> bev2conn;  //index by struct bufferevent * and its events
 
   SSL_CTX *ssl_ctx {nullptr};
   SSL_CTX *get_ssl_ctx();
   void init_ssl();
 
-  void sendto_manager(uint8_t *, size_t);
+  void process_response(uint8_t *, size_t, std::string, bool);
+  bool tc_fallback(uint8_t *, size_t, const dns_hdr_t *, const std::string &, const std::string &);
+  void classify_response(const dns_hdr_t *, size_t, bool);
+  void sendto_manager(uint8_t *, size_t, const dns_hdr_t *, const std::string &, bool);
+  bool sample_keep(const std::string &, const std::string &);
   void record_message_time(uint8_t *, size_t, std::string);
+  std::string stats_str(const replay_stats_t &);
+  void add_stat(uint64_t replay_stats_t::*, uint64_t);
+  query_rec_t *add_query_rec(std::string &, int, uint64_t);
+  void udp_retry_add(const std::string &, int);
+  void udp_retry_schedule();
+  static void udp_retry_cb_helper(evutil_socket_t, short, void *);
+  void udp_retry_cb();
+  bool udp_retry_send(query_rec_t *);
+  void udp_retry_done(const std::string &);
+  uint64_t tag_query(std::string &);
+
+  int pick_target(const std::string &);
+  int pick_udp_fd(int, const std::string &);
+  std::string conn_key(const std::string &, int);
+  std::string key_src(const std::string &);
+  int key_target(const std::string &);
+  void add_target_stat(int, uint64_t target_stats_t::*, uint64_t);
+  std::string target_stats_str(const target_stats_t &);
+
+  bool conn_pace_admit(void *, bool);
+  void conn_pace_refill();
+  void conn_pace_schedule();
+  static void conn_pace_cb_helper(evutil_socket_t, short, void *);
+  void conn_pace_cb();
+
+  void tls_offload_wait(void *);
+  static void tls_pool_cb_helper(evutil_socket_t, short, void *);
+  void tls_pool_cb(evutil_socket_t);
+  void register_server_bev(struct bufferevent *, std::string &);
+  void conn_note_write(struct bufferevent *, size_t, const std::string &);
+  static void conn_output_cb_helper(struct evbuffer *, const struct evbuffer_cb_info *, void *);
+  void conn_output_cb(struct bufferevent *, size_t);
+  void conn_close(struct bufferevent *, const char *);
+
+  static void stats_timer_cb_helper(evutil_socket_t, short, void *);
+  void stats_timer_cb();
   
-  static void send_query_helper(evutil_socket_t, short, void *);
+  void set_start(int64_t);
+  void pending_due(const struct timeval *, struct timeval *);
+  bool pending_overdue(const struct timeval *);
+  void pending_schedule();
+  static void pending_timer_cb_helper(evutil_socket_t, short, void *);
+  void pending_timer_cb();
+
   void send_query(void *, long long unsigned int);
   void send_query_udp(void *);
   void send_query_tcp(void *, bool);
@@ -104,6 +367,10 @@ private:
   
   static void manager_read_cb_helper(struct bufferevent *, void *);
   void manager_read_cb(struct bufferevent *);
+  static void ring_read_cb_helper(evutil_socket_t, short, void *);
+  void ring_read_cb();
+  void read_manager_msgs();
+  void grant_credit();
 
   static void manager_event_cb_helper(struct bufferevent *, short, void *);
   void manager_event_cb(struct bufferevent *, short);
@@ -111,9 +378,16 @@ private:
   static void server_udp_read_cb_helper(evutil_socket_t, short, void *);
   void server_udp_read_cb(evutil_socket_t);
   void server_udp_read_timeout_cb(evutil_socket_t);
+  void setup_udp_socket(int, bool);
+  void set_sock_buf(int, int, int);
+  void enable_kernel_ts(int);
+  void read_tx_ts(evutil_socket_t);
+  int recv_udp(evutil_socket_t, uint8_t *, size_t);
+  bool read_snmp_udp(uint64_t *, uint64_t *);
+  void sample_snmp();
 
   static void server_udp_write_cb_helper(evutil_socket_t, short, void *);
-  void server_udp_write_cb(evutil_socket_t, void *);
+  void server_udp_write_cb(evutil_socket_t, void *, const std::string &);
   
   static void server_read_cb_helper(struct bufferevent *, void *);
   void server_read_cb(struct bufferevent *);
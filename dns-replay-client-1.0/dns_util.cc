@@ -17,6 +17,7 @@
  */
 
 #include <stdio.h>
+#include <ctype.h>
 #include <err.h>
 #include <ldns/ldns.h>
 #include "dns_util.hh"
@@ -139,3 +140,267 @@ string get_query_rr_str(uint8_t *buf, size_t buf_sz)
   ldns_pkt_free(pkt);
   return r;
 }
+
+/*
+  skip a (possibly compressed) domain name starting at offset; return
+  the offset right after the name, or 0 if the name is malformed
+*/
+size_t skip_dns_name(const uint8_t *buf, size_t buf_sz, size_t offset)
+{
+  while (offset < buf_sz) {
+    uint8_t l = buf[offset];
+    if (l == 0)                   //root label
+      return offset + 1;
+    if ((l & 0xC0) == 0xC0)       //compression pointer ends the name
+      return (offset + 2 <= buf_sz) ? offset + 2 : 0;
+    if ((l & 0xC0) != 0)          //extended label types are not supported
+      return 0;
+    offset += l + 1;
+  }
+  return 0;
+}
+
+/*
+  fill in header fields of a DNS message; return false if the message
+  is shorter than a DNS header. qend is 0 if the question section
+  cannot be walked.
+*/
+bool parse_dns_hdr(const uint8_t *buf, size_t buf_sz, dns_hdr_t *h)
+{
+  if (buf == NULL || buf_sz < 12)
+    return false;
+  uint16_t bits = (buf[2] << 8) | buf[3];
+  h->id      = (buf[0] << 8) | buf[1];
+  h->qr      = bits & 0x8000U;
+  h->opcode  = (bits >> 11) & 0x0FU;
+  h->aa      = bits & 0x0400U;
+  h->tc      = bits & 0x0200U;
+  h->rd      = bits & 0x0100U;
+  h->ra      = bits & 0x0080U;
+  h->rcode   = bits & 0x000FU;
+  h->qdcount = (buf[4] << 8) | buf[5];
+  h->ancount = (buf[6] << 8) | buf[7];
+  h->nscount = (buf[8] << 8) | buf[9];
+  h->arcount = (buf[10] << 8) | buf[11];
+
+  size_t offset = 12;
+  for (uint16_t i = 0; i < h->qdcount; i++) {
+    offset = skip_dns_name(buf, buf_sz, offset);
+    if (offset == 0 || offset + 4 > buf_sz) { //qtype and qclass
+      offset = 0;
+      break;
+    }
+    offset += 4;
+  }
+  h->qend = offset;
+  return true;
+}
+
+/*
+  key matching a query and its response: the id and the question
+  section as they are on the wire, without parsing the message; empty
+  if the message has no question that can be walked
+*/
+string msg_key(const uint8_t *buf, const dns_hdr_t *h)
+{
+  string k;
+  if (h->qend == 0 || h->qdcount == 0)
+    return k;
+  k.reserve(2 + h->qend - 12);
+  k.assign((const char *)buf, 2);
+  k.append((const char *)buf + 12, h->qend - 12);
+  return k;
+}
+
+/*
+  the first question as text, "NAME CLASS TYPE" like ldns prints it,
+  for output lines; empty if there is none
+*/
+string question_str(const uint8_t *buf, size_t buf_sz, const dns_hdr_t *h)
+{
+  string r;
+  if (h->qend == 0 || h->qdcount == 0)
+    return r;
+  size_t offset = 12;
+  while (buf[offset] != 0) {
+    if ((buf[offset] & 0xC0) == 0xC0) //a question name is not compressed
+      return string();
+    uint8_t l = buf[offset++];
+    for (size_t i = offset; i < offset + l; i++) {
+      unsigned char c = buf[i];
+      if (c == '.' || c == ';' || c == '(' || c == ')' || c == '\\') {
+	r += '\\';
+	r += c;
+      } else if (!(isascii(c) && isgraph(c))) {
+	char d[8];
+	snprintf(d, sizeof(d), "\\%03u", c);
+	r += d;
+      } else {
+	r += c;
+      }
+    }
+    r += '.';
+    offset += l;
+  }
+  if (r.empty())
+    r = ".";
+  offset += 1;
+  char *type = ldns_rr_type2str((ldns_rr_type)((buf[offset] << 8) | buf[offset + 1]));
+  char *cls = ldns_rr_class2str((ldns_rr_class)((buf[offset + 2] << 8) | buf[offset + 3]));
+  r += string(" ") + cls + " " + type;
+  free(type);
+  free(cls);
+  return r;
+}
+
+const char *rcode_str(uint8_t rcode)
+{
+  static const char *names[] = {
+    "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED",
+    "YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE"
+  };
+  if (rcode < sizeof(names)/sizeof(names[0]))
+    return names[rcode];
+  return "OTHER";
+}
+
+/*
+  response flags as a comma separated list, "-" for none
+*/
+string hdr_flags_str(const dns_hdr_t *h)
+{
+  string r;
+  if (h->aa) r += "aa,";
+  if (h->tc) r += "tc,";
+  if (h->ra) r += "ra,";
+  if (r.empty())
+    return "-";
+  r.pop_back();
+  return r;
+}
+
+/*
+  find the EDNS OPT record in the additional section: its start and
+  end offsets. A truncated message may end in the middle of a record,
+  then there is no OPT.
+*/
+bool find_opt_rr(const uint8_t *buf, size_t buf_sz, const dns_hdr_t *h, size_t *start, size_t *end)
+{
+  if (h->qend == 0)
+    return false;
+  size_t offset = h->qend;
+  unsigned int num_rr = h->ancount + h->nscount + h->arcount;
+  for (unsigned int i = 0; i < num_rr; i++) {
+    size_t s = offset;
+    offset = skip_dns_name(buf, buf_sz, offset);
+    if (offset == 0 || offset + 10 > buf_sz)
+      return false;
+    uint16_t type = (buf[offset] << 8) | buf[offset + 1];
+    uint16_t rdlen = (buf[offset + 8] << 8) | buf[offset + 9];
+    offset += 10 + rdlen;
+    if (offset > buf_sz)
+      return false;
+    if (type == 41 && i >= (unsigned int)(h->ancount + h->nscount)) {
+      *start = s;
+      *end = offset;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+  rebuild the query of a (truncated) response for a retry: header with
+  the query flags, the question, and the EDNS OPT record of the
+  response if it can be found (the DO bit is copied to responses)
+*/
+bool make_retry_query(const uint8_t *buf, size_t buf_sz, const dns_hdr_t *h, string &q)
+{
+  if (h->qend == 0 || h->qdcount == 0)
+    return false;
+
+  size_t opt_start = 0, opt_end = 0;
+  bool has_opt = find_opt_rr(buf, buf_sz, h, &opt_start, &opt_end);
+
+  q.assign((const char *)buf, h->qend);
+  q[2] &= 0x79;                    //clear qr, aa, tc; keep opcode and rd
+  q[3] &= 0x30;                    //clear ra and rcode; keep ad and cd
+  q[6] = q[7] = q[8] = q[9] = 0;   //no answer and authority records
+  q[10] = 0;
+  q[11] = has_opt ? 1 : 0;
+  if (has_opt) {
+    size_t name_end = skip_dns_name(buf, buf_sz, opt_start);
+    size_t ttl = q.size() + (name_end - opt_start) + 4;
+    q.append((const char *)buf + opt_start, opt_end - opt_start);
+    q[ttl] = 0;                    //extended rcode; keep version and DO
+  }
+  return true;
+}
+
+/*
+  add an EDNS option to a message: to its OPT record, or to a new OPT
+  record with a 512-byte payload size so that the server answers as it
+  would without EDNS
+*/
+bool add_edns_option(string &pkt, uint16_t code, const string &data)
+{
+  dns_hdr_t h;
+  if (!parse_dns_hdr((const uint8_t *)pkt.data(), pkt.size(), &h) || h.qend == 0)
+    return false;
+
+  string o;
+  o += (char)(code >> 8);
+  o += (char)(code & 0xFF);
+  o += (char)(data.size() >> 8);
+  o += (char)(data.size() & 0xFF);
+  o += data;
+
+  size_t opt_start = 0, opt_end = 0;
+  if (find_opt_rr((const uint8_t *)pkt.data(), pkt.size(), &h, &opt_start, &opt_end)) {
+    size_t rdlen_off = skip_dns_name((const uint8_t *)pkt.data(), pkt.size(), opt_start) + 8;
+    size_t rdlen = (opt_end - rdlen_off - 2) + o.size();
+    if (rdlen > 0xFFFF)
+      return false;
+    pkt[rdlen_off] = (char)(rdlen >> 8);
+    pkt[rdlen_off + 1] = (char)(rdlen & 0xFF);
+    pkt.insert(opt_end, o);
+    return true;
+  }
+
+  if (h.arcount == 0xFFFF)
+    return false;
+  uint16_t arcount = h.arcount + 1;
+  pkt[10] = (char)(arcount >> 8);
+  pkt[11] = (char)(arcount & 0xFF);
+  const char rr[] = {0, 0, 41, 0x02, 0x00, 0, 0, 0, 0}; //root, OPT, 512, ttl 0
+  pkt.append(rr, sizeof(rr));
+  pkt += (char)(o.size() >> 8);
+  pkt += (char)(o.size() & 0xFF);
+  pkt += o;
+  return true;
+}
+
+/*
+  get the data of an EDNS option of a message
+*/
+bool get_edns_option(const uint8_t *buf, size_t buf_sz, uint16_t code, string &data)
+{
+  dns_hdr_t h;
+  size_t opt_start = 0, opt_end = 0;
+  if (!parse_dns_hdr(buf, buf_sz, &h) || !find_opt_rr(buf, buf_sz, &h, &opt_start, &opt_end))
+    return false;
+  size_t offset = skip_dns_name(buf, buf_sz, opt_start) + 10;
+  while (offset + 4 <= opt_end) {
+    uint16_t c = (buf[offset] << 8) | buf[offset + 1];
+    uint16_t len = (buf[offset + 2] << 8) | buf[offset + 3];
+    offset += 4;
+    if (offset + len > opt_end)
+      return false;
+    if (c == code) {
+      data.assign((const char *)buf + offset, len);
+      return true;
+    }
+    offset += len;
+  }
+  return false;
+}
@@ -22,6 +22,8 @@
 #include <stdint.h>
 #include <string>
 
+#define EDNS_SEQ_OPTION 65001   //local/experimental EDNS option code of the replay sequence number
+
 struct query_t
 {
   const char *qname;
@@ -29,12 +31,41 @@ struct query_t
   const char *qclass;
 };
 
+//fields of a DNS message read from the fixed 12-byte header and the
+//question section, without a full ldns parse
+struct dns_hdr_t
+{
+  uint16_t id;
+  uint8_t opcode;
+  uint8_t rcode;
+  bool qr;
+  bool aa;
+  bool tc;
+  bool rd;
+  bool ra;
+  uint16_t qdcount;
+  uint16_t ancount;
+  uint16_t nscount;
+  uint16_t arcount;
+  size_t qend;      //offset of the end of the question section, 0 if malformed
+};
+
 bool build_dns_query(uint8_t **, size_t *, query_t *);
 bool build_dns_pkt(uint8_t **, size_t *);
 void print_dns_pkt(uint8_t *, int);
 bool is_query(uint8_t *, size_t, bool);
 void set_random_id(uint8_t *);
 uint16_t get_id(uint8_t *);
+bool parse_dns_hdr(const uint8_t *, size_t, dns_hdr_t *);
+size_t skip_dns_name(const uint8_t *, size_t, size_t);
+std::string msg_key(const uint8_t *, const dns_hdr_t *);
+std::string question_str(const uint8_t *, size_t, const dns_hdr_t *);
+const char *rcode_str(uint8_t);
+std::string hdr_flags_str(const dns_hdr_t *);
+bool find_opt_rr(const uint8_t *, size_t, const dns_hdr_t *, size_t *, size_t *);
+bool make_retry_query(const uint8_t *, size_t, const dns_hdr_t *, std::string &);
+bool add_edns_option(std::string &, uint16_t, const std::string &);
+bool get_edns_option(const uint8_t *, size_t, uint16_t, std::string &);
 
 std::string get_query_rr_str(uint8_t *, size_t);
 
@@ -27,4 +27,8 @@ extern bool verbose_log;
 #include <sys/types.h> //pid_t
 #include <unistd.h>    //getpid
 
+//flag in the length of a manager to worker frame: the message syncs the
+//trace start time
+#define FRAME_SYNC 0x80000000U
+
 #endif  //GLOBAL_VAR_H
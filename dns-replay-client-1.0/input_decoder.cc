@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2018 by the University of Southern California
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "input_decoder.hh"
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+using namespace std;
+
+#define DECODE_IN_SIZE     (1 << 20)   //bytes of input read at once
+#define DECODE_CHUNK       (1 << 20)   //decoded bytes handed to the reader at once
+#define DECODE_QUEUE_LEN   16          //decoded chunks kept ahead of the reader
+#define DECODE_MAX_THREADS 8           //xz decoder threads
+#define MAGIC_LEN          6
+
+static const unsigned char gzip_magic[] = {0x1f, 0x8b};
+static const unsigned char xz_magic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+static const unsigned char zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+InputDecoder::InputDecoder(string fn)
+{
+  path = fn;
+  is_stdin = (fn == "-");
+  if (is_stdin)
+    fd = STDIN_FILENO;
+  else if ((fd = open(fn.c_str(), O_RDONLY)) == -1)
+    err(1, "cannot open input file");
+
+  //the magic is decoded with the rest; a pipe may return it in pieces
+  head.resize(MAGIC_LEN);
+  size_t n = 0, r = 0;
+  while (n < head.size() && (r = read_in(&head[n], head.size() - n)) > 0)
+    n += r;
+  head.resize(n);
+  codec = codec_of(head.data(), head.size());
+
+  memset(&zs, 0, sizeof(zs));
+  if (codec == INPUT_CODEC_GZIP) {
+    //15 + 32: default window, gzip or zlib header
+    if (inflateInit2(&zs, 15 + 32) != Z_OK)
+      errx(1, "inflateInit2 fails");
+  } else if (codec == INPUT_CODEC_XZ) {
+#if LZMA_VERSION >= 50040002U
+    //blocks are decoded in parallel when the file has several of them
+    //(xz -T), one thread decodes a single block file
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = min(max(thread::hardware_concurrency(), 1U), (unsigned int)DECODE_MAX_THREADS);
+    mt.memlimit_threading = lzma_physmem() / 4;
+    mt.memlimit_stop = UINT64_MAX;
+    if (lzma_stream_decoder_mt(&ls, &mt) != LZMA_OK)
+      errx(1, "lzma_stream_decoder_mt fails");
+#else
+    if (lzma_stream_decoder(&ls, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+      errx(1, "lzma_stream_decoder fails");
+#endif
+  } else if (codec == INPUT_CODEC_ZSTD) {
+#ifdef HAVE_ZSTD
+    zds = ZSTD_createDCtx();
+    if (!zds)
+      errx(1, "ZSTD_createDCtx fails");
+#else
+    errx(1, "zstd input is not supported, build with -DHAVE_ZSTD");
+#endif
+  }
+
+  out = new string(DECODE_CHUNK, '\0');
+  th = thread(&InputDecoder::decode_loop, this);
+}
+
+InputDecoder::~InputDecoder()
+{
+  {
+    lock_guard<mutex> lk(mtx);
+    stopping = true;
+  }
+  cv.notify_all();
+  th.join();
+  for (auto c : chunks)
+    delete c;
+  for (auto c : spare)
+    delete c;
+  delete cur;
+  delete out;
+
+  if (codec == INPUT_CODEC_GZIP)
+    inflateEnd(&zs);
+  else if (codec == INPUT_CODEC_XZ)
+    lzma_end(&ls);
+#ifdef HAVE_ZSTD
+  else if (codec == INPUT_CODEC_ZSTD)
+    ZSTD_freeDCtx(zds);
+#endif
+  if (!is_stdin)
+    close(fd);
+}
+
+unsigned int InputDecoder::codec_of(const char *d, size_t len)
+{
+  if (len >= sizeof(gzip_magic) && memcmp(d, gzip_magic, sizeof(gzip_magic)) == 0)
+    return INPUT_CODEC_GZIP;
+  if (len >= sizeof(xz_magic) && memcmp(d, xz_magic, sizeof(xz_magic)) == 0)
+    return INPUT_CODEC_XZ;
+  if (len >= sizeof(zstd_magic) && memcmp(d, zstd_magic, sizeof(zstd_magic)) == 0)
+    return INPUT_CODEC_ZSTD;
+  return INPUT_CODEC_NONE;
+}
+
+/*
+  codec of a file by its first bytes; stdin is not looked at, the
+  decoder finds its codec when it reads it
+*/
+unsigned int InputDecoder::detect(string fn)
+{
+  if (fn == "-")
+    return INPUT_CODEC_NONE;
+  int f = open(fn.c_str(), O_RDONLY);
+  if (f == -1)
+    return INPUT_CODEC_NONE; //the caller reports it when it opens the file
+  char b[MAGIC_LEN];
+  ssize_t n = read(f, b, sizeof(b));
+  close(f);
+  return (n > 0 ? codec_of(b, n) : INPUT_CODEC_NONE);
+}
+
+const char *InputDecoder::codec_name(unsigned int c)
+{
+  switch (c) {
+  case INPUT_CODEC_GZIP:
+    return "gzip";
+  case INPUT_CODEC_XZ:
+    return "xz";
+  case INPUT_CODEC_ZSTD:
+    return "zstd";
+  default:
+    return "none";
+  }
+}
+
+/*
+  next decoded chunk, waiting for the decoder thread; the chunk read
+  before is given back to it for reuse
+*/
+InputDecoder::int_type InputDecoder::underflow()
+{
+  if (gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+  unique_lock<mutex> lk(mtx);
+  if (cur) {
+    spare.push_back(cur);
+    cur = NULL;
+  }
+  cv.wait(lk, [this] { return ended || !chunks.empty(); });
+  if (chunks.empty()) {
+    setg(NULL, NULL, NULL);
+    return traits_type::eof();
+  }
+  cur = chunks.front();
+  chunks.pop_front();
+  lk.unlock();
+  cv.notify_all();
+  char *b = &(*cur)[0];
+  setg(b, b, b + cur->size());
+  return traits_type::to_int_type(*gptr());
+}
+
+size_t InputDecoder::read_in(char *d, size_t len)
+{
+  while (true) {
+    ssize_t n = read(fd, d, len);
+    if (n >= 0)
+      return n;
+    if (errno == EINTR)
+      continue;
+    warn("[warn] fail to read input");
+    return 0;
+  }
+}
+
+void InputDecoder::decode_loop()
+{
+  bool ok = decode(head.data(), head.size(), head.empty());
+  in_buf.resize(DECODE_IN_SIZE);
+  while (ok && !head.empty()) {
+    size_t n = read_in(&in_buf[0], in_buf.size());
+    ok = decode(in_buf.data(), n, n == 0);
+    if (n == 0)
+      break;
+  }
+  if (ok && frame_open)
+    warnx("[warn] %s input %s is truncated", codec_name(codec), path.c_str());
+  if (ok)
+    push_out();
+  {
+    lock_guard<mutex> lk(mtx);
+    ended = true;
+  }
+  cv.notify_all();
+}
+
+/*
+  decode len bytes of input into the chunks; end is set once, with no
+  input, at the end of the file. return false on a corrupt input or
+  when the reader is gone
+*/
+bool InputDecoder::decode(const char *d, size_t len, bool end)
+{
+  switch (codec) {
+  case INPUT_CODEC_NONE:
+    while (len > 0) {
+      size_t k = min(len, (size_t)DECODE_CHUNK - out_len);
+      memcpy(&(*out)[out_len], d, k);
+      out_len += k;
+      d += k;
+      len -= k;
+      if (out_len == DECODE_CHUNK && !push_out())
+	return false;
+    }
+    return true;
+
+  case INPUT_CODEC_GZIP:
+    zs.next_in = (Bytef *)d;
+    zs.avail_in = len;
+    while (true) {
+      zs.next_out = (Bytef *)&(*out)[out_len];
+      zs.avail_out = DECODE_CHUNK - out_len;
+      int r = inflate(&zs, Z_NO_FLUSH);
+      out_len = DECODE_CHUNK - zs.avail_out;
+      if (r == Z_STREAM_END) {
+	inflateReset(&zs); //next member of concatenated files
+	frame_open = false;
+      } else if (r == Z_OK) {
+	frame_open = true;
+      } else if (r != Z_BUF_ERROR) {
+	warnx("[warn] gzip input %s is corrupt: %s", path.c_str(), (zs.msg ? zs.msg : "unknown"));
+	return false;
+      }
+      if (out_len == DECODE_CHUNK) {
+	if (!push_out())
+	  return false;
+      } else if (zs.avail_in == 0) {
+	break;
+      }
+    }
+    return true;
+
+  case INPUT_CODEC_XZ:
+    ls.next_in = (const uint8_t *)d;
+    ls.avail_in = len;
+    while (true) {
+      ls.next_out = (uint8_t *)&(*out)[out_len];
+      ls.avail_out = DECODE_CHUNK - out_len;
+      lzma_ret r = lzma_code(&ls, (end ? LZMA_FINISH : LZMA_RUN));
+      out_len = DECODE_CHUNK - ls.avail_out;
+      if (r == LZMA_STREAM_END)
+	break;
+      if (r != LZMA_OK) {
+	warnx("[warn] xz input %s is corrupt or truncated (%d)", path.c_str(), (int)r);
+	return false;
+      }
+      if (out_len == DECODE_CHUNK) {
+	if (!push_out())
+	  return false;
+      } else if (ls.avail_in == 0 && !end) {
+	break;
+      }
+    }
+    return true;
+
+#ifdef HAVE_ZSTD
+  case INPUT_CODEC_ZSTD: {
+    ZSTD_inBuffer ib = {d, len, 0};
+    while (true) {
+      ZSTD_outBuffer ob = {&(*out)[0], DECODE_CHUNK, out_len};
+      size_t r = ZSTD_decompressStream(zds, &ob, &ib);
+      out_len = ob.pos;
+      if (ZSTD_isError(r)) {
+	warnx("[warn] zstd input %s is corrupt: %s", path.c_str(), ZSTD_getErrorName(r));
+	return false;
+      }
+      frame_open = (r != 0);
+      if (out_len == DECODE_CHUNK) {
+	if (!push_out())
+	  return false;
+      } else if (ib.pos == ib.size) {
+	break;
+      }
+    }
+    return true;
+  }
+#endif
+
+  default:
+    return false;
+  }
+}
+
+/*
+  hand the decoded chunk to the reader, waiting while it is
+  DECODE_QUEUE_LEN chunks behind; return false when it is gone
+*/
+bool InputDecoder::push_out()
+{
+  if (out_len == 0)
+    return true;
+  out->resize(out_len);
+  unique_lock<mutex> lk(mtx);
+  cv.wait(lk, [this] { return stopping || chunks.size() < DECODE_QUEUE_LEN; });
+  if (stopping)
+    return false;
+  chunks.push_back(out);
+  if (!spare.empty()) {
+    out = spare.back();
+    spare.pop_back();
+  } else {
+    out = new string;
+  }
+  lk.unlock();
+  cv.notify_all();
+  out->resize(DECODE_CHUNK);
+  out_len = 0;
+  return true;
+}
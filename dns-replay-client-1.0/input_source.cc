@@ -24,10 +24,16 @@
 #include <cassert>
 #include <cstring>
 #include <vector>
+#include <cmath>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "utility.hh"
 using namespace std;
 
-#define BUF_SIZE  4096
+#define READ_AHEAD (16 * 1024 * 1024)  //bytes of a mapped file asked to be read ahead
 
 unordered_map<string, unsigned int> input_src_map = {
   {"text",  INPUT_SRC_TEXT},
@@ -58,7 +64,9 @@ InputSource::InputSource(string fn, string ft)
       trace_cleanup();
       err(1, "cannot start trace");
     }
-  } else if (!is_stdin) { //not read from stdin: open input file
+  } else if (!is_stdin && InputDecoder::detect(fn) == INPUT_CODEC_NONE) { //plain input file
+    if ((input_format & INPUT_SRC_RAW) && map_file(fn))
+      return;
     if (input_format & INPUT_SRC_TEXT) {
       ifs.open(fn);
     } else if (input_format & INPUT_SRC_RAW) {
@@ -66,6 +74,12 @@ InputSource::InputSource(string fn, string ft)
     }
     if (!ifs.is_open())
       err(1, "cannot open input file");
+    input.rdbuf(ifs.rdbuf());
+  } else { //stdin or compressed file: decoded by its own thread
+    dec = new InputDecoder(fn);
+    input.rdbuf(dec);
+    LOG(LOG_DBG, "[%d] input %s compression: %s\n", my_pid, fn.c_str(),
+	InputDecoder::codec_name(dec->get_codec()));
   }
 }
 
@@ -73,10 +87,62 @@ InputSource::~InputSource()
 {
   if (input_format & INPUT_SRC_TRACE)
     trace_cleanup();
+  else if (map)
+    munmap((void *)map, map_len);
+  else if (dec)
+    delete dec;
   else if (!is_stdin)
     ifs.close();
 }
 
+/*
+  map a raw regular file for reading in place; return false to read it
+  as a stream
+*/
+bool InputSource::map_file(const string &fn)
+{
+  int fd = open(fn.c_str(), O_RDONLY);
+  if (fd == -1)
+    err(1, "cannot open input file");
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); //the mapping keeps the file
+  if (p == MAP_FAILED) {
+    warn("[warn] cannot map input file, read it as a stream");
+    return false;
+  }
+  map = (const char *)p;
+  map_len = st.st_size;
+  madvise(p, map_len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise(p, map_len, MADV_HUGEPAGE); //a hint, the file system may not do it
+#endif
+  read_ahead();
+  LOG(LOG_DBG, "[%d] mapped %lu bytes of raw input\n", my_pid, map_len);
+  return true;
+}
+
+/*
+  ask the kernel to read the next part of the mapped file in the
+  background, and drop the pages already read
+*/
+void InputSource::read_ahead()
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  if (map_pos > drop_pos + READ_AHEAD) {
+    size_t done = (map_pos - READ_AHEAD) & ~(page - 1);
+    madvise((void *)(map + drop_pos), done - drop_pos, MADV_DONTNEED);
+    drop_pos = done;
+  }
+  size_t len = min((size_t)READ_AHEAD, map_len - ahead_pos);
+  madvise((void *)(map + ahead_pos), len, MADV_WILLNEED);
+  ahead_pos += len;
+}
+
 void InputSource::trace_cleanup()
 {
   log_dbg("clean up trace");
@@ -117,41 +183,146 @@ trace_replay::DNSMsg *InputSource::get()
 
 bool InputSource::read_bytes (char *buf, size_t n)
 {
-  if (is_stdin) {
-    if (n != fread((void *)buf, 1, n, stdin)) {
-      warn("[warn] fail to read stdin");
+  if (!input.read(buf, n)) {
+    warn("[warn] fail to read %s", (is_stdin ? "stdin" : "file"));
+    return false;
+  }
+  return true;
+}
+
+trace_replay::DNSMsg *InputSource::get_from_raw()
+{
+  const char *d = NULL;
+  size_t sz = 0;
+  if (!get_raw_view(d, sz))
+    return NULL;
+  trace_replay::DNSMsg *msg = new trace_replay::DNSMsg();
+  assert(msg);
+  msg->ParseFromArray(d, sz);
+  return msg;
+}
+
+/*
+  next record of raw input as it is, without parsing it: in place in
+  a mapped file, or in a buffer reused by the next call
+*/
+bool InputSource::get_raw_view(const char *&d, size_t &len)
+{
+  if (input_format != INPUT_SRC_RAW)
+    return false;
+  uint32_t sz = 0;
+  if (map) {
+    if (map_len - map_pos < sizeof(sz))
+      return false;
+    memcpy(&sz, map + map_pos, sizeof(sz));
+    sz = ntohl(sz);
+    if (sz >= FRAME_SYNC) {
+      warnx("[warn] raw record of %u bytes is invalid", sz);
+      return false;
+    }
+    if (sz > map_len - map_pos - sizeof(sz)) {
+      warnx("[warn] raw record of %u bytes is truncated", sz);
       return false;
     }
+    d = map + map_pos + sizeof(sz);
+    len = sz;
+    map_pos += sizeof(sz) + sz;
+    if (map_pos + READ_AHEAD / 2 > ahead_pos && ahead_pos < map_len)
+      read_ahead();
   } else {
-    if (!ifs.read(buf, n)) {
-      warn("[warn] fail to read file");
+    if (!read_bytes((char *)&sz, sizeof(sz)))
+      return false;
+    sz = ntohl(sz);
+    if (sz >= FRAME_SYNC) {
+      warnx("[warn] raw record of %u bytes is invalid", sz);
       return false;
     }
+    raw_buf.resize(sz);
+    if (!read_bytes(&raw_buf[0], sz))
+      return false;
+    d = raw_buf.data();
+    len = sz;
   }
   return true;
 }
 
-trace_replay::DNSMsg *InputSource::get_from_raw()
+bool InputSource::get_raw(string &rec)
 {
-  uint32_t sz = 0;
-  char buf[BUF_SIZE];
-  while(true) {
-    sz = 0;
-    if (!read_bytes((char *)&sz, sizeof(sz)))
-      break;
+  const char *d = NULL;
+  size_t sz = 0;
+  if (!get_raw_view(d, sz))
+    return false;
+  rec.assign(d, sz);
+  return true;
+}
 
-    sz = ntohl(sz);
-    
-    memset(buf, 0, sizeof(buf));
-    if (!read_bytes(buf, sz))
-      break;
+/*
+  read a protobuf varint; return false past the end
+*/
+static bool scan_varint(const uint8_t *&p, const uint8_t *end, uint64_t *v)
+{
+  *v = 0;
+  for (int shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t b = *p++;
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
 
-    trace_replay::DNSMsg *msg = new trace_replay::DNSMsg();
-    assert(msg);
-    msg->ParseFromArray(buf, sz);
-    return msg;
+/*
+  find the fields the manager needs in a serialized DNSMsg by walking
+  its wire format; other fields are skipped. Return false if the
+  message is malformed.
+*/
+bool scan_dns_msg(const char *buf, size_t len, msg_fields_t *f)
+{
+  const uint8_t *p = (const uint8_t *)buf, *end = p + len;
+  *f = msg_fields_t();
+  while (p < end) {
+    uint64_t key, v;
+    if (!scan_varint(p, end, &key))
+      return false;
+    switch (key & 7) {
+    case 0: //varint
+      if (!scan_varint(p, end, &v))
+	return false;
+      if ((key >> 3) == 1)
+	f->seconds = (int64_t)v;
+      else if ((key >> 3) == 2)
+	f->microseconds = (int32_t)v;
+      else if ((key >> 3) == 3)
+	f->tcp = (v != 0);
+      else if ((key >> 3) == 9)
+	f->sync_time = (v != 0);
+      break;
+    case 1: //64-bit
+      if (end - p < 8)
+	return false;
+      p += 8;
+      break;
+    case 2: //length delimited
+      if (!scan_varint(p, end, &v) || v > (uint64_t)(end - p))
+	return false;
+      if ((key >> 3) == 6) {
+	f->src_ip = (const char *)p;
+	f->src_ip_len = v;
+      } else if ((key >> 3) == 8) {
+	f->raw_len = v;
+      }
+      p += v;
+      break;
+    case 5: //32-bit
+      if (end - p < 4)
+	return false;
+      p += 4;
+      break;
+    default:
+      return false;
+    }
   }
-  return NULL;
+  return true;
 }
 
 trace_replay::DNSMsg *InputSource::get_from_text()
@@ -159,7 +330,7 @@ trace_replay::DNSMsg *InputSource::get_from_text()
   string line;
   do {
     line.clear();
-    if (!getline((is_stdin ? (cin):(ifs)), line))
+    if (!getline(input, line))
       return NULL;
   } while (line.length() == 0 || line == "\n" || line.at(0) == '#');
 
@@ -371,3 +542,197 @@ void InputSource::log_dbg(const char *s)
 {
   LOG(LOG_DBG, "[%d] %s\n", my_pid, s);
 }
+
+/*
+  inputs separated by commas, each FILE[@OFFSET[:RATE]] with OFFSET in
+  seconds and RATE a multiplier of the query rate; window is the
+  records of an input that may be out of order
+*/
+InputMerge::InputMerge(string fns, string ft, int w)
+{
+  my_pid = getpid();
+  window = w;
+  size_t pos = 0;
+  while (pos <= fns.size()) {
+    size_t comma = fns.find(',', pos);
+    if (comma == string::npos)
+      comma = fns.size();
+    string spec = fns.substr(pos, comma - pos);
+    pos = comma + 1;
+
+    merge_input_t in;
+    size_t at = spec.rfind('@');
+    in.file = spec.substr(0, at);
+    if (at != string::npos) {
+      string t = spec.substr(at + 1);
+      size_t colon = t.find(':');
+      try {
+	size_t n = 0;
+	string o = t.substr(0, colon);
+	if (!o.empty())
+	  in.offset_us = llround(stod(o, &n) * 1000000);
+	if (n != o.size())
+	  throw invalid_argument(o);
+	if (colon != string::npos) {
+	  string r = t.substr(colon + 1);
+	  in.rate = stod(r, &n);
+	  if (n != r.size() || in.rate <= 0)
+	    throw invalid_argument(r);
+	}
+      } catch (const exception &e) {
+	errx(1, "[error] input %s has invalid offset or rate, abort!", spec.c_str());
+      }
+    }
+    if (in.file.empty())
+      errx(1, "[error] input file is empty in %s, abort!", fns.c_str());
+    if (in.file == "-" && !inputs.empty())
+      errx(1, "[error] standard input must be the only input, abort!");
+    in.ins = new InputSource(in.file, ft);
+    inputs.push_back(in);
+  }
+  direct = (inputs.size() == 1 && window == 0 &&
+	    inputs[0].offset_us == 0 && inputs[0].rate == 1.0);
+  LOG(LOG_DBG, "[%d] merge %lu inputs with a window of %d records\n", my_pid, inputs.size(), window);
+}
+
+InputMerge::~InputMerge()
+{
+  for (merge_rec_t &r : heap)
+    delete r.msg;
+  for (merge_input_t &in : inputs)
+    delete in.ins;
+  if (late > 0)
+    LOG(LOG_INFO, "[%d] %llu input records are out of order beyond the reorder window\n", my_pid,
+	(long long unsigned int)late);
+}
+
+static bool merge_rec_after(const merge_rec_t &a, const merge_rec_t &b)
+{
+  return a.ts > b.ts || (a.ts == b.ts && a.seq > b.seq);
+}
+
+/*
+  time of a record after the offset and the rate of its input
+*/
+int64_t InputMerge::adjust(merge_input_t &in, int64_t ts)
+{
+  if (in.base_us < 0)
+    in.base_us = ts;
+  if (in.rate != 1.0)
+    ts = in.base_us + llround((ts - in.base_us) / in.rate);
+  return max(ts + in.offset_us, (int64_t)0);
+}
+
+/*
+  read the next valid record of input i into the heap; return false at
+  the end of the input
+*/
+bool InputMerge::fill(int i)
+{
+  merge_input_t &in = inputs[i];
+  merge_rec_t r;
+  r.input = i;
+  r.msg = NULL;
+  if (raw_mode) {
+    msg_fields_t f;
+    while (true) {
+      if (!in.ins->get_raw(r.rec))
+	return false;
+      if (scan_dns_msg(r.rec.data(), r.rec.size(), &f) && f.raw_len > 0)
+	break;
+    }
+    int64_t ts = f.seconds * 1000000 + f.microseconds;
+    r.ts = adjust(in, ts);
+    if (r.ts != ts) { //the time is in the record
+      trace_replay::DNSMsg msg;
+      msg.ParseFromString(r.rec);
+      msg.set_seconds(r.ts / 1000000);
+      msg.set_microseconds(r.ts % 1000000);
+      r.rec.clear();
+      msg.SerializeToString(&r.rec);
+    }
+  } else {
+    while (true) {
+      r.msg = in.ins->get();
+      if (r.msg == NULL)
+	return false;
+      if (!r.msg->raw().empty())
+	break;
+      delete r.msg; //not a valid query
+    }
+    int64_t ts = r.msg->seconds() * 1000000 + r.msg->microseconds();
+    r.ts = adjust(in, ts);
+    if (r.ts != ts) {
+      r.msg->set_seconds(r.ts / 1000000);
+      r.msg->set_microseconds(r.ts % 1000000);
+    }
+  }
+  r.seq = seq++;
+  heap.push_back(move(r));
+  push_heap(heap.begin(), heap.end(), merge_rec_after);
+  return true;
+}
+
+void InputMerge::start(bool raw)
+{
+  started = true;
+  raw_mode = raw;
+  if (direct)
+    return;
+  heap.reserve(inputs.size() * (window + 1));
+  for (size_t i = 0; i < inputs.size(); i++)
+    for (int k = 0; k <= window && fill(i); k++)
+      ;
+}
+
+/*
+  take the earliest record and read the next one of its input
+*/
+bool InputMerge::pop(merge_rec_t &r)
+{
+  if (heap.empty())
+    return false;
+  pop_heap(heap.begin(), heap.end(), merge_rec_after);
+  r = move(heap.back());
+  heap.pop_back();
+  fill(r.input);
+  if (r.ts < last_ts)
+    late += 1;
+  else
+    last_ts = r.ts;
+  return true;
+}
+
+/*
+  same as InputSource::get, but invalid queries are skipped
+*/
+trace_replay::DNSMsg *InputMerge::get()
+{
+  if (!started)
+    start(false);
+  if (direct)
+    return inputs[0].ins->get();
+  merge_rec_t r;
+  if (!pop(r))
+    return NULL;
+  return r.msg;
+}
+
+/*
+  same as InputSource::get_raw_view, but malformed records and invalid
+  queries are skipped
+*/
+bool InputMerge::get_raw_view(const char *&d, size_t &len)
+{
+  if (!started)
+    start(true);
+  if (direct)
+    return inputs[0].ins->get_raw_view(d, len);
+  merge_rec_t r;
+  if (!pop(r))
+    return false;
+  view_buf.swap(r.rec);
+  d = view_buf.data();
+  len = view_buf.size();
+  return true;
+}
@@ -32,23 +32,81 @@ using namespace std;
 int log_level = LOG_INFO;
 bool verbose_log = false;
 
+//long options without a short form
+enum {
+  OPT_STATS_INTERVAL = 256,
+  OPT_COMPRESS,
+  OPT_ROTATE_SIZE,
+  OPT_ROTATE_TIME,
+  OPT_CONN_RATE,
+  OPT_CONN_BURST,
+  OPT_CONN_QUEUE,
+  OPT_TLS_HELPERS,
+  OPT_KTLS,
+  OPT_SERVER_POLICY,
+  OPT_TC_FALLBACK,
+  OPT_KERNEL_TS,
+  OPT_UDP_POOL,
+  OPT_UDP_POOL_POLICY,
+  OPT_EXPECTED_QPS,
+  OPT_UDP_RCVBUF,
+  OPT_UDP_SNDBUF,
+  OPT_SEQ_TAG,
+  OPT_CONN_DETAIL,
+  OPT_UDP_RETRY,
+  OPT_UDP_RETRIES,
+  OPT_UDP_BACKOFF,
+  OPT_SAMPLE,
+  OPT_SAMPLE_BY,
+  OPT_SHM_RING,
+  OPT_WORKER_MAP,
+  OPT_MAP_SEED,
+  OPT_CREDITS,
+  OPT_REORDER,
+  OPT_PRELOAD,
+  OPT_START_MARGIN,
+  OPT_HOT_SHARE,
+  OPT_HOT_SPREAD,
+  OPT_HOT_STICKY_TCP,
+  OPT_MAX_WORKERS,
+  OPT_SCALE_LAG,
+};
+
 void usage(const char *comm) {
   cerr << " Usage:\n " <<
     comm << " [-i FORMAT:FILE] [-o FORMAT:FILE] [-s IP:PORT] [-r IP:PORT] [-n NUMBER]\n"
     "         [-c TYPE] [-t TIMEOUT] [-l SECONDS] [-p SECONDS]\n"
-    "         [-u] [-d] [-f] [-v] [-V] [-h]\n"
+    "         [-u] [-d] [-f] [-v] [-V] [-h] [--stats-interval SECONDS]\n"
+    "         [--compress TYPE] [--rotate-size MB] [--rotate-time SECONDS]\n"
+    "         [--conn-rate NUMBER] [--conn-burst NUMBER] [--conn-queue NUMBER]\n"
+    "         [--tls-helpers NUMBER] [--ktls] [--server-policy POLICY]\n"
+    "         [--tc-fallback] [--kernel-ts] [--udp-pool NUMBER]\n"
+    "         [--udp-pool-policy POLICY] [--expected-qps NUMBER]\n"
+    "         [--udp-rcvbuf KB] [--udp-sndbuf KB] [--seq-tag RUNID]\n"
+    "         [--conn-detail] [--udp-retry MS] [--udp-retries NUMBER]\n"
+    "         [--udp-backoff FACTOR] [--sample NUMBER] [--sample-by KEY]\n"
+    "         [--shm-ring KB] [--worker-map POLICY] [--map-seed NUMBER]\n"
+    "         [--credits NUMBER] [--reorder NUMBER] [--preload SECONDS]\n"
+    "         [--start-margin MS] [--hot-share PERCENT] [--hot-spread NUMBER]\n"
+    "         [--hot-sticky-tcp] [--max-workers NUMBER] [--scale-lag MS]\n"
     " -i/--input FORMAT:FILE    input stream, required without -d\n"
     "                           format and file separated by colon like FORMAT:PATH\n"
     "                           accepted format: trace, text, raw\n"
     "                           e.g. trace:test.pcap, text:test.fsdb, raw:test.raw\n"
     "                           use '-' as FILE to read from stdin\n"
+    "                           gzip, xz or zstd input is decompressed\n"
+    "                           FILE may list inputs separated by commas, merged\n"
+    "                           by time, each FILE[@OFFSET[:RATE]] to shift it\n"
+    "                           OFFSET seconds and multiply its query rate\n"
     " -o/--output FORMAT:FILE   optional output file; accepted format: latency, timing\n"
     "                           latency: output the latency of each query\n"
     "                           timing: output the timing of each query and response\n"
     "                           format and file separated by colon like FORMAT:PATH\n"
     "                           use '-' as FILE to write to stdout\n"
-    " -s/--server SERVER        server address and port, separated by colon\n"
-    "                           e.g. 1.2.3.4:53\n"
+    " -s/--server SERVERS       server address and port, separated by colon\n"
+    "                           e.g. 1.2.3.4:53; several servers are separated by\n"
+    "                           commas, each with an optional weight after '@'\n"
+    "                           e.g. 1.2.3.4:53@2,1.2.3.5:53\n"
     " -r/--controller ADDRESS   address and port to receive message from controller\n"
     "                           e.g. 5.6.7.8:2018, required in distributed mode (-d)\n"
     " -n/--num-workers NUMBER   number of worker processes\n"
@@ -70,6 +128,72 @@ void usage(const char *comm) {
     "                           this also disables address to worker mapping\n"
     " -d/--distribute           distributed mode with reading input stream from controller\n"
     " -f/--fast                 send input queries immediately instead of timer\n"
+    " --stats-interval SECONDS  write per-worker response stats (rcode, flags,\n"
+    "                           empty answers) every SECONDS as '#stats' lines\n"
+    "                           default is 0: no periodic stats\n"
+    " --compress TYPE           compress the output file: none, gzip, xz or zstd\n"
+    "                           default is none\n"
+    " --rotate-size MB          start a new output file FILE.N every MB megabytes\n"
+    " --rotate-time SECONDS     start a new output file FILE.N every SECONDS\n"
+    " --conn-rate NUMBER        new tcp/tls connections per second per worker\n"
+    "                           queries wait for a connection; default 0: no pacing\n"
+    " --conn-burst NUMBER       connections opened back to back, default is 1\n"
+    " --conn-queue NUMBER       queries waiting for connections per worker\n"
+    "                           more are dropped; default is 10000\n"
+    " --tls-helpers NUMBER      threads per worker doing tls handshakes (-c tls)\n"
+    "                           default 0: handshakes run in the worker event loop\n"
+    " --ktls                    move established tls sessions to Linux kernel tls\n"
+    "                           (tls 1.2); uses at least one tls helper\n"
+    " --server-policy POLICY    server for a query with several servers (-s)\n"
+    "                           hash: by source ip, weighted (default)\n"
+    "                           rr: round robin; weight: weighted round robin\n"
+    " --tc-fallback             retry truncated udp responses over tcp\n"
+    "                           the latency covers both queries\n"
+    " --kernel-ts               udp latency from kernel send and receive timestamps\n"
+    " --udp-pool NUMBER         unified udp sockets per worker and server (-u)\n"
+    "                           each on its own source port; default is 1\n"
+    " --udp-pool-policy POLICY  socket for a query: hash by source ip (default)\n"
+    "                           or rr (round robin)\n"
+    " --expected-qps NUMBER     expected queries per second per worker, used to\n"
+    "                           size the buffers of unified udp sockets (-u)\n"
+    " --udp-rcvbuf KB           receive buffer of udp sockets, overrides sizing\n"
+    " --udp-sndbuf KB           send buffer of udp sockets, overrides sizing\n"
+    " --seq-tag RUNID           tag each query with an EDNS option (code 65001)\n"
+    "                           holding RUNID (0-65535), worker and counter\n"
+    "                           the tag is added to the output lines\n"
+    " --conn-detail             split tcp/tls latency into connect, handshake,\n"
+    "                           queue and server time; log each connection\n"
+    " --udp-retry MS            retry a udp query without response after MS\n"
+    "                           milliseconds on the same socket; default no retries\n"
+    " --udp-retries NUMBER      retries before giving up a query; default is 2\n"
+    " --udp-backoff FACTOR      wait multiplied by FACTOR after each retry;\n"
+    "                           default is 2\n"
+    " --sample NUMBER           write per-query latency/timing lines for about\n"
+    "                           1 in NUMBER queries; stats keep counting all and\n"
+    "                           add a latency histogram\n"
+    " --sample-by KEY           what picks the sampled queries: query (default),\n"
+    "                           qname or src, to keep whole names or sources\n"
+    " --shm-ring KB             pass queries to each worker over a shared memory\n"
+    "                           ring of KB kilobytes instead of a socket\n"
+    " --worker-map POLICY       worker of a new source: random (default), hash\n"
+    "                           (consistent hash, no state) or load (least\n"
+    "                           recent queries)\n"
+    " --map-seed NUMBER         seed of the hash mapping; default is 0\n"
+    " --credits NUMBER          queries each worker may hold before the manager\n"
+    "                           holds its queries; default no limit\n"
+    " --reorder NUMBER          records of each input that may be out of order,\n"
+    "                           put back in order when merged; default 0\n"
+    " --start-margin MS         synchronized start: workers hold their queries\n"
+    "                           and all start MS milliseconds after the preload\n"
+    " --preload SECONDS         seconds of input given to the workers before the\n"
+    "                           start, with --start-margin; default 0\n"
+    " --hot-share PERCENT       spread a source with more than PERCENT of the\n"
+    "                           recent queries over several workers\n"
+    " --hot-spread NUMBER       workers a hot source is spread over; default 4\n"
+    " --hot-sticky-tcp          keep the tcp queries of a hot source on its worker\n"
+    " --max-workers NUMBER      elastic pool: fork NUMBER workers, start with -n\n"
+    "                           of them and add or retire workers by their lag\n"
+    " --scale-lag MS            lag of a worker that adds one; default 100\n"
     " -h/--help                 print this message\n"
     " -v/--verbose              verbose log; default is none\n"
     " -V/--version              show the program version\n"
@@ -82,19 +206,24 @@ int main(int argc, char *argv[])
   const char *comm = argv[0];
   if (argc == 1) usage(comm);
 
-  string server_ip, command_ip;
+  string command_ip;
   string input_file, input_format;
   string output_file, output_format;
   string conn_type = "adaptive", tmp, nagle;
 
   bool dist = false, non_wait = false;
-  int server_port = -1, command_port = -1;
+  int command_port = -1;
   int trace_limit = -1, time_out = 30;
   int opt = -1, status = 0, *tmp_skt = NULL;
   unsigned int i = 0, num_clients = thread::hardware_concurrency();
+  unsigned int max_workers = 0;
   uint32_t socket_unify = SOCKET_UNIFY_NONE, output_option = OUTPUT_NONE;
   pid_t child_pid, wpid, my_pid = getpid();
   double query_pace = -1.0;
+  int shm_ring_kb = 0;
+  client_opt_t client_opt;
+  manager_opt_t manager_opt;
+  vector<target_t> targets;
 
   vector<int *> paired_fd; //just keep trace of memory
   vector<int> client_fd, manager_fd, client_pid;
@@ -116,6 +245,43 @@ int main(int argc, char *argv[])
     {"unify-udp",     0, NULL, 'u'},
     {"verbose",       0, NULL, 'v'},
     {"version",       0, NULL, 'V'},
+    {"stats-interval", 1, NULL, OPT_STATS_INTERVAL},
+    {"compress",      1, NULL, OPT_COMPRESS},
+    {"rotate-size",   1, NULL, OPT_ROTATE_SIZE},
+    {"rotate-time",   1, NULL, OPT_ROTATE_TIME},
+    {"conn-rate",     1, NULL, OPT_CONN_RATE},
+    {"conn-burst",    1, NULL, OPT_CONN_BURST},
+    {"conn-queue",    1, NULL, OPT_CONN_QUEUE},
+    {"tls-helpers",   1, NULL, OPT_TLS_HELPERS},
+    {"ktls",          0, NULL, OPT_KTLS},
+    {"server-policy", 1, NULL, OPT_SERVER_POLICY},
+    {"tc-fallback",   0, NULL, OPT_TC_FALLBACK},
+    {"kernel-ts",     0, NULL, OPT_KERNEL_TS},
+    {"udp-pool",      1, NULL, OPT_UDP_POOL},
+    {"udp-pool-policy", 1, NULL, OPT_UDP_POOL_POLICY},
+    {"expected-qps",  1, NULL, OPT_EXPECTED_QPS},
+    {"udp-rcvbuf",    1, NULL, OPT_UDP_RCVBUF},
+    {"udp-sndbuf",    1, NULL, OPT_UDP_SNDBUF},
+    {"seq-tag",       1, NULL, OPT_SEQ_TAG},
+    {"conn-detail",   0, NULL, OPT_CONN_DETAIL},
+    {"udp-retry",     1, NULL, OPT_UDP_RETRY},
+    {"udp-retries",   1, NULL, OPT_UDP_RETRIES},
+    {"udp-backoff",   1, NULL, OPT_UDP_BACKOFF},
+    {"sample",        1, NULL, OPT_SAMPLE},
+    {"sample-by",     1, NULL, OPT_SAMPLE_BY},
+    {"shm-ring",      1, NULL, OPT_SHM_RING},
+    {"worker-map",    1, NULL, OPT_WORKER_MAP},
+    {"map-seed",      1, NULL, OPT_MAP_SEED},
+    {"credits",       1, NULL, OPT_CREDITS},
+    {"reorder",       1, NULL, OPT_REORDER},
+    {"preload",       1, NULL, OPT_PRELOAD},
+    {"start-margin",  1, NULL, OPT_START_MARGIN},
+    {"hot-share",     1, NULL, OPT_HOT_SHARE},
+    {"hot-spread",    1, NULL, OPT_HOT_SPREAD},
+    {"hot-sticky-tcp", 0, NULL, OPT_HOT_STICKY_TCP},
+    {"max-workers",   1, NULL, OPT_MAX_WORKERS},
+    {"scale-lag",     1, NULL, OPT_SCALE_LAG},
+    {NULL,            0, NULL, 0},
   };
 
   size_t found;
@@ -163,9 +329,8 @@ int main(int argc, char *argv[])
       command_port = stoi(tmp);
       break;
     case 's':
-      str_split(optarg, server_ip, tmp, ':');
-      check_gt0(tmp, "server port");
-      server_port = stoi(tmp);
+      targets.clear();
+      parse_targets(optarg, targets);
       break;
     case 't':
       check_gt0(optarg, "time out");
@@ -186,6 +351,148 @@ int main(int argc, char *argv[])
     case 'V':
       errx(0, VERSION);
       break;
+    case OPT_STATS_INTERVAL:
+      check_gt0(optarg, "stats interval");
+      client_opt.stats_interval = atoi(optarg);
+      break;
+    case OPT_COMPRESS:
+      manager_opt.compress = str_tolower(optarg);
+      break;
+    case OPT_ROTATE_SIZE:
+      check_gt0(optarg, "rotate size");
+      manager_opt.rotate_size = stoull(optarg) * 1024 * 1024;
+      break;
+    case OPT_ROTATE_TIME:
+      check_gt0(optarg, "rotate time");
+      manager_opt.rotate_time = atoi(optarg);
+      break;
+    case OPT_CONN_RATE:
+      client_opt.conn_rate = stod(optarg);
+      if (client_opt.conn_rate < 0)
+	errx(1, "[error] connection rate must be >= 0, abort!");
+      break;
+    case OPT_CONN_BURST:
+      check_gt0(optarg, "connection burst");
+      client_opt.conn_burst = atoi(optarg);
+      break;
+    case OPT_CONN_QUEUE:
+      check_gt0(optarg, "connection wait queue");
+      client_opt.conn_queue = atoi(optarg);
+      break;
+    case OPT_TLS_HELPERS:
+      check_gt0(optarg, "number of tls helpers");
+      client_opt.tls_helpers = atoi(optarg);
+      break;
+    case OPT_KTLS:
+      client_opt.ktls = true;
+      break;
+    case OPT_SERVER_POLICY:
+      client_opt.server_policy = str_tolower(optarg);
+      break;
+    case OPT_TC_FALLBACK:
+      client_opt.tc_fallback = true;
+      break;
+    case OPT_KERNEL_TS:
+      client_opt.kernel_ts = true;
+      break;
+    case OPT_UDP_POOL:
+      check_gt0(optarg, "udp socket pool");
+      client_opt.udp_pool = atoi(optarg);
+      break;
+    case OPT_UDP_POOL_POLICY:
+      client_opt.udp_pool_policy = str_tolower(optarg);
+      break;
+    case OPT_EXPECTED_QPS:
+      check_gt0(optarg, "expected queries per second");
+      client_opt.expected_qps = atoi(optarg);
+      break;
+    case OPT_UDP_RCVBUF:
+      check_gt0(optarg, "udp receive buffer");
+      client_opt.udp_rcvbuf = atoi(optarg) * 1024;
+      break;
+    case OPT_UDP_SNDBUF:
+      check_gt0(optarg, "udp send buffer");
+      client_opt.udp_sndbuf = atoi(optarg) * 1024;
+      break;
+    case OPT_SEQ_TAG:
+      client_opt.seq_run = atoi(optarg);
+      if (!is_number(optarg, true) || client_opt.seq_run < 0 || client_opt.seq_run > 65535)
+	errx(1, "[error] sequence tag run id must be 0-65535, abort!");
+      break;
+    case OPT_CONN_DETAIL:
+      client_opt.conn_detail = true;
+      break;
+    case OPT_UDP_RETRY:
+      check_gt0(optarg, "udp retry timeout");
+      client_opt.udp_retry_ms = atoi(optarg);
+      break;
+    case OPT_UDP_RETRIES:
+      check_gt0(optarg, "udp retries");
+      client_opt.udp_retries = atoi(optarg);
+      break;
+    case OPT_UDP_BACKOFF:
+      client_opt.udp_backoff = atof(optarg);
+      if (client_opt.udp_backoff < 1.0)
+	errx(1, "[error] udp backoff must be >= 1, abort!");
+      break;
+    case OPT_SAMPLE:
+      check_gt0(optarg, "sample rate");
+      client_opt.sample = atoi(optarg);
+      break;
+    case OPT_SAMPLE_BY:
+      client_opt.sample_by = optarg;
+      check_set(client_opt.sample_by, sample_by_set, "sample key");
+      break;
+    case OPT_SHM_RING:
+      check_gt0(optarg, "shared memory ring size");
+      shm_ring_kb = atoi(optarg);
+      break;
+    case OPT_WORKER_MAP:
+      manager_opt.worker_map = str_tolower(optarg);
+      check_set(manager_opt.worker_map, worker_map_set, "worker map");
+      break;
+    case OPT_MAP_SEED:
+      if (!is_number(optarg, true))
+	errx(1, "[error] map seed %s is invalid, abort!", optarg);
+      manager_opt.map_seed = stoull(optarg);
+      break;
+    case OPT_CREDITS:
+      check_gt0(optarg, "credits");
+      manager_opt.credit_limit = atoi(optarg);
+      break;
+    case OPT_REORDER:
+      check_gt0(optarg, "reorder");
+      manager_opt.reorder = atoi(optarg);
+      break;
+    case OPT_PRELOAD:
+      manager_opt.preload = atof(optarg);
+      if (manager_opt.preload <= 0)
+	errx(1, "[error] preload must be > 0, abort!");
+      break;
+    case OPT_START_MARGIN:
+      check_gt0(optarg, "start margin");
+      manager_opt.start_margin = atoi(optarg);
+      break;
+    case OPT_HOT_SHARE:
+      manager_opt.hot_share = atof(optarg) / 100;
+      if (manager_opt.hot_share <= 0 || manager_opt.hot_share >= 1)
+	errx(1, "[error] hot share must be between 0 and 100, abort!");
+      break;
+    case OPT_HOT_SPREAD:
+      check_gt0(optarg, "hot spread");
+      manager_opt.hot_spread = atoi(optarg);
+      break;
+    case OPT_HOT_STICKY_TCP:
+      manager_opt.hot_sticky_tcp = true;
+      break;
+    case OPT_MAX_WORKERS:
+      check_gt0(optarg, "max workers");
+      max_workers = atoi(optarg);
+      break;
+    case OPT_SCALE_LAG:
+      check_gt0(optarg, "scale lag");
+      manager_opt.scale_lag = atoi(optarg);
+      break;
     default:
       usage(comm);
     }
@@ -197,8 +504,12 @@ int main(int argc, char *argv[])
 
   //check input error
   check_set(conn_type, conn_set, "connection type");
-  check_str(server_ip, "server ip");
-  check_int(server_port, "server port");
+  if (targets.empty())
+    errx(1, "[error] server address is invalid, abort!");
+  check_set(client_opt.server_policy, server_policy_set, "server policy");
+  check_set(client_opt.udp_pool_policy, udp_pool_policy_set, "udp pool policy");
+  if (client_opt.udp_pool > 1 && !(socket_unify & SOCKET_UNIFY_UDP))
+    warnx("[warn] udp socket pool is only used with unified udp sockets (-u)");
   //check_int(time_out, "time out");
   if (time_out < 0) errx(1, "[error] time_out [%d] must be >=0, abort!", time_out);
   if (dist) { //check command address
@@ -211,6 +522,26 @@ int main(int argc, char *argv[])
     check_map(input_format, input_src_map, "input format");
   }
   check_set(nagle, {"disable", "enable", ""}, "nagle options");
+  if (max_workers > 0) {
+    if (max_workers < num_clients)
+      errx(1, "[error] max workers %u is less than the %u workers, abort!", max_workers, num_clients);
+    //the extra workers are forked now and stay dormant until needed
+    manager_opt.active = num_clients;
+    num_clients = max_workers;
+  }
+  if (manager_opt.preload > 0 && manager_opt.start_margin == 0)
+    errx(1, "[error] preload needs a start margin, abort!");
+  if (manager_opt.hot_share > 0 && socket_unify != SOCKET_UNIFY_NONE)
+    warnx("[warn] sources are not kept on one worker with unified sockets, hot share is not used");
+  if (dist && manager_opt.start_margin > 0)
+    warnx("[warn] the controller decides the start in distributed mode");
+  if ((client_opt.tls_helpers > 0 || client_opt.ktls) && conn_type != "tls")
+    warnx("[warn] tls helpers and kernel tls are only used with connection type tls");
+  if (client_opt.tc_fallback && conn_type != "udp" && conn_type != "adaptive")
+    warnx("[warn] tcp fallback is only used for udp queries");
+  check_map(manager_opt.compress, output_compress_map, "output compression");
+  if (output_file == "-" && (manager_opt.rotate_size > 0 || manager_opt.rotate_time > 0))
+    errx(1, "[error] cannot rotate standard output");
 
   if (!output_file.empty()) {
     if (output_format == "latency") {
@@ -229,14 +560,43 @@ int main(int argc, char *argv[])
   LOG(LOG_INFO, "# input format: [%s]  path: [%s]\n", input_format.c_str(), input_file.c_str());
   LOG(LOG_INFO, "# output format: [%s] path: [%s]\n", output_format.c_str(), output_file.c_str());
   LOG(LOG_INFO, "# output option: [%u]\n", output_option);
-  LOG(LOG_INFO, "# server address: %s  port: %d\n", server_ip.c_str(), server_port);
+  for (target_t &tg : targets)
+    LOG(LOG_INFO, "# server address: %s  weight: %d\n", tg.name.c_str(), tg.weight);
+  LOG(LOG_INFO, "# server policy: %s\n", client_opt.server_policy.c_str());
+  LOG(LOG_INFO, "# tcp fallback on truncation: %s\n", client_opt.tc_fallback ? "yes" : "no");
+  LOG(LOG_INFO, "# kernel timestamps: %s\n", client_opt.kernel_ts ? "yes" : "no");
+  LOG(LOG_INFO, "# unified udp sockets: %d  policy: %s\n", client_opt.udp_pool,
+      client_opt.udp_pool_policy.c_str());
+  LOG(LOG_INFO, "# sequence tag run id: %d\n", client_opt.seq_run);
+  LOG(LOG_INFO, "# connection detail: %s\n", client_opt.conn_detail ? "yes" : "no");
+  LOG(LOG_INFO, "# sample: 1 in %d  by: %s\n", client_opt.sample, client_opt.sample_by.c_str());
+  LOG(LOG_INFO, "# udp retry: %d ms  retries: %d  backoff: %.2f\n", client_opt.udp_retry_ms,
+      client_opt.udp_retries, client_opt.udp_backoff);
+  LOG(LOG_INFO, "# expected qps: %d  udp buffers: receive %d send %d bytes\n", client_opt.expected_qps,
+      client_opt.udp_rcvbuf, client_opt.udp_sndbuf);
   LOG(LOG_INFO, "# command address: %s  port: %d\n", command_ip.c_str(), command_port);
-  LOG(LOG_INFO, "# number of clients: %d\n", num_clients);
+  LOG(LOG_INFO, "# number of clients: %d  active at first: %d  scale lag: %d ms\n", num_clients,
+      manager_opt.active > 0 ? manager_opt.active : num_clients, manager_opt.scale_lag);
   LOG(LOG_INFO, "# connection: %s\n", conn_type.c_str());
   LOG(LOG_INFO, "# time out: %d\n", time_out);
   LOG(LOG_INFO, "# trace limit: %d seconds\n", trace_limit);
   LOG(LOG_INFO, "# query_pace: %f seconds\n", query_pace);
   LOG(LOG_INFO, "# nagle: %s\n", nagle.c_str());
+  LOG(LOG_INFO, "# stats interval: %d seconds\n", client_opt.stats_interval);
+  LOG(LOG_INFO, "# connection pacing: %f per second  burst: %d  queue: %d\n", client_opt.conn_rate,
+      client_opt.conn_burst, client_opt.conn_queue);
+  LOG(LOG_INFO, "# tls handshake helpers: %d  kernel tls: %s\n", client_opt.tls_helpers,
+      client_opt.ktls ? "yes" : "no");
+  LOG(LOG_INFO, "# output compression: %s  rotate: %llu bytes %d seconds\n", manager_opt.compress.c_str(),
+      manager_opt.rotate_size, manager_opt.rotate_time);
+  LOG(LOG_INFO, "# shared memory ring: %d KB\n", shm_ring_kb);
+  LOG(LOG_INFO, "# credits: %d queries per worker\n", manager_opt.credit_limit);
+  LOG(LOG_INFO, "# reorder window: %d records\n", manager_opt.reorder);
+  LOG(LOG_INFO, "# preload: %f seconds  start margin: %d ms\n", manager_opt.preload, manager_opt.start_margin);
+  LOG(LOG_INFO, "# hot sources: share %.2f%%  spread: %d  sticky tcp: %s\n", manager_opt.hot_share * 100,
+      manager_opt.hot_spread, manager_opt.hot_sticky_tcp ? "yes" : "no");
+  LOG(LOG_INFO, "# worker map: %s  seed: %llu\n", manager_opt.worker_map.c_str(),
+      (long long unsigned int)manager_opt.map_seed);
 
   LOG(LOG_INFO, "use %s for UDP queries\n", ((socket_unify & SOCKET_UNIFY_UDP) ? "the same socket" : "different sockets"));
   LOG(LOG_INFO, "use %s for TCP queries\n", ((socket_unify & SOCKET_UNIFY_TCP) ? "the same socket" : "different sockets"));
@@ -254,6 +614,10 @@ int main(int argc, char *argv[])
    *   +-----fork()---> manager processs ---++
    */
   
+  //shared counters for flow control and the elastic pool, mapped before fork
+  if (manager_opt.credit_limit > 0 || manager_opt.active > 0)
+    manager_opt.credits = shm_credit_new(num_clients);
+
   //set up unix sockets
   LOG(LOG_DBG, "[%d] set up %u pairs of unix sockets for manager-client communication\n", my_pid, num_clients);
   for (i=0; i<num_clients; i++) {
@@ -265,6 +629,10 @@ int main(int argc, char *argv[])
     client_fd.push_back(tmp_skt[0]);
     manager_fd.push_back(tmp_skt[1]);
     LOG(LOG_DBG, "[%d] unix socket pair [%d]<->[%d]\n", my_pid, tmp_skt[0], tmp_skt[1]);
+
+    //the ring is mapped before fork, so manager and client share it
+    if (shm_ring_kb > 0)
+      manager_opt.rings.push_back(new ShmRing((size_t)shm_ring_kb * 1024));
   }
     
   //fork sub-client processes
@@ -276,8 +644,14 @@ int main(int argc, char *argv[])
     } else if (child_pid == 0) { //child
       my_pid = getpid();
       LOG(LOG_DBG, "[%d] client [%d] is up\n", my_pid, my_pid);
-      DNSClient clt(conn_type, nagle, time_out, server_ip, server_port, manager_fd[i],
-		    socket_unify, output_option, non_wait);
+      client_opt.sample_snmp = (i == 0); //host wide counters, reported once
+      client_opt.worker_id = i;
+      if (shm_ring_kb > 0)
+	client_opt.ring = manager_opt.rings[i];
+      if (manager_opt.credits)
+	client_opt.credit = &manager_opt.credits[i];
+      DNSClient clt(conn_type, nagle, time_out, targets, manager_fd[i],
+		    socket_unify, output_option, non_wait, client_opt);
       clt.start();
       exit(0);
     } else {                     //parent
@@ -297,9 +671,7 @@ int main(int argc, char *argv[])
     LOG(LOG_DBG, "[%d] manager [%d] is up\n", my_pid, my_pid);
     Manager mgr(num_clients, dist, conn_type, input_file, input_format,
 		output_file, command_ip, command_port, client_fd, client_pid,
-		(socket_unify != SOCKET_UNIFY_NONE), trace_limit, query_pace);
-    LOG(LOG_DBG, "[%d] sleep for 5s\n", my_pid);
-    sleep(5);
+		(socket_unify != SOCKET_UNIFY_NONE), trace_limit, query_pace, manager_opt);
     mgr.start();
     exit(0);
   }
@@ -28,6 +28,7 @@
 #include <event2/buffer.h>
 
 #include <sys/socket.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -41,13 +42,25 @@
 using namespace std;
 
 #define FAIL_RETRY_LIMIT 5
-#define SLEEP_TIME 1.0
+#define PASS_BATCH_BYTES (64 * 1024)  //raw records batched for a client before a write
+#define PASS_BATCH_TIME 0.01          //seconds a record may wait in a batch
 #define FAKE_TRACE_START_TIME 1000000000.0
+#define OUTPUT_FLUSH_TIME 1  //seconds between handing partial output buffers to the writer
+#define LOAD_DECAY_QUERIES 65536  //client loads are halved after this many queries
+#define MAP_REPORT_TIME 10        //seconds between client load reports
+#define HOT_TOP_K 16              //hot sources tracked and reported
+#define HOT_MIN_QUERIES 1000      //recent queries before any source is hot
+#define POOL_CHECK_TIME 1         //seconds between checks of the elastic pool
+#define POOL_COOLDOWN 5           //seconds between changes of the pool
+#define POOL_IDLE_TIME 30         //seconds all active clients are idle before one is retired
+#define POOL_CPU_HIGH 0.95        //cpu share of a client that adds one
+#define POOL_CPU_LOW 0.5          //cpu share the others would have after a retirement
 
 Manager::Manager(int n, bool d, string conn,
 		 string in_fn, string in_ft, string out_fn,
 		 string c_ip, int c_port,
-		 vector<int> clt_fd, vector<int> clt_pid, bool no_map, int l, double pace)
+		 vector<int> clt_fd, vector<int> clt_pid, bool no_map, int l, double pace,
+		 manager_opt_t mopt)
 {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
   
@@ -64,7 +77,7 @@ Manager::Manager(int n, bool d, string conn,
   input_file = in_fn;
   input_format = in_ft;
   if (!dist)
-    ins = new InputSource(in_fn, in_ft);
+    ins = new InputMerge(in_fn, in_ft, mopt.reorder);
   output_file = out_fn;
   //output_format = out_ft;
   command_ip = c_ip;
@@ -79,21 +92,52 @@ Manager::Manager(int n, bool d, string conn,
   for (unsigned int i=0; i<client_fd.size(); i++) {
     client_fd2pid.insert(make_pair(client_fd[i], client_pid[i]));
     client_idx2fd.insert(make_pair(i, client_fd[i]));
+    client_fd2idx.insert(make_pair(client_fd[i], i));
     tmp = new client_t;
     tmp->idx = i;
     tmp->fd = client_fd[i];
     tmp->pid = client_pid[i];
     tmp->bev = NULL;
     client_vec.push_back(tmp);
+    if (i < mopt.rings.size())
+      client_fd2ring[client_fd[i]] = mopt.rings[i];
   }
 
   //randome seed
   srand(time(NULL));
 
+  //source mapping
+  worker_map = mopt.worker_map;
+  map_seed = mopt.map_seed;
+  client_load.assign(num_clients, 0.0);
+  client_queries.assign(num_clients, 0);
+  client_srcs.resize(num_clients);
+  num_active = num_clients;
+  if (mopt.active > 0 && mopt.active < num_clients) {
+    elastic = true;
+    num_active = mopt.active;
+    scale_lag = mopt.scale_lag;
+    client_ticks.assign(num_clients, 0);
+  }
+  hot_share = mopt.hot_share;
+  hot_spread = min(mopt.hot_spread, num_clients);
+  hot_sticky_tcp = mopt.hot_sticky_tcp;
+
+  //flow control
+  credits = mopt.credits;
+  credit_limit = mopt.credit_limit;
+  client_sent.assign(num_clients, 0);
+  client_held.resize(num_clients);
+  client_batch.resize(num_clients);
+
+  //synchronized start
+  preload = mopt.preload;
+  start_margin = mopt.start_margin;
+
   //output file
-  if (output_file.length() != 0 && output_file != "-") {
-    out_fs.open(output_file);
-    assert(out_fs.is_open());
+  if (output_file.length() != 0) {
+    writer = new OutputWriter(output_file, mopt.compress, mopt.rotate_size, mopt.rotate_time);
+    assert(writer);
   }
 
   if (dist) {  //fill in commander address, IPv4 only for now
@@ -124,8 +168,10 @@ void Manager::clean_up()
   }
   if (ins != NULL)
     delete ins;
-  if (out_fs.is_open())
-    out_fs.close();
+  if (writer != NULL) {
+    delete writer;  //flush and close the output file
+    writer = NULL;
+  }
 }
 
 /*
@@ -172,7 +218,18 @@ void Manager::read_client_cb_helper(struct bufferevent *bev, void *ctx)
 }
 
 /*
-  read data from client
+  helper of flushing the output periodically
+*/
+void Manager::flush_output_cb_helper(evutil_socket_t fd, short what, void *ctx)
+{
+  OutputWriter *w = (static_cast<Manager *>(ctx))->writer;
+  if (w)
+    w->flush();
+}
+
+/*
+  read data from client; only complete lines are passed to the output
+  so that lines of different clients are not mixed
 */
 void Manager::read_client_cb(struct bufferevent *bev)
 {
@@ -184,25 +241,39 @@ void Manager::read_client_cb(struct bufferevent *bev)
   assert(input_buffer);
 
   size_t len = evbuffer_get_length(input_buffer);
+  if (len == 0)
+    return;
 
-  if (len > 0) {
-    char *data = new char[len+1];//+1 makes sure the end of string is '\0'
-    assert(data);
-    memset(data, '\0', len+1);
-    bufferevent_read(bev, data, len);//read len, not +1
-
-    //20170912: do not write to controller for now
-    //if (dist) //write to commander in distributed mode
-    //  bufferevent_write(com_bev, data, len);
-
-    if (output_file.length() != 0) { //log to local file in non-distributed mode
-      if (out_fs.is_open())
-	out_fs << data;
-      else
-	cout << data;
+  read_buf.resize(len);
+  bufferevent_read(bev, &read_buf[0], len);
+
+  //20170912: do not write to controller for now
+  //if (dist) //write to commander in distributed mode
+  //  bufferevent_write(com_bev, data, len);
+
+  if (writer == NULL)
+    return;
+
+  client_t *clt = NULL;
+  for (client_t *c : client_vec) {
+    if (c->bev == bev) {
+      clt = c;
+      break;
     }
-    delete[] data;
   }
+  assert(clt);
+
+  size_t last = read_buf.find_last_of('\n');
+  if (last == string::npos) { //no complete line yet
+    clt->partial.append(read_buf);
+    return;
+  }
+  if (!clt->partial.empty()) {
+    writer->write(clt->partial.data(), clt->partial.size());
+    clt->partial.clear();
+  }
+  writer->write(read_buf.data(), last + 1);
+  clt->partial.append(read_buf, last + 1, string::npos);
 }
 
 void Manager::com_read_cb_helper(struct bufferevent *bev, void *ctx)
@@ -248,25 +319,24 @@ void Manager::com_read_cb(struct bufferevent *bev)
     //string raw = msg->raw();
     //print_dns_pkt((uint8_t*)raw.data(), raw.size());
 
-    if (!done_sync_time && msg->sync_time()) {//sync_time message sent to all sub-clients
+    if (msg->has_ping_time()) { //the controller measures the clock offset
+      char pong[64];
+      int n = snprintf(pong, sizeof(pong), "#pong %lld %lld\n", (long long)msg->ping_time(),
+		       (long long)get_time_now("us"));
+      bufferevent_write(com_bev, pong, n);
+    } else if (msg->sync_time()) {//sync_time and start messages sent to all sub-clients
       log_dbg("recv sync_time from controller");
       done_sync_time = true;
-      uint32_t msg_sz = htonl(sz);
-      for (int cfd : client_fd) { //write length and then the data
-	if (-1 == write(cfd, &msg_sz, sizeof(msg_sz))) log_err("fail to write socket");
-	if (-1 == write(cfd, d, sz)) log_err("fail to write socket");
-      }
+      for (int cfd : client_fd)
+	send_client(cfd, (const char *)d, sz);
       log_dbg("sent sync time message to all client processes");
     } else { //normal message sent one sub-clients
-      int fd = rand_client_fd((char *)(msg->src_ip().c_str()));
+      int fd = rand_client_fd((char *)(msg->src_ip().c_str()), msg->tcp());
       assert(fd != -1);
 
       LOG(LOG_DBG, "[%d] write to client [%d] with fd [%d]\n", my_pid, client_fd2pid[fd], fd);
 
-      //write length and then the data
-      uint32_t ln = htonl(sz);
-      if (-1 == write(fd, &ln, sizeof(ln))) log_err("fail to write socket");
-      if (-1 == write(fd, d, sz)) log_err("fail to write socket");
+      send_client(fd, (const char *)d, sz);
     }
     delete msg;
     com_msg_buffer = com_msg_buffer.substr(sz + sizeof(uint32_t));
@@ -323,13 +393,18 @@ void Manager::read_input_file()
     log_err("input format is invalid");
 
   LOG(LOG_DBG, "[%d] read from input %s file\n", my_pid, input_format.c_str());
+
+  //raw records go to the clients as they are, unless pacing changes
+  //their time
+  if (input_src_map[input_format] == INPUT_SRC_RAW && query_pace <= 0) {
+    read_input_raw();
+    return;
+  }
     
   trace_replay::DNSMsg *msg = NULL;
   int fd = -1;
   string raw;
   string msg_str;
-  double real_start_ts = -1.0;
-  double trace_start_ts = -1.0;
   while((msg = ins->get()) != NULL) {
     assert(msg);
     raw = msg->raw();
@@ -349,61 +424,56 @@ void Manager::read_input_file()
     }
     
     //the first message is sent to all client processes to sync time
+    double trace_current_ts = double(msg->seconds()) + double(msg->microseconds())/1000000.0;
     if (!done_sync_time) {
       msg->set_sync_time(true);
+      if (start_margin > 0) { //clients hold queries until the start instant
+	msg->set_start_time(0);
+	start_hold = true;
+	hold_trace_ts = trace_current_ts;
+      }
       msg_str.clear();
       if (!(msg->SerializeToString(&msg_str))) 
 	log_err("serialize message fails");
       assert(msg_str.size() > 0);
 
       done_sync_time = true;
-      for (int cfd : client_fd) {
-	//write length and then the data
-	uint32_t sz = msg_str.size();
-	sz = htonl(sz);
-	if (-1 == write(cfd, &sz, sizeof(sz))) log_err("fail to write socket");
-	if (-1 == write(cfd, msg_str.data(), msg_str.size())) log_err("fail to write socket");
-      }
+      for (int cfd : client_fd)
+	send_client(cfd, msg_str.data(), msg_str.size());
       log_dbg("sent sync time message to all client processes");
     }
 
-    if (trace_limit > 0) {
-      double trace_current_ts = double(msg->seconds()) + double(msg->microseconds())/1000000.0;
+    if (start_hold && trace_current_ts - hold_trace_ts >= preload)
+      send_start();
+
+    if (trace_limit > 0 && !start_hold) {
       if (trace_start_ts < 0) {//the first packet
 	trace_start_ts = trace_current_ts;
 	real_start_ts = get_time_now("second");
       } else {
-	//use get_time_now inside while condition may be necessary
-	//for sensitive time accuracy
-	while (
-	       (trace_current_ts - trace_start_ts)     //trace_ts_diff
-	       -
-	       (get_time_now("second") - real_start_ts)//real_ts_diff
-	       >
-	       (trace_limit + double(SLEEP_TIME))      //limit_ts
-	       ) {
-	  //printf("go to sleep: %.6f\n", get_time_now("second"));
-	  sleep(SLEEP_TIME); //wait for SLEEP_TIME
+	//sleep just until the query is within the limit
+	double ahead;
+	while ((ahead = (trace_current_ts - trace_start_ts)         //trace_ts_diff
+		- (get_time_now("second") - real_start_ts)         //real_ts_diff
+		- trace_limit) > 0.001) {
+	  reader_wait(ahead);
 	}
       }
     }
 
     msg->set_sync_time(false);
+    msg->clear_start_time();
     msg_str.clear();
     if (!(msg->SerializeToString(&msg_str))) 
       log_err("serialize message fails");
     assert(msg_str.size() > 0);
     
-    fd = rand_client_fd((char *)(msg->src_ip().c_str()));
+    fd = rand_client_fd((char *)(msg->src_ip().c_str()), msg->tcp());
     assert(fd != -1);
 
     LOG(LOG_DBG, "[%d] write to client [%d] with fd [%d]\n", my_pid, client_fd2pid[fd], fd);
 
-    //write length and then the data
-    uint32_t sz = msg_str.size();
-    sz = htonl(sz);
-    if (-1 == write(fd, &sz, sizeof(sz))) log_err("fail to write socket");
-    if (-1 == write(fd, msg_str.data(), msg_str.size())) log_err("fail to write socket");
+    send_credited(client_fd2idx[fd], msg_str.data(), msg_str.size());
 
     //clean up
     raw.clear();
@@ -411,6 +481,282 @@ void Manager::read_input_file()
     delete msg;
     fd = -1;
   }
+  if (start_hold) //input shorter than the preload
+    send_start();
+  while (held_total > 0)
+    reader_wait(-1);
+  report_clients(true);
+  if (credits)
+    LOG(LOG_INFO, "[%d] clients out of credits: %llu, reader waits: %llu\n", my_pid,
+	(long long unsigned int)credit_waits, (long long unsigned int)reader_waits);
+}
+
+/*
+  read raw input and pass each record through to its client without
+  parsing it: a scan of the wire format finds the source and the time,
+  and the sync flag goes in the frame length. Records are batched per
+  client and written together.
+*/
+void Manager::read_input_raw()
+{
+  log_dbg("pass raw records through");
+  pass_raw = true;
+  const char *d = NULL;   //record in place in the input
+  size_t len = 0;
+  string rec;             //record rewritten by the manager
+  string src;
+  msg_fields_t f;
+  batch_flush_ts = get_time_now("second");
+  while (ins->get_raw_view(d, len)) {
+    if (!scan_dns_msg(d, len, &f)) {
+      LOG(LOG_ERR, "[%d] raw record of %lu bytes is malformed, skip it\n", my_pid, len);
+      continue;
+    }
+    if (f.raw_len == 0) //not a valid query
+      continue;
+    if (f.sync_time) { //only the manager decides the sync message
+      trace_replay::DNSMsg msg;
+      msg.ParseFromArray(d, len);
+      msg.set_sync_time(false);
+      rec.clear();
+      if (!msg.SerializeToString(&rec))
+	log_err("serialize message fails");
+      d = rec.data();
+      len = rec.size();
+    }
+
+    //the first record is sent to all client processes to sync time
+    double trace_current_ts = double(f.seconds) + double(f.microseconds)/1000000.0;
+    if (!done_sync_time) {
+      done_sync_time = true;
+      string sync_rec(d, len);
+      if (start_margin > 0) { //clients hold queries until the start instant
+	trace_replay::DNSMsg msg;
+	msg.ParseFromArray(d, len);
+	msg.set_start_time(0);
+	sync_rec.clear();
+	if (!msg.SerializeToString(&sync_rec))
+	  log_err("serialize message fails");
+	start_hold = true;
+	hold_trace_ts = trace_current_ts;
+      }
+      for (int cfd : client_fd) {
+	if (client_fd2ring.count(cfd)) {
+	  client_fd2ring[cfd]->put(sync_rec.data(), sync_rec.size(), FRAME_SYNC);
+	} else {
+	  uint32_t ln = htonl(sync_rec.size() | FRAME_SYNC);
+	  client_batch[client_fd2idx[cfd]].append((const char *)&ln, sizeof(ln));
+	  client_batch[client_fd2idx[cfd]].append(sync_rec);
+	}
+      }
+      log_dbg("sent sync time message to all client processes");
+    }
+
+    if (start_hold && trace_current_ts - hold_trace_ts >= preload)
+      send_start();
+
+    double now = get_time_now("second");
+    if (trace_limit > 0 && !start_hold) {
+      if (trace_start_ts < 0) {//the first packet
+	trace_start_ts = trace_current_ts;
+	real_start_ts = now;
+      } else if ((trace_current_ts - trace_start_ts) - (now - real_start_ts) - trace_limit > 0.001) {
+	double ahead;
+	while ((ahead = (trace_current_ts - trace_start_ts) - (get_time_now("second") - real_start_ts)
+		- trace_limit) > 0.001) {
+	  reader_wait(ahead);
+	}
+	now = get_time_now("second");
+      }
+    }
+
+    src.assign(f.src_ip ? f.src_ip : "", f.src_ip_len);
+    int fd = rand_client_fd((char *)src.c_str(), f.tcp);
+    send_credited(client_fd2idx[fd], d, len);
+    if (now - batch_flush_ts >= PASS_BATCH_TIME)
+      flush_batches();
+  }
+  if (start_hold) //input shorter than the preload
+    send_start();
+  while (held_total > 0)
+    reader_wait(-1);
+  flush_batches();
+  report_clients(true);
+  if (credits)
+    LOG(LOG_INFO, "[%d] clients out of credits: %llu, reader waits: %llu\n", my_pid,
+	(long long unsigned int)credit_waits, (long long unsigned int)reader_waits);
+}
+
+/*
+  write the batched records of client idx to its socket
+*/
+void Manager::flush_batch(int idx)
+{
+  string &b = client_batch[idx];
+  size_t off = 0;
+  while (off < b.size()) {
+    ssize_t n = write(client_idx2fd[idx], b.data() + off, b.size() - off);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      log_err("fail to write socket");
+    }
+    off += n;
+  }
+  b.clear(); //keeps its capacity for the next batch
+}
+
+void Manager::flush_batches()
+{
+  for (int i = 0; i < num_clients; i++)
+    if (!client_batch[i].empty())
+      flush_batch(i);
+  batch_flush_ts = get_time_now("second");
+}
+
+/*
+  end the preload: tell all clients the instant the replay starts,
+  start_margin ms from now. The input is then read trace_limit ahead
+  of that instant.
+*/
+void Manager::send_start()
+{
+  start_hold = false;
+  int64_t start_us = (int64_t)get_time_now("us") + (int64_t)start_margin * 1000;
+  trace_replay::DNSMsg msg;
+  msg.set_seconds(0);
+  msg.set_microseconds(0);
+  msg.set_tcp(false);
+  msg.set_ipv4(true);
+  msg.set_src_ip("");
+  msg.set_raw("");
+  msg.set_sync_time(true);
+  msg.set_start_time(start_us);
+  string msg_str;
+  if (!msg.SerializeToString(&msg_str))
+    log_err("serialize message fails");
+
+  flush_batches(); //the preloaded queries go first
+  for (int cfd : client_fd)
+    send_client(cfd, msg_str.data(), msg_str.size());
+  trace_start_ts = hold_trace_ts;
+  real_start_ts = double(start_us) / 1000000.0;
+  LOG(LOG_INFO, "[%d] preload is sent, replay starts in %d ms\n", my_pid, start_margin);
+}
+
+/*
+  whether client idx holds fewer than credit_limit queries
+*/
+bool Manager::has_credit(int idx)
+{
+  return client_sent[idx] - credits[idx].consumed.load() < (uint64_t)credit_limit;
+}
+
+/*
+  send a query to client idx if it has credit for it, otherwise hold
+  it; the reader waits only when the client has credit_limit queries
+  held as well
+*/
+void Manager::send_credited(int idx, const char *d, size_t len)
+{
+  if (!credits || credit_limit == 0) { //the elastic pool only
+    deliver(idx, d, len);
+    return;
+  }
+  if (held_total > 0)
+    release_held();
+  if (client_held[idx].empty() && has_credit(idx)) {
+    client_sent[idx] += 1;
+    deliver(idx, d, len);
+    return;
+  }
+  if (client_held[idx].empty()) {
+    credit_waits += 1;
+    if (start_hold) { //a held client never gives credits back
+      LOG(LOG_INFO, "[%d] client %d is out of credits, end the preload\n", my_pid, idx);
+      send_start();
+    }
+  }
+  client_held[idx].emplace_back(d, len);
+  held_total += 1;
+  if (client_held[idx].size() >= (size_t)credit_limit)
+    reader_waits += 1;
+  while (client_held[idx].size() >= (size_t)credit_limit)
+    reader_wait(-1);
+}
+
+/*
+  send the held queries of every client that has credits again;
+  return true if any was sent
+*/
+bool Manager::release_held()
+{
+  bool sent = false;
+  for (int i = 0; i < num_clients && held_total > 0; i++) {
+    deque<string> &h = client_held[i];
+    while (!h.empty() && has_credit(i)) {
+      client_sent[i] += 1;
+      deliver(i, h.front().data(), h.front().size());
+      h.pop_front();
+      held_total -= 1;
+      sent = true;
+    }
+  }
+  return sent;
+}
+
+/*
+  the reader has nothing to do for up to sec seconds, or until a client
+  gives credits back if sec is negative. The clients get their batches
+  first, and held queries go out as soon as they have credit. The
+  elastic pool is checked at least every POOL_CHECK_TIME meanwhile: the
+  reader waits when the clients are saturated, when the pool must grow.
+*/
+void Manager::reader_wait(double sec)
+{
+  flush_batches();
+  if (elastic) {
+    check_pool();
+    if (sec < 0 || sec > POOL_CHECK_TIME)
+      sec = POOL_CHECK_TIME;
+  }
+  if (!credits || held_total == 0) {
+    if (sec > 0)
+      usleep((useconds_t)(sec * 1000000));
+    return;
+  }
+  //the clients see the flags before we look at their counts
+  for (int i = 0; i < num_clients; i++)
+    if (!client_held[i].empty())
+      credits[i].manager_waiting.store(1);
+  if (!release_held()) {
+    struct pollfd p = {credits[0].notify_fd, POLLIN, 0};
+    if (poll(&p, 1, (sec < 0 ? -1 : (int)(sec * 1000))) == -1 && errno != EINTR)
+      log_err("poll credit eventfd");
+    uint64_t v;
+    if (read(p.fd, &v, sizeof(v)) == -1 && errno != EAGAIN)
+      log_err("read credit eventfd");
+    release_held();
+  }
+  flush_batches();
+}
+
+/*
+  write a query to client idx: raw records passed through to a socket
+  are batched
+*/
+void Manager::deliver(int idx, const char *d, size_t len)
+{
+  int fd = client_idx2fd[idx];
+  if (!pass_raw || client_fd2ring.count(fd)) {
+    send_client(fd, d, len);
+    return;
+  }
+  uint32_t ln = htonl(len);
+  client_batch[idx].append((const char *)&ln, sizeof(ln));
+  client_batch[idx].append(d, len);
+  if (client_batch[idx].size() >= PASS_BATCH_BYTES)
+    flush_batch(idx);
 }
 
 void Manager::main_event_loop()
@@ -430,6 +776,17 @@ void Manager::main_event_loop()
   if (event_add(sigterm_event, NULL) < 0)
     log_err("cannot add sigterm event");
 
+  //output writer thread and the timer handing it partial buffers
+  struct event *flush_event = NULL;
+  if (writer) {
+    writer->start();
+    struct timeval flush_tv = {OUTPUT_FLUSH_TIME, 0};
+    flush_event = event_new(evbase, -1, EV_PERSIST, &Manager::flush_output_cb_helper, this);
+    assert(flush_event != NULL);
+    if (event_add(flush_event, &flush_tv) < 0)
+      log_err("cannot add output flush event");
+  }
+
   //set up buffer event from every client fd
   log_dbg("set up client bufferevent");
   for (client_t *clt : client_vec) {
@@ -465,10 +822,12 @@ void Manager::main_event_loop()
   }
   event_free(signal_event);
   event_free(sigterm_event);
+  if (flush_event)
+    event_free(flush_event);
   event_base_free(evbase);
 
-  if (out_fs.is_open()) {
-    out_fs.close();
+  if (writer) {
+    writer->stop();
     log_dbg("close output file");
   }
 }
@@ -501,22 +860,236 @@ void Manager::start()
 }
 
 /*
-  get a random client's fd if src_ip has not been seen
-  otherwise, pick the existing one
+  get the client's fd for a query of src_ip. A source keeps its client:
+  random and load remember the client picked for a new source, hash
+  computes it every time from the source and the seed, without state,
+  except with the elastic pool: then it remembers it as well, so that
+  adding or retiring a client does not move sources in use.
+  Sources need no client of their own with unified sockets, then
+  every query is placed on its own. A hot source is spread: its
+  queries go in turn to hot_spread clients from its own one.
 */
-int Manager::rand_client_fd(char *src_ip)
+int Manager::rand_client_fd(char *src_ip, bool tcp)
 {
-  if (disable_mapping)
-    return client_idx2fd[rand() % num_clients];
-  
-  string ip = src_ip; 
-  if (client_src2fd.find(ip) == client_src2fd.end()) {
-    int idx = rand() % num_clients;
-    int fd = client_idx2fd[idx];
-    client_src2fd.insert(make_pair(ip, fd));
-    return fd;
-  } else
-    return client_src2fd[ip];
+  string ip = src_ip;
+  uint64_t h = hash_str(ip);
+  int idx = -1;
+  if (elastic && (map_queries & 255) == 0)
+    check_pool();
+  if (worker_map == "hash") {
+    auto it = elastic ? client_src2fd.find(ip) : client_src2fd.end();
+    if (it != client_src2fd.end() && it->second < num_active) {
+      idx = it->second;
+    } else { //new source, or its client is retired
+      idx = jump_hash(mix_seed(h, map_seed), num_active);
+      if (elastic)
+	client_src2fd[ip] = idx;
+    }
+  } else if (disable_mapping) {
+    idx = (worker_map == "load") ? least_loaded_client() : rand() % num_active;
+  } else {
+    auto it = client_src2fd.find(ip);
+    if (it != client_src2fd.end() && it->second < num_active) {
+      idx = it->second;
+    } else { //new source, or its client is retired
+      idx = (worker_map == "load") ? least_loaded_client() : rand() % num_active;
+      client_src2fd[ip] = idx;
+    }
+  }
+
+  if (hot_share > 0 && !disable_mapping) {
+    recent_queries += 1.0;
+    uint32_t est = cms_add(src_sketch, h);
+    if (recent_queries >= HOT_MIN_QUERIES && est >= hot_share * recent_queries) {
+      hot_src_t *hs = hot_source(ip, est);
+      if (hs && hot_spread > 1 && !(tcp && hot_sticky_tcp)) {
+	if (hs->next)
+	  hs->split += 1;
+	idx = (idx + hs->next) % num_active;
+	hs->next = (hs->next + 1) % hot_spread;
+      }
+    }
+  }
+
+  //recent load and totals of the clients
+  client_load[idx] += 1.0;
+  client_queries[idx] += 1;
+  hll_add(client_srcs[idx], h);
+  if (++map_queries % LOAD_DECAY_QUERIES == 0) {
+    for (double &l : client_load)
+      l /= 2;
+    if (hot_share > 0) {
+      cms_halve(src_sketch);
+      recent_queries /= 2;
+      for (hot_src_t &hs : hot_srcs)
+	hs.est /= 2;
+    }
+    report_clients(false);
+  }
+  return client_idx2fd[idx];
+}
+
+/*
+  the entry of a hot source in the top-k table, added if there is room
+  or if it has more queries than the smallest entry; NULL otherwise
+*/
+hot_src_t *Manager::hot_source(const string &ip, uint32_t est)
+{
+  hot_src_t *low = NULL;
+  for (hot_src_t &hs : hot_srcs) {
+    if (hs.ip == ip) {
+      hs.est = est;
+      hs.peak_share = max(hs.peak_share, est / recent_queries);
+      return &hs;
+    }
+    if (!low || hs.est < low->est)
+      low = &hs;
+  }
+  if (hot_srcs.size() < HOT_TOP_K) {
+    hot_srcs.push_back(hot_src_t());
+    low = &hot_srcs.back();
+  } else if (low->est >= est) {
+    return NULL;
+  } else if (low->split > 0) {
+    LOG(LOG_INFO, "[%d] hot source %s: share=%.1f%% split=%llu (no longer in the top %d)\n", my_pid,
+	low->ip.c_str(), low->peak_share * 100, (long long unsigned int)low->split, HOT_TOP_K);
+  }
+  *low = hot_src_t();
+  low->ip = ip;
+  low->est = est;
+  low->peak_share = est / recent_queries;
+  LOG(LOG_DBG, "[%d] source %s is hot\n", my_pid, ip.c_str());
+  return low;
+}
+
+/*
+  grow or shrink the elastic pool. A dormant client is added when an
+  active one sends its queries more than scale_lag ms late or is busy
+  on cpu; the last active client is retired when the others could take
+  its work and none is late for POOL_IDLE_TIME. With hash mapping only
+  the sources of the added or retired client move.
+*/
+void Manager::check_pool()
+{
+  double now = get_time_now("second");
+  if (now - pool_check_ts < POOL_CHECK_TIME)
+    return;
+  double span = now - pool_check_ts;
+  bool first = (pool_check_ts < 0);
+  pool_check_ts = now;
+
+  int64_t max_lag = 0;
+  double cpu_sum = 0.0, cpu_max = 0.0;
+  for (int i = 0; i < num_clients; i++) {
+    double cpu = client_cpu(i, span);
+    if (i >= num_active)
+      continue;
+    max_lag = max(max_lag, (int64_t)credits[i].lag_us.load(memory_order_relaxed));
+    cpu_sum += cpu;
+    cpu_max = max(cpu_max, cpu);
+  }
+  if (first || now - scale_ts < POOL_COOLDOWN)
+    return;
+
+  if ((max_lag > scale_lag * 1000LL || cpu_max > POOL_CPU_HIGH) && num_active < num_clients) {
+    credits[num_active].lag_us.store(0, memory_order_relaxed); //from its last activity
+    num_active += 1;
+    scale_ts = now;
+    idle_since = -1.0;
+    LOG(LOG_INFO, "[%d] lag %.1f ms cpu %.0f%%: add client %d, %d active\n", my_pid, max_lag / 1000.0,
+	cpu_max * 100, num_active - 1, num_active);
+    return;
+  }
+  if (num_active == 1 || max_lag > scale_lag * 250LL || cpu_sum > POOL_CPU_LOW * (num_active - 1)) {
+    idle_since = -1.0;
+    return;
+  }
+  if (idle_since < 0)
+    idle_since = now;
+  if (now - idle_since < POOL_IDLE_TIME)
+    return;
+  num_active -= 1;
+  scale_ts = now;
+  idle_since = -1.0;
+  LOG(LOG_INFO, "[%d] lag %.1f ms cpu %.0f%%: retire client %d, %d active\n", my_pid, max_lag / 1000.0,
+      cpu_sum * 100, num_active, num_active);
+}
+
+/*
+  cpu share of client idx since the last check, from /proc
+*/
+double Manager::client_cpu(int idx, double span)
+{
+  char fn[64];
+  snprintf(fn, sizeof(fn), "/proc/%d/stat", client_pid[idx]);
+  FILE *fp = fopen(fn, "r");
+  if (!fp)
+    return 0.0;
+  char buf[1024];
+  size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[n] = '\0';
+  //utime and stime are the 12th and 13th fields after the command name
+  char *p = strrchr(buf, ')');
+  unsigned long long utime = 0, stime = 0;
+  if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*lu %*lu %*lu %*lu %llu %llu", &utime, &stime) != 2)
+    return 0.0;
+  uint64_t ticks = utime + stime;
+  double cpu = 0.0;
+  if (span > 0 && client_ticks[idx] > 0)
+    cpu = (ticks - client_ticks[idx]) / (double)sysconf(_SC_CLK_TCK) / span;
+  client_ticks[idx] = ticks;
+  return cpu;
+}
+
+/*
+  client with the lowest recent load
+*/
+int Manager::least_loaded_client()
+{
+  int idx = 0;
+  for (int i = 1; i < num_active; i++)
+    if (client_load[i] < client_load[idx])
+      idx = i;
+  return idx;
+}
+
+/*
+  log queries and distinct sources (estimated) of each client, every
+  MAP_REPORT_TIME seconds or at the end
+*/
+void Manager::report_clients(bool end)
+{
+  double now = get_time_now("second");
+  if (!end && now - map_report_ts < MAP_REPORT_TIME)
+    return;
+  map_report_ts = now;
+  for (int i = 0; i < num_clients; i++)
+    LOG(LOG_INFO, "[%d] client %d [%d]: queries=%llu sources=%.0f%s%s\n", my_pid, i, client_pid[i],
+	(long long unsigned int)client_queries[i], hll_count(client_srcs[i]),
+	i < num_active ? "" : " (dormant)", end ? " (end)" : "");
+  for (const hot_src_t &hs : hot_srcs) {
+    if (hs.split == 0)
+      continue;
+    LOG(LOG_INFO, "[%d] hot source %s: share=%.1f%% split=%llu over %d clients%s\n", my_pid, hs.ip.c_str(),
+	hs.peak_share * 100, (long long unsigned int)hs.split, hot_spread, end ? " (end)" : "");
+  }
+}
+
+/*
+  send one message to a client: into its shared memory ring, or as
+  length and then data on its socket
+*/
+void Manager::send_client(int fd, const char *d, uint32_t sz)
+{
+  auto it = client_fd2ring.find(fd);
+  if (it != client_fd2ring.end()) {
+    it->second->put(d, sz);
+    return;
+  }
+  uint32_t ln = htonl(sz);
+  if (-1 == write(fd, &ln, sizeof(ln))) log_err("fail to write socket");
+  if (-1 == write(fd, d, sz)) log_err("fail to write socket");
 }
 
 /*
@@ -22,9 +22,14 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <deque>
+#include <set>
 #include <fstream>
+#include <event2/event.h>
 #include "libtrace.h"
 #include "input_source.hh"
+#include "output_writer.hh"
+#include "shm_ring.hh"
 //#include <netinet/in.h>
 
 struct client_t {
@@ -32,6 +37,40 @@ struct client_t {
   int fd;
   pid_t pid;
   struct bufferevent *bev;
+  std::string partial;  //output data after the last complete line
+};
+
+const std::set<std::string> worker_map_set = {"random", "hash", "load"};
+
+//optional manager features; the defaults keep the plain behavior
+struct manager_opt_t
+{
+  std::string compress = "none";         //output compression
+  long long unsigned int rotate_size = 0; //rotate output after bytes, 0 means none
+  int rotate_time = 0;                    //rotate output after seconds, 0 means none
+  std::vector<ShmRing *> rings;           //shared memory ring of each client, empty for sockets
+  std::string worker_map = "random";      //client of a new source: random, hash or load
+  uint64_t map_seed = 0;                  //seed of the hash mapping
+  shm_credit_t *credits = NULL;           //queries taken by each client, NULL without --credits
+  int credit_limit = 0;                   //queries a client may hold
+  int reorder = 0;                        //records of an input that may be out of order
+  double preload = 0.0;                   //seconds of trace sent before the start instant
+  int start_margin = 0;                   //ms from the end of the preload to the start, 0 for none
+  double hot_share = 0.0;                 //share of recent queries that makes a source hot, 0 for none
+  int hot_spread = 4;                     //clients a hot source is spread over
+  bool hot_sticky_tcp = false;            //tcp queries of a hot source stay on its client
+  int active = 0;                         //clients with queries at first, 0 for all (fixed pool)
+  int scale_lag = 100;                    //ms of lag that adds a client
+};
+
+//a hot source in the top-k table of the manager
+struct hot_src_t
+{
+  std::string ip;
+  uint32_t est = 0;        //recent queries, estimated
+  double peak_share = 0.0; //highest share of the recent queries
+  uint64_t split = 0;      //queries sent away from its own client
+  int next = 0;            //next client of the spread, from its own one
 };
 
 class Manager{
@@ -41,7 +80,7 @@ public:
 	  std::string,
 	  std::string, int,
 	  std::vector<int>, std::vector<int>,
-	  bool, int, double);
+	  bool, int, double, manager_opt_t);
   ~Manager();
   void start();
 
@@ -56,8 +95,16 @@ private:
   double query_pace = -1.0;
   double query_pace_ts = -1.0;
   double trace_limit = -1.0;
+  double real_start_ts = -1.0;    //trace_limit: real and trace time of the start
+  double trace_start_ts = -1.0;
+
+  //synchronized start: clients hold queries until the start instant
+  double preload = 0.0;
+  int start_margin = 0;
+  bool start_hold = false;
+  double hold_trace_ts = 0.0;     //trace time of the first query
 
-  InputSource *ins = NULL;
+  InputMerge *ins = NULL;
   
   std::string input_file;
   std::string input_format;
@@ -65,25 +112,91 @@ private:
   std::string command_ip;
   std::string conn_type;
   std::string com_msg_buffer;
+  std::string read_buf;   //reused buffer for reading client output
 
   std::vector<int> client_fd;
   std::vector<int> client_pid;
   std::vector<client_t *> client_vec;
   std::unordered_map<int, int> client_idx2fd;    //index by (idx, fd)
   std::unordered_map<int, int> client_fd2pid;    //index by (fd, pid)
-  std::unordered_map<std::string, int> client_src2fd; //index by (src_ip, pid)
+  std::unordered_map<std::string, int> client_src2fd; //index by (src_ip, client index), for hash only when elastic
+  std::unordered_map<int, ShmRing *> client_fd2ring;  //index by (fd, shared memory ring)
 
-  //output file
-  std::ofstream out_fs;
+  //source mapping and the load of each client
+  std::string worker_map;
+  uint64_t map_seed;
+  std::vector<double> client_load;                //queries, decayed every LOAD_DECAY_QUERIES
+  std::vector<uint64_t> client_queries;
+  std::vector<std::vector<uint8_t> > client_srcs; //distinct sources, hyperloglog
+  uint64_t map_queries = 0;
+  double map_report_ts = 0.0;
+
+  //hot sources: recent queries of each source are counted in a
+  //count-min sketch, decayed with the loads; a source with more than
+  //hot_share of them is spread over hot_spread clients
+  double hot_share = 0.0;
+  int hot_spread = 1;
+  bool hot_sticky_tcp = false;
+  double recent_queries = 0.0;
+  std::vector<uint32_t> src_sketch;
+  std::vector<hot_src_t> hot_srcs;  //top HOT_TOP_K by estimate
+
+  //elastic pool: clients [0, num_active) get queries; the others are
+  //forked but dormant until the lag or cpu of the active ones calls
+  //for them, and the last active one is retired when all are idle
+  int num_active;
+  bool elastic = false;
+  int scale_lag = 100;
+  double pool_check_ts = -1.0;
+  double scale_ts = 0.0;            //last change of the pool
+  double idle_since = -1.0;
+  std::vector<uint64_t> client_ticks;  //cpu ticks at the last check
+
+  //flow control: queries sent to each client and its shared count of
+  //queries taken out of its queue. Queries of a client at its limit
+  //are held, in order, while the reader goes on with the others.
+  shm_credit_t *credits = NULL;
+  int credit_limit = 0;
+  std::vector<uint64_t> client_sent;
+  std::unordered_map<int, int> client_fd2idx;     //index by (fd, idx)
+  std::vector<std::deque<std::string> > client_held;
+  size_t held_total = 0;
+  uint64_t credit_waits = 0;      //times a client ran out of credits
+  uint64_t reader_waits = 0;      //times the reader waited for one
+
+  //raw input passed through: records for each client batched into one write
+  bool pass_raw = false;
+  std::vector<std::string> client_batch;
+  double batch_flush_ts = 0.0;
+
+  //output file, written by its own thread
+  OutputWriter *writer = NULL;
 
   struct sockaddr_in com_addr;
   struct bufferevent *com_bev = NULL;
   struct event_base *evbase = NULL;
 
   void read_input_file();
+  void read_input_raw();
+  void flush_batch(int);
+  void flush_batches();
+  void send_start();
   void main_event_loop();
 
-  int rand_client_fd(char *);
+  int rand_client_fd(char *, bool);
+  hot_src_t *hot_source(const std::string &, uint32_t);
+  void check_pool();
+  double client_cpu(int, double);
+  int least_loaded_client();
+  void report_clients(bool);
+  bool has_credit(int);
+  void send_credited(int, const char *, size_t);
+  bool release_held();
+  void reader_wait(double);
+  void deliver(int, const char *, size_t);
+  void send_client(int, const char *, uint32_t);
+
+  static void flush_output_cb_helper(evutil_socket_t, short, void *);
 
   static void read_client_cb_helper(struct bufferevent *, void *);
   void read_client_cb(struct bufferevent *);
@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2018 by the University of Southern California
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "output_writer.hh"
+#include "global_var.h"
+#include "utility.hh"
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+using namespace std;
+
+#define OUTPUT_BUF_SIZE     (1 << 20)   //hand a buffer over once it holds 1 MiB
+#define OUTPUT_QUEUE_LEN    256
+#define COMPRESS_CHUNK      (1 << 18)
+#define WRITER_IDLE_US      2000
+
+unordered_map<string, unsigned int> output_compress_map = {
+  {"none", OUTPUT_COMPRESS_NONE},
+  {"gzip", OUTPUT_COMPRESS_GZIP},
+  {"xz",   OUTPUT_COMPRESS_XZ},
+#ifdef HAVE_ZSTD
+  {"zstd", OUTPUT_COMPRESS_ZSTD},
+#endif
+};
+
+OutputWriter::OutputWriter(string fn, string c, long long unsigned int rs, int rt)
+  : full_bufs(OUTPUT_QUEUE_LEN), free_bufs(OUTPUT_QUEUE_LEN)
+{
+  my_pid = getpid();
+  path = fn;
+  is_stdout = (fn == "-");
+  rotate_size = rs;
+  rotate_time = rt;
+  if (output_compress_map.find(c) == output_compress_map.end())
+    log_err("unknown output compression");
+  compress = output_compress_map[c];
+  if (is_stdout && (rotate_size > 0 || rotate_time > 0))
+    log_err("cannot rotate standard output");
+  done.store(false);
+  cur = new string;
+  cur->reserve(OUTPUT_BUF_SIZE);
+}
+
+OutputWriter::~OutputWriter()
+{
+  stop();
+  delete cur;
+  string *b = NULL;
+  while (free_bufs.pop(b))
+    delete b;
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(zcs);
+#endif
+}
+
+/*
+  open the first file and start the writer thread
+*/
+void OutputWriter::start()
+{
+  open_file();
+  running = true;
+  th = thread(&OutputWriter::writer_loop, this);
+}
+
+/*
+  append data; called from the event loop thread only
+*/
+void OutputWriter::write(const char *data, size_t len)
+{
+  cur->append(data, len);
+  if (cur->size() >= OUTPUT_BUF_SIZE)
+    flush();
+}
+
+/*
+  hand the current buffer to the writer thread; if the queue is full
+  keep filling the current buffer instead of waiting
+*/
+void OutputWriter::flush()
+{
+  if (cur->empty())
+    return;
+  if (!full_bufs.push(cur)) {
+    num_backlog += 1;
+    return;
+  }
+  string *b = NULL;
+  if (free_bufs.pop(b)) {
+    b->clear();
+  } else {
+    b = new string;
+    b->reserve(OUTPUT_BUF_SIZE);
+  }
+  cur = b;
+}
+
+/*
+  write what is left, finish the compressed stream and close the file
+*/
+void OutputWriter::stop()
+{
+  if (!running)
+    return;
+  running = false;
+  while (!cur->empty()) {
+    flush();
+    if (!cur->empty())
+      usleep(WRITER_IDLE_US);
+  }
+  done.store(true);
+  th.join();
+  close_file();
+  if (num_backlog > 0)
+    LOG(LOG_INFO, "[%d] output queue was full %llu times\n", my_pid, num_backlog);
+}
+
+void OutputWriter::writer_loop()
+{
+  string *b = NULL;
+  while (true) {
+    if (full_bufs.pop(b)) {
+      write_buf(*b);
+      if (!free_bufs.push(b))
+	delete b;
+      continue;
+    }
+    if (done.load())
+      break;
+    usleep(WRITER_IDLE_US);
+  }
+}
+
+/*
+  write one buffer of whole lines, rotating the file first if needed
+*/
+void OutputWriter::write_buf(const string &b)
+{
+  if (!is_stdout &&
+      ((rotate_size > 0 && file_bytes >= rotate_size) ||
+       (rotate_time > 0 && get_time_now("second") - file_start >= rotate_time))) {
+    close_file();
+    file_idx += 1;
+    open_file();
+  }
+  file_bytes += b.size();
+
+  if (compress == OUTPUT_COMPRESS_NONE) {
+    write_all(b.data(), b.size());
+    return;
+  }
+
+  out_buf.resize(COMPRESS_CHUNK);
+  if (compress == OUTPUT_COMPRESS_GZIP) {
+    zs.next_in = (Bytef *)b.data();
+    zs.avail_in = b.size();
+    do {
+      zs.next_out = (Bytef *)&out_buf[0];
+      zs.avail_out = out_buf.size();
+      if (deflate(&zs, Z_NO_FLUSH) == Z_STREAM_ERROR)
+	log_err("deflate fails");
+      write_all(out_buf.data(), out_buf.size() - zs.avail_out);
+    } while (zs.avail_out == 0);
+#ifdef HAVE_ZSTD
+  } else if (compress == OUTPUT_COMPRESS_ZSTD) {
+    ZSTD_inBuffer ib = {b.data(), b.size(), 0};
+    do {
+      ZSTD_outBuffer ob = {&out_buf[0], out_buf.size(), 0};
+      if (ZSTD_isError(ZSTD_compressStream2(zcs, &ob, &ib, ZSTD_e_continue)))
+	log_err("ZSTD_compressStream2 fails");
+      write_all(out_buf.data(), ob.pos);
+    } while (ib.pos < ib.size);
+#endif
+  } else {
+    ls.next_in = (const uint8_t *)b.data();
+    ls.avail_in = b.size();
+    do {
+      ls.next_out = (uint8_t *)&out_buf[0];
+      ls.avail_out = out_buf.size();
+      if (lzma_code(&ls, LZMA_RUN) != LZMA_OK)
+	log_err("lzma_code fails");
+      write_all(out_buf.data(), out_buf.size() - ls.avail_out);
+    } while (ls.avail_out == 0);
+  }
+}
+
+void OutputWriter::write_all(const char *d, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = ::write(fd, d, len);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      log_err("fail to write output file");
+    }
+    d += n;
+    len -= n;
+  }
+}
+
+/*
+  output file name: PATH, or PATH.N with rotation, plus the suffix of
+  the compression if PATH does not have it
+*/
+string OutputWriter::file_name()
+{
+  string fn = path;
+  if (rotate_size > 0 || rotate_time > 0)
+    fn += "." + to_string(file_idx);
+  string suffix;
+  if (compress == OUTPUT_COMPRESS_GZIP)
+    suffix = ".gz";
+  else if (compress == OUTPUT_COMPRESS_XZ)
+    suffix = ".xz";
+  else if (compress == OUTPUT_COMPRESS_ZSTD)
+    suffix = ".zst";
+  if (!suffix.empty() &&
+      (fn.size() < suffix.size() || fn.compare(fn.size() - suffix.size(), suffix.size(), suffix) != 0))
+    fn += suffix;
+  return fn;
+}
+
+void OutputWriter::open_file()
+{
+  if (is_stdout) {
+    fd = STDOUT_FILENO;
+  } else {
+    string fn = file_name();
+    fd = open(fn.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1)
+      log_err("cannot open output file");
+    LOG(LOG_DBG, "[%d] open output file %s\n", my_pid, fn.c_str());
+  }
+  file_bytes = 0;
+  file_start = get_time_now("second");
+
+  if (compress == OUTPUT_COMPRESS_GZIP) {
+    memset(&zs, 0, sizeof(zs));
+    //15 + 16: default window with a gzip header
+    if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      log_err("deflateInit2 fails");
+  } else if (compress == OUTPUT_COMPRESS_XZ) {
+    ls = LZMA_STREAM_INIT;
+    if (lzma_easy_encoder(&ls, 1, LZMA_CHECK_CRC64) != LZMA_OK)
+      log_err("lzma_easy_encoder fails");
+#ifdef HAVE_ZSTD
+  } else if (compress == OUTPUT_COMPRESS_ZSTD) {
+    if (!zcs && !(zcs = ZSTD_createCCtx()))
+      log_err("ZSTD_createCCtx fails");
+    ZSTD_CCtx_reset(zcs, ZSTD_reset_session_only);
+    if (ZSTD_isError(ZSTD_CCtx_setParameter(zcs, ZSTD_c_compressionLevel, 1)))
+      log_err("ZSTD_CCtx_setParameter fails");
+#endif
+  }
+}
+
+/*
+  finish the compressed stream and close the current file
+*/
+void OutputWriter::close_file()
+{
+  if (fd == -1)
+    return;
+  out_buf.resize(COMPRESS_CHUNK);
+  if (compress == OUTPUT_COMPRESS_GZIP) {
+    int r = Z_OK;
+    zs.avail_in = 0;
+    do {
+      zs.next_out = (Bytef *)&out_buf[0];
+      zs.avail_out = out_buf.size();
+      r = deflate(&zs, Z_FINISH);
+      write_all(out_buf.data(), out_buf.size() - zs.avail_out);
+    } while (r == Z_OK);
+    deflateEnd(&zs);
+  } else if (compress == OUTPUT_COMPRESS_XZ) {
+    lzma_ret r = LZMA_OK;
+    ls.avail_in = 0;
+    do {
+      ls.next_out = (uint8_t *)&out_buf[0];
+      ls.avail_out = out_buf.size();
+      r = lzma_code(&ls, LZMA_FINISH);
+      write_all(out_buf.data(), out_buf.size() - ls.avail_out);
+    } while (r == LZMA_OK);
+    lzma_end(&ls);
+#ifdef HAVE_ZSTD
+  } else if (compress == OUTPUT_COMPRESS_ZSTD) {
+    ZSTD_inBuffer ib = {NULL, 0, 0};
+    size_t r = 0;
+    do {
+      ZSTD_outBuffer ob = {&out_buf[0], out_buf.size(), 0};
+      r = ZSTD_compressStream2(zcs, &ob, &ib, ZSTD_e_end);
+      if (ZSTD_isError(r))
+	log_err("ZSTD_compressStream2 fails");
+      write_all(out_buf.data(), ob.pos);
+    } while (r != 0);
+#endif
+  }
+  if (!is_stdout)
+    close(fd);
+  fd = -1;
+}
+
+void OutputWriter::log_err(const char *s)
+{
+  err(1, "[%d] [error] %s, abort!", my_pid, s);
+}
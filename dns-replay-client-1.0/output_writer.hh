@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2018 by the University of Southern California
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef OUTPUT_WRITER_HH
+#define OUTPUT_WRITER_HH
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <zlib.h>
+#include <lzma.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "spsc_queue.hh"
+
+#define OUTPUT_COMPRESS_NONE  0x0000U
+#define OUTPUT_COMPRESS_GZIP  0x0001U
+#define OUTPUT_COMPRESS_XZ    0x0002U
+#define OUTPUT_COMPRESS_ZSTD  0x0004U
+
+extern std::unordered_map<std::string, unsigned int> output_compress_map;
+
+// output writer collects result lines into large buffers on the
+// caller's thread and hands full buffers to its own thread, which
+// compresses and writes them with big sequential write() calls; the
+// caller never waits for the disk
+
+class OutputWriter {
+public:
+  OutputWriter(std::string, std::string, long long unsigned int, int);
+  ~OutputWriter();
+  void start();
+  void write(const char *, size_t);
+  void flush();
+  void stop();
+
+private:
+  pid_t my_pid;
+  int fd = -1;
+  int file_idx = 0;
+  int rotate_time = 0;                         //seconds, 0 means no rotation by time
+  unsigned int compress = OUTPUT_COMPRESS_NONE;
+  long long unsigned int rotate_size = 0;      //bytes, 0 means no rotation by size
+  long long unsigned int file_bytes = 0;       //uncompressed bytes in the current file
+  long long unsigned int num_backlog = 0;      //times the queue was full
+  double file_start = 0.0;
+  bool is_stdout = false;
+  bool running = false;
+
+  std::string path;
+  std::string *cur = NULL;                     //buffer being filled by the caller
+  std::string out_buf;                         //compressed output
+
+  spsc_queue<std::string *> full_bufs;         //caller -> writer thread
+  spsc_queue<std::string *> free_bufs;         //writer thread -> caller, for reuse
+  std::atomic<bool> done;
+  std::thread th;
+
+  z_stream zs;
+  lzma_stream ls = LZMA_STREAM_INIT;
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx *zcs = NULL;                       //kept across rotated files
+#endif
+
+  void writer_loop();
+  void write_buf(const std::string &);
+  void write_all(const char *, size_t);
+  void open_file();
+  void close_file();
+  std::string file_name();
+  void log_err(const char *);
+};
+
+#endif //OUTPUT_WRITER_HH
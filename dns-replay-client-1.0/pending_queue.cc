@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2018 by the University of Southern California
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "pending_queue.hh"
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+//earlier trace time first, then earlier query; std heaps keep the
+//greatest element on top
+static bool later(const pending_rec_t &a, const pending_rec_t &b)
+{
+  if (a.ts.tv_sec != b.ts.tv_sec)
+    return a.ts.tv_sec > b.ts.tv_sec;
+  if (a.ts.tv_usec != b.ts.tv_usec)
+    return a.ts.tv_usec > b.ts.tv_usec;
+  return a.num > b.num;
+}
+
+PendingQueue::PendingQueue()
+{
+}
+
+PendingQueue::~PendingQueue()
+{
+  for (uint8_t *b : blocks)
+    delete[] b;
+  if (spare)
+    delete[] spare;
+}
+
+uint8_t *PendingQueue::block_at(uint64_t off)
+{
+  return blocks[(off - head_off) / ARENA_BLOCK_SIZE] + (off % ARENA_BLOCK_SIZE);
+}
+
+/*
+  add a query: copy its source and wire bytes to the arena and queue a
+  record
+*/
+void PendingQueue::push(const struct timeval &ts, uint64_t num, const string &src, uint16_t flags,
+			const string &raw)
+{
+  assert(raw.size() <= UINT16_MAX && src.size() <= UINT8_MAX);
+  size_t len = src.size() + raw.size();
+
+  //a query never spans two blocks
+  if (tail_off % ARENA_BLOCK_SIZE + len > ARENA_BLOCK_SIZE)
+    tail_off += ARENA_BLOCK_SIZE - tail_off % ARENA_BLOCK_SIZE;
+  while (tail_off + len > head_off + blocks.size() * (uint64_t)ARENA_BLOCK_SIZE) {
+    if (spare) {
+      blocks.push_back(spare);
+      spare = NULL;
+    } else {
+      blocks.push_back(new uint8_t[ARENA_BLOCK_SIZE]);
+    }
+    block_recs.push_back(0);
+  }
+  uint8_t *d = block_at(tail_off);
+  memcpy(d, src.data(), src.size());
+  memcpy(d + src.size(), raw.data(), raw.size());
+  block_recs[(tail_off - head_off) / ARENA_BLOCK_SIZE] += 1;
+
+  pending_rec_t r;
+  r.ts = ts;
+  r.num = num;
+  r.off = tail_off;
+  r.len = raw.size();
+  r.flags = flags;
+  r.src_len = src.size();
+  recs.push_back(r);
+  push_heap(recs.begin(), recs.end(), later);
+  tail_off += len;
+}
+
+bool PendingQueue::empty()
+{
+  return recs.empty();
+}
+
+size_t PendingQueue::size()
+{
+  return recs.size();
+}
+
+/*
+  the query due first
+*/
+const pending_rec_t &PendingQueue::front()
+{
+  return recs.front();
+}
+
+const uint8_t *PendingQueue::front_raw()
+{
+  if (recs.front().len == 0)
+    return NULL;
+  return block_at(recs.front().off) + recs.front().src_len;
+}
+
+string PendingQueue::front_src()
+{
+  return string((const char *)block_at(recs.front().off), recs.front().src_len);
+}
+
+/*
+  drop the first record and release the leading blocks nobody points
+  into; the last block is kept for the next queries
+*/
+void PendingQueue::pop()
+{
+  block_recs[(recs.front().off - head_off) / ARENA_BLOCK_SIZE] -= 1;
+  pop_heap(recs.begin(), recs.end(), later);
+  recs.pop_back();
+  while (blocks.size() > 1 && block_recs.front() == 0) {
+    if (spare)
+      delete[] spare;
+    spare = blocks.front();
+    blocks.pop_front();
+    block_recs.pop_front();
+    head_off += ARENA_BLOCK_SIZE;
+  }
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2018 by the University of Southern California
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef PENDING_QUEUE_HH
+#define PENDING_QUEUE_HH
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <cstdint>
+#include <sys/time.h>
+
+#define PENDING_TCP        0x0001U
+#define PENDING_IPV4       0x0002U
+
+//a query scheduled for the future; its source and wire bytes live in
+//the arena
+struct pending_rec_t
+{
+  struct timeval ts;  //trace time of the query
+  uint64_t num;       //query number in the worker
+  uint64_t off;       //offset of the source and wire bytes in the arena
+  uint16_t len;       //length of the wire bytes
+  uint16_t flags;     //PENDING_*
+  uint8_t src_len;    //length of the source, before the wire bytes
+};
+
+// queries waiting for their send time in a worker. Records are kept in
+// a heap by trace time, then query number, so a late or early record in
+// the input does not hold back the others. The source and wire bytes
+// are appended to a chain of large blocks; each block counts the records
+// that point into it and is released once the blocks before it are free
+// and none is left.
+
+class PendingQueue {
+public:
+  PendingQueue();
+  ~PendingQueue();
+  void push(const struct timeval &, uint64_t, const std::string &, uint16_t, const std::string &);
+  bool empty();
+  size_t size();
+  const pending_rec_t &front();
+  const uint8_t *front_raw();
+  std::string front_src();
+  void pop();
+
+private:
+  std::vector<pending_rec_t> recs;  //heap, earliest first
+  std::deque<uint8_t *> blocks;
+  std::deque<uint32_t> block_recs;  //records in each block
+  uint8_t *spare = NULL;     //released block kept for the next one
+  uint64_t head_off = 0;     //arena offset of the first block
+  uint64_t tail_off = 0;     //arena offset for the next query
+
+  uint8_t *block_at(uint64_t);
+};
+
+#endif //PENDING_QUEUE_HH
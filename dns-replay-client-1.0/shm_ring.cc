@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2018 by the University of Southern California
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "shm_ring.hh"
+#include "global_var.h"
+#include <new>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <err.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+using namespace std;
+
+#define SHM_RING_MIN (64 * 1024)
+
+ShmRing::ShmRing(size_t n)
+{
+  cap = SHM_RING_MIN;
+  while (cap < n)
+    cap <<= 1;
+  map_len = sizeof(shm_ring_hdr_t) + cap;
+  void *p = mmap(NULL, map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err(1, "[error] mmap of %lu bytes for shared memory ring, abort!", map_len);
+  hdr = new (p) shm_ring_hdr_t;
+  hdr->head.store(0);
+  hdr->tail.store(0);
+  hdr->producer_waiting.store(0);
+  hdr->consumer_idle.store(1);
+  data = (char *)p + sizeof(shm_ring_hdr_t);
+
+  data_fd = eventfd(0, EFD_NONBLOCK);
+  space_fd = eventfd(0, 0);
+  if (data_fd == -1 || space_fd == -1)
+    err(1, "[error] eventfd for shared memory ring, abort!");
+}
+
+ShmRing::~ShmRing()
+{
+  if (hdr)
+    munmap((void *)hdr, map_len);
+  if (data_fd != -1)
+    close(data_fd);
+  if (space_fd != -1)
+    close(space_fd);
+}
+
+/*
+  copy bytes to the ring at a producer position, wrapping at the end
+*/
+void ShmRing::copy_in(uint64_t pos, const void *d, size_t len)
+{
+  size_t off = pos & (cap - 1);
+  size_t first = min(len, cap - off);
+  memcpy(data + off, d, first);
+  memcpy(data, (const char *)d + first, len - first);
+}
+
+/*
+  block until len bytes fit after the producer position t
+*/
+void ShmRing::wait_space(uint64_t t, size_t len)
+{
+  while (t + len - hdr->head.load(memory_order_acquire) > cap) {
+    hdr->producer_waiting.store(1);
+    //the consumer may have freed space before it saw the flag
+    if (t + len - hdr->head.load() > cap) {
+      uint64_t v;
+      if (read(space_fd, &v, sizeof(v)) == -1 && errno != EINTR)
+	err(1, "[error] read shared memory ring eventfd, abort!");
+    }
+    hdr->producer_waiting.store(0);
+  }
+}
+
+/*
+  put one framed message, flags or'ed into its length; blocks while
+  the ring is full
+*/
+void ShmRing::put(const char *d, uint32_t sz, uint32_t flags)
+{
+  size_t len = sizeof(uint32_t) + sz;
+  if (len > cap)
+    errx(1, "[error] message of %u bytes is larger than the shared memory ring, abort!", sz);
+  uint64_t t = hdr->tail.load(memory_order_relaxed);
+  wait_space(t, len);
+  uint32_t ln = htonl(sz | flags);
+  copy_in(t, &ln, sizeof(ln));
+  copy_in(t + sizeof(ln), d, sz);
+  hdr->tail.store(t + len); //publish, and order it before the idle check
+
+  if (hdr->consumer_idle.load() && hdr->consumer_idle.exchange(0)) {
+    uint64_t one = 1;
+    if (write(data_fd, &one, sizeof(one)) == -1)
+      err(1, "[error] write shared memory ring eventfd, abort!");
+  }
+}
+
+/*
+  consumer: append up to max bytes of the ring to s; return the number
+  of bytes taken
+*/
+size_t ShmRing::get(string &s, size_t max)
+{
+  uint64_t h = hdr->head.load(memory_order_relaxed);
+  uint64_t t = hdr->tail.load(memory_order_acquire);
+  size_t len = min((size_t)(t - h), max);
+  if (len == 0)
+    return 0;
+  size_t off = h & (cap - 1);
+  size_t first = min(len, cap - off);
+  s.append(data + off, first);
+  s.append(data, len - first);
+  hdr->head.store(h + len); //free the space, and order it before the waiting check
+
+  if (hdr->producer_waiting.load() && hdr->producer_waiting.exchange(0)) {
+    uint64_t one = 1;
+    if (write(space_fd, &one, sizeof(one)) == -1)
+      err(1, "[error] write shared memory ring eventfd, abort!");
+  }
+  return len;
+}
+
+/*
+  consumer: the ring is drained, wait for the notify fd. Return false
+  if data came in the meantime, then the consumer reads on.
+*/
+bool ShmRing::idle()
+{
+  hdr->consumer_idle.store(1);
+  if (hdr->tail.load() != hdr->head.load(memory_order_relaxed)) {
+    hdr->consumer_idle.store(0);
+    return false;
+  }
+  return true;
+}
+
+/*
+  fd the consumer watches for reading
+*/
+int ShmRing::get_notify_fd()
+{
+  return data_fd;
+}
+
+/*
+  shared counters of n workers, mapped before fork
+*/
+shm_credit_t *shm_credit_new(int n)
+{
+  size_t len = sizeof(shm_credit_t) * n;
+  void *p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err(1, "[error] mmap of %lu bytes for credits, abort!", len);
+  shm_credit_t *c = new (p) shm_credit_t[n];
+  int fd = eventfd(0, EFD_NONBLOCK);
+  if (fd == -1)
+    err(1, "[error] eventfd for credits, abort!");
+  for (int i = 0; i < n; i++) {
+    c[i].consumed.store(0);
+    c[i].manager_waiting.store(0);
+    c[i].lag_us.store(0);
+    c[i].notify_fd = fd;
+  }
+  return c;
+}
+
+/*
+  worker: one more message taken, wake the manager if it waits for it
+*/
+void shm_credit_grant(shm_credit_t *c)
+{
+  //only the worker writes its count; publish it before the waiting check
+  c->consumed.store(c->consumed.load(memory_order_relaxed) + 1);
+  if (c->manager_waiting.load() && c->manager_waiting.exchange(0)) {
+    uint64_t one = 1;
+    if (write(c->notify_fd, &one, sizeof(one)) == -1)
+      err(1, "[error] write credit eventfd, abort!");
+  }
+}
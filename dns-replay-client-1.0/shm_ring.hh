@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2018 by the University of Southern California
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef SHM_RING_HH
+#define SHM_RING_HH
+
+#include <atomic>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+//shared state at the start of the mapping; producer and consumer
+//fields are on their own cache lines
+struct shm_ring_hdr_t
+{
+  alignas(64) std::atomic<uint64_t> head;          //bytes consumed, written by the consumer
+  std::atomic<uint32_t> producer_waiting;          //producer blocked on a full ring
+  alignas(64) std::atomic<uint64_t> tail;          //bytes produced, written by the producer
+  std::atomic<uint32_t> consumer_idle;             //consumer waits for the notify fd
+};
+
+// byte ring in shared memory for exactly one producer process and one
+// consumer process, set up before fork. The producer puts framed
+// messages (network order length, then data) like the manager socket
+// carries; the consumer takes all bytes available. The consumer is
+// woken through an eventfd only when it has said it is idle, and a
+// producer facing a full ring sleeps on a second eventfd until the
+// consumer frees space, so a busy ring costs no system calls.
+
+class ShmRing {
+public:
+  ShmRing(size_t);
+  ~ShmRing();
+  void put(const char *, uint32_t, uint32_t = 0);
+  size_t get(std::string &, size_t);
+  bool idle();
+  int get_notify_fd();
+
+private:
+  size_t cap;                //bytes, a power of two
+  size_t map_len;
+  shm_ring_hdr_t *hdr = NULL;
+  char *data = NULL;
+  int data_fd = -1;          //eventfd: data for an idle consumer
+  int space_fd = -1;         //eventfd: space for a waiting producer
+
+  void copy_in(uint64_t, const void *, size_t);
+  void wait_space(uint64_t, size_t);
+};
+
+//messages a worker has taken from the manager, in shared memory for
+//flow control: the worker counts, the manager compares with what it
+//has sent, and a manager waiting for credits is woken through an
+//eventfd shared by all workers. The worker also gives how late its
+//last query was sent, for the elastic pool.
+struct shm_credit_t
+{
+  alignas(64) std::atomic<uint64_t> consumed;
+  std::atomic<uint32_t> manager_waiting;  //manager waits for credits of this worker
+  std::atomic<int64_t> lag_us;
+  int notify_fd;                          //eventfd, the same for all workers
+};
+
+shm_credit_t *shm_credit_new(int);
+void shm_credit_grant(shm_credit_t *);
+
+#endif //SHM_RING_HH
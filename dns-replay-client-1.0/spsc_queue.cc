@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2018 by the University of Southern California
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "spsc_queue.hh"
+#include <string>
+using namespace std;
+
+template<typename T>
+spsc_queue<T>::spsc_queue(size_t m)
+{
+  //one slot is kept empty to tell full from empty
+  max_len = m;
+  slots.resize(max_len + 1);
+  head.store(0);
+  tail.store(0);
+}
+
+template<typename T>
+spsc_queue<T>::~spsc_queue()
+{
+}
+
+template<typename T>
+bool spsc_queue<T>::push(const T &x)
+{
+  size_t t = tail.load(memory_order_relaxed);
+  size_t next = (t + 1) % slots.size();
+  if (next == head.load(memory_order_acquire))
+    return false; //full
+  slots[t] = x;
+  tail.store(next, memory_order_release);
+  return true;
+}
+
+template<typename T>
+bool spsc_queue<T>::pop(T &x)
+{
+  size_t h = head.load(memory_order_relaxed);
+  if (h == tail.load(memory_order_acquire))
+    return false; //empty
+  x = slots[h];
+  head.store((h + 1) % slots.size(), memory_order_release);
+  return true;
+}
+
+template<typename T>
+bool spsc_queue<T>::empty()
+{
+  return head.load(memory_order_acquire) == tail.load(memory_order_acquire);
+}
+
+template<typename T>
+size_t spsc_queue<T>::get_max_len()
+{
+  return max_len;
+}
+
+//explicit instantiation for the types in use
+template class spsc_queue<string *>;
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2018 by the University of Southern California
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef SPSC_QUEUE_HH
+#define SPSC_QUEUE_HH
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+// bounded lock-free queue for exactly one producer thread and one
+// consumer thread; push and pop never block and return false when the
+// queue is full or empty
+
+template <typename T>
+class spsc_queue {
+public:
+  spsc_queue(size_t);
+  ~spsc_queue();
+  bool push(const T &);
+  bool pop(T &);
+  bool empty();
+  size_t get_max_len();
+
+private:
+  size_t max_len;
+  std::vector<T> slots;
+  std::atomic<size_t> head;   //next slot to pop, written by the consumer
+  std::atomic<size_t> tail;   //next slot to push, written by the producer
+};
+
+#endif //SPSC_QUEUE_HH
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2018 by the University of Southern California
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "tls_pool.hh"
+#include "global_var.h"
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+#include <event2/util.h>
+using namespace std;
+
+#define TLS_POOL_TIMEOUT 10  //seconds, used when the replay has no timeout
+
+TlsHandshakePool::TlsHandshakePool(SSL_CTX *c, int n, int nagle, int t, bool k)
+{
+  my_pid = getpid();
+  ctx = c;
+  num_threads = n;
+  nagle_flag = nagle;
+  time_out = (t > 0 ? t : TLS_POOL_TIMEOUT);
+  use_ktls = k;
+}
+
+TlsHandshakePool::~TlsHandshakePool()
+{
+  stop();
+}
+
+/*
+  start the helper threads; return the fd to watch for results
+*/
+int TlsHandshakePool::start()
+{
+  notify_fd = eventfd(0, EFD_NONBLOCK);
+  if (notify_fd == -1)
+    err(1, "[%d] [error] eventfd for tls handshake pool, abort!", my_pid);
+  for (int i = 0; i < num_threads; i++)
+    helpers.push_back(thread(&TlsHandshakePool::helper_loop, this));
+  LOG(LOG_DBG, "[%d] started %d tls handshake helpers\n", my_pid, num_threads);
+  return notify_fd;
+}
+
+/*
+  stop the helpers after their current handshake and free what has not
+  been collected
+*/
+void TlsHandshakePool::stop()
+{
+  {
+    lock_guard<mutex> lk(job_mtx);
+    if (done)
+      return;
+    done = true;
+  }
+  job_cv.notify_all();
+  for (thread &th : helpers)
+    th.join();
+  helpers.clear();
+
+  tls_job_t r;
+  while (get_result(r)) {
+    if (r.ssl) SSL_free(r.ssl);
+    if (r.fd != -1) close(r.fd);
+  }
+  if (notify_fd != -1) {
+    close(notify_fd);
+    notify_fd = -1;
+  }
+}
+
+void TlsHandshakePool::submit(const string &src_ip, const struct sockaddr_in &addr)
+{
+  tls_job_t job;
+  job.src_ip = src_ip;
+  job.addr = addr;
+  {
+    lock_guard<mutex> lk(job_mtx);
+    jobs.push(job);
+  }
+  job_cv.notify_one();
+}
+
+/*
+  pop one finished job; return false if there is none
+*/
+bool TlsHandshakePool::get_result(tls_job_t &r)
+{
+  lock_guard<mutex> lk(result_mtx);
+  if (results.empty())
+    return false;
+  r = results.front();
+  results.pop();
+  return true;
+}
+
+void TlsHandshakePool::helper_loop()
+{
+  while (true) {
+    tls_job_t job;
+    {
+      unique_lock<mutex> lk(job_mtx);
+      while (jobs.empty() && !done)
+	job_cv.wait(lk);
+      if (done)
+	return;
+      job = jobs.front();
+      jobs.pop();
+    }
+
+    handshake(job);
+
+    {
+      lock_guard<mutex> lk(result_mtx);
+      results.push(job);
+    }
+    uint64_t one = 1;
+    if (write(notify_fd, &one, sizeof(one)) == -1)
+      LOG(LOG_ERR, "[%d] [error] cannot notify tls handshake result\n", my_pid);
+  }
+}
+
+/*
+  blocking connect and tls handshake; the socket is left non-blocking
+  for the worker's bufferevent
+*/
+void TlsHandshakePool::handshake(tls_job_t &job)
+{
+  evutil_gettimeofday(&job.start, NULL);
+  job.fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (job.fd == -1) {
+    LOG(LOG_ERR, "[%d] [error] tls helper cannot create socket\n", my_pid);
+    return;
+  }
+  struct timeval to = {time_out, 0};
+  setsockopt(job.fd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof(to));
+  setsockopt(job.fd, SOL_SOCKET, SO_SNDTIMEO, &to, sizeof(to));
+  if (nagle_flag != -1)
+    setsockopt(job.fd, IPPROTO_TCP, TCP_NODELAY, (char *)&nagle_flag, sizeof(int));
+
+  if (connect(job.fd, (struct sockaddr *)&job.addr, sizeof(job.addr)) < 0) {
+    LOG(LOG_DBG, "[%d] tls helper connect fails for %s: %s\n", my_pid, job.src_ip.c_str(), strerror(errno));
+    close(job.fd);
+    job.fd = -1;
+    return;
+  }
+  evutil_gettimeofday(&job.connected, NULL);
+
+  job.ssl = SSL_new(ctx);
+  if (job.ssl == NULL || SSL_set_fd(job.ssl, job.fd) != 1 || SSL_connect(job.ssl) != 1) {
+    LOG(LOG_DBG, "[%d] tls helper handshake fails for %s\n", my_pid, job.src_ip.c_str());
+    if (job.ssl) SSL_free(job.ssl);
+    job.ssl = NULL;
+    close(job.fd);
+    job.fd = -1;
+    return;
+  }
+  evutil_gettimeofday(&job.done, NULL);
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+  //records can go through the plain socket only if the kernel has
+  //both directions and openssl holds no data read ahead
+  if (use_ktls &&
+      BIO_get_ktls_send(SSL_get_wbio(job.ssl)) &&
+      BIO_get_ktls_recv(SSL_get_rbio(job.ssl)) &&
+      !SSL_has_pending(job.ssl)) {
+    job.ktls = true;
+  }
+#endif
+
+  //back to the worker's settings: non-blocking, no socket timeouts
+  struct timeval zero = {0, 0};
+  setsockopt(job.fd, SOL_SOCKET, SO_RCVTIMEO, &zero, sizeof(zero));
+  setsockopt(job.fd, SOL_SOCKET, SO_SNDTIMEO, &zero, sizeof(zero));
+  evutil_make_socket_nonblocking(job.fd);
+  job.ok = true;
+}
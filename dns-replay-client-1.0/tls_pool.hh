@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2018 by the University of Southern California
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef TLS_POOL_HH
+#define TLS_POOL_HH
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+
+//one tcp connection plus tls handshake done by a helper thread
+struct tls_job_t
+{
+  std::string src_ip;
+  struct sockaddr_in addr;            //server to connect to
+  int fd = -1;
+  SSL *ssl = NULL;
+  bool ok = false;
+  bool ktls = false;                  //kernel tls on for both directions
+  struct timeval start = {0, 0};      //job taken by a helper
+  struct timeval connected = {0, 0};  //tcp connection established
+  struct timeval done = {0, 0};       //tls handshake finished
+};
+
+// tls handshake pool: a few helper threads connect to the server and
+// run blocking tls handshakes, so the worker's event loop only sees
+// established sessions. The worker submits jobs and, when the notify
+// fd is readable, collects the results. With kernel tls the helper
+// also checks that the kernel took over the session.
+
+class TlsHandshakePool {
+public:
+  TlsHandshakePool(SSL_CTX *, int, int, int, bool);
+  ~TlsHandshakePool();
+  int start();
+  void stop();
+  void submit(const std::string &, const struct sockaddr_in &);
+  bool get_result(tls_job_t &);
+
+private:
+  pid_t my_pid;
+  int num_threads;
+  int notify_fd = -1;  //eventfd, readable when results are waiting
+  int nagle_flag;      //TCP_NODELAY value, -1 to keep the default
+  int time_out;        //seconds for connect and handshake
+  bool done = false;
+  bool use_ktls = false;
+
+  SSL_CTX *ctx;
+
+  std::vector<std::thread> helpers;
+  std::queue<tls_job_t> jobs;
+  std::queue<tls_job_t> results;
+  std::mutex job_mtx;
+  std::mutex result_mtx;
+  std::condition_variable job_cv;
+
+  void helper_loop();
+  void handshake(tls_job_t &);
+};
+
+#endif //TLS_POOL_HH
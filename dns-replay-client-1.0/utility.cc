@@ -17,6 +17,7 @@
  */
 
 #include "utility.hh"
+#include <cmath>
 #include <iostream>
 #include <cstdlib>	//for exit
 #include <sstream>
@@ -26,6 +27,7 @@
 #include <stdio.h>	//for perror
 #include <err.h>        //for err
 #include <locale>
+#include <algorithm>
 using namespace std;
 
 void trim_spaces(string &s) {
@@ -143,6 +145,104 @@ void str_split(string s, string &s1, string &s2, char c)
   s2 = s.substr(found + 1);
 }
 
+//64-bit FNV-1a hash; unlike std::hash it is the same in every build,
+//so all processes map a key to the same place
+uint64_t hash_str(const string &s)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+//jump consistent hash (Lamping and Veach): bucket of a key among n;
+//when n grows by one only 1/n of the keys move
+int jump_hash(uint64_t key, int n)
+{
+  int64_t b = -1, j = 0;
+  while (j < n) {
+    b = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = (b + 1) * (double(1LL << 31) / double((key >> 33) + 1));
+  }
+  return b;
+}
+
+//mix the bits of a key with a seed, so a seed gives another mapping
+uint64_t mix_seed(uint64_t key, uint64_t seed)
+{
+  key ^= seed + 0x9e3779b97f4a7c15ULL + (key << 6) + (key >> 2);
+  key ^= key >> 31;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  return key;
+}
+
+//hyperloglog distinct counter over a vector of HLL_REGS registers
+void hll_add(vector<uint8_t> &regs, uint64_t h)
+{
+  if (regs.size() != HLL_REGS)
+    regs.assign(HLL_REGS, 0);
+  size_t i = h & (HLL_REGS - 1);
+  uint64_t w = h >> HLL_BITS;
+  uint8_t rank = 1;
+  while (rank <= 64 - HLL_BITS && !(w & 1)) {
+    rank++;
+    w >>= 1;
+  }
+  if (rank > regs[i])
+    regs[i] = rank;
+}
+
+double hll_count(const vector<uint8_t> &regs)
+{
+  if (regs.size() != HLL_REGS)
+    return 0.0;
+  double sum = 0.0;
+  int zeros = 0;
+  for (uint8_t r : regs) {
+    sum += 1.0 / double(1ULL << r);
+    if (r == 0)
+      zeros++;
+  }
+  double m = HLL_REGS;
+  double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  if (e <= 2.5 * m && zeros > 0) //small counts: linear counting
+    e = m * log(m / zeros);
+  return e;
+}
+
+//count-min sketch of CMS_DEPTH rows of CMS_WIDTH counters: add one
+//for the key and return its estimated count. Only the smallest
+//counters grow (conservative update), which keeps the overestimate
+//of keys sharing counters with heavy ones low.
+uint32_t cms_add(vector<uint32_t> &c, uint64_t h)
+{
+  if (c.size() != CMS_DEPTH * CMS_WIDTH)
+    c.assign(CMS_DEPTH * CMS_WIDTH, 0);
+  size_t pos[CMS_DEPTH];
+  uint32_t est = UINT32_MAX;
+  for (int r = 0; r < CMS_DEPTH; r++) {
+    pos[r] = r * CMS_WIDTH + (mix_seed(h, r) & (CMS_WIDTH - 1));
+    est = min(est, c[pos[r]]);
+  }
+  if (est == UINT32_MAX)
+    return est;
+  for (int r = 0; r < CMS_DEPTH; r++)
+    if (c[pos[r]] == est)
+      c[pos[r]] = est + 1;
+  return est + 1;
+}
+
+//age the sketch: recent counts weigh more
+void cms_halve(vector<uint32_t> &c)
+{
+  for (uint32_t &v : c)
+    v >>= 1;
+}
+
 //get time
 double get_time_now(struct timeval *tv, struct timezone *tz, string t)
 {
@@ -24,6 +24,8 @@
 #include <cassert>
 #include <cstring>
 #include <vector>
+#include <cmath>
+#include <stdexcept>
 #include "utility.hh"
 using namespace std;
 
@@ -58,7 +60,7 @@ InputSource::InputSource(string fn, string ft)
       trace_cleanup();
       err(1, "cannot start trace");
     }
-  } else if (!is_stdin) { //not read from stdin: open input file
+  } else if (!is_stdin && InputDecoder::detect(fn) == INPUT_CODEC_NONE) { //plain input file
     if (input_format & INPUT_SRC_TEXT) {
       ifs.open(fn);
     } else if (input_format & INPUT_SRC_RAW) {
@@ -66,6 +68,12 @@ InputSource::InputSource(string fn, string ft)
     }
     if (!ifs.is_open())
       err(1, "cannot open input file");
+    input.rdbuf(ifs.rdbuf());
+  } else { //stdin or compressed file: decoded by its own thread
+    dec = new InputDecoder(fn);
+    input.rdbuf(dec);
+    LOG(LOG_DBG, "[%d] input %s compression: %s\n", my_pid, fn.c_str(),
+	InputDecoder::codec_name(dec->get_codec()));
   }
 }
 
@@ -73,6 +81,8 @@ InputSource::~InputSource()
 {
   if (input_format & INPUT_SRC_TRACE)
     trace_cleanup();
+  else if (dec)
+    delete dec;
   else if (!is_stdin)
     ifs.close();
 }
@@ -117,16 +127,9 @@ trace_replay::DNSMsg *InputSource::get()
 
 bool InputSource::read_bytes (char *buf, size_t n)
 {
-  if (is_stdin) {
-    if (n != fread((void *)buf, 1, n, stdin)) {
-      warn("[warn] fail to read stdin");
-      return false;
-    }
-  } else {
-    if (!ifs.read(buf, n)) {
-      warn("[warn] fail to read file");
-      return false;
-    }
+  if (!input.read(buf, n)) {
+    warn("[warn] fail to read %s", (is_stdin ? "stdin" : "file"));
+    return false;
   }
   return true;
 }
@@ -159,7 +162,7 @@ trace_replay::DNSMsg *InputSource::get_from_text()
   string line;
   do {
     line.clear();
-    if (!getline((is_stdin ? (cin):(ifs)), line))
+    if (!getline(input, line))
       return NULL;
   } while (line.length() == 0 || line == "\n" || line.at(0) == '#');
 
@@ -371,3 +374,157 @@ void InputSource::log_dbg(const char *s)
 {
   LOG(LOG_DBG, "[%d] %s\n", my_pid, s);
 }
+
+/*
+  inputs separated by commas, each FILE[@OFFSET[:RATE]] with OFFSET in
+  seconds and RATE a multiplier of the query rate; window is the
+  records of an input that may be out of order
+*/
+InputMerge::InputMerge(string fns, string ft, int w)
+{
+  my_pid = getpid();
+  window = w;
+  size_t pos = 0;
+  while (pos <= fns.size()) {
+    size_t comma = fns.find(',', pos);
+    if (comma == string::npos)
+      comma = fns.size();
+    string spec = fns.substr(pos, comma - pos);
+    pos = comma + 1;
+
+    merge_input_t in;
+    size_t at = spec.rfind('@');
+    in.file = spec.substr(0, at);
+    if (at != string::npos) {
+      string t = spec.substr(at + 1);
+      size_t colon = t.find(':');
+      try {
+	size_t n = 0;
+	string o = t.substr(0, colon);
+	if (!o.empty())
+	  in.offset_us = llround(stod(o, &n) * 1000000);
+	if (n != o.size())
+	  throw invalid_argument(o);
+	if (colon != string::npos) {
+	  string r = t.substr(colon + 1);
+	  in.rate = stod(r, &n);
+	  if (n != r.size() || in.rate <= 0)
+	    throw invalid_argument(r);
+	}
+      } catch (const exception &e) {
+	errx(1, "[error] input %s has invalid offset or rate, abort!", spec.c_str());
+      }
+    }
+    if (in.file.empty())
+      errx(1, "[error] input file is empty in %s, abort!", fns.c_str());
+    if (in.file == "-" && !inputs.empty())
+      errx(1, "[error] standard input must be the only input, abort!");
+    in.ins = new InputSource(in.file, ft);
+    inputs.push_back(in);
+  }
+  direct = (inputs.size() == 1 && window == 0 &&
+	    inputs[0].offset_us == 0 && inputs[0].rate == 1.0);
+  LOG(LOG_DBG, "[%d] merge %lu inputs with a window of %d records\n", my_pid, inputs.size(), window);
+}
+
+InputMerge::~InputMerge()
+{
+  for (merge_rec_t &r : heap)
+    delete r.msg;
+  for (merge_input_t &in : inputs)
+    delete in.ins;
+  if (late > 0)
+    LOG(LOG_INFO, "[%d] %llu input records are out of order beyond the reorder window\n", my_pid,
+	(long long unsigned int)late);
+}
+
+static bool merge_rec_after(const merge_rec_t &a, const merge_rec_t &b)
+{
+  return a.ts > b.ts || (a.ts == b.ts && a.seq > b.seq);
+}
+
+/*
+  time of a record after the offset and the rate of its input
+*/
+int64_t InputMerge::adjust(merge_input_t &in, int64_t ts)
+{
+  if (in.base_us < 0)
+    in.base_us = ts;
+  if (in.rate != 1.0)
+    ts = in.base_us + llround((ts - in.base_us) / in.rate);
+  return max(ts + in.offset_us, (int64_t)0);
+}
+
+/*
+  read the next valid record of input i into the heap; return false at
+  the end of the input
+*/
+bool InputMerge::fill(int i)
+{
+  merge_input_t &in = inputs[i];
+  merge_rec_t r;
+  r.input = i;
+  r.msg = NULL;
+  while (true) {
+    r.msg = in.ins->get();
+    if (r.msg == NULL)
+      return false;
+    if (!r.msg->raw().empty())
+      break;
+    delete r.msg; //not a valid query
+  }
+  int64_t ts = r.msg->seconds() * 1000000 + r.msg->microseconds();
+  r.ts = adjust(in, ts);
+  if (r.ts != ts) {
+    r.msg->set_seconds(r.ts / 1000000);
+    r.msg->set_microseconds(r.ts % 1000000);
+  }
+  r.seq = seq++;
+  heap.push_back(move(r));
+  push_heap(heap.begin(), heap.end(), merge_rec_after);
+  return true;
+}
+
+void InputMerge::start()
+{
+  started = true;
+  if (direct)
+    return;
+  heap.reserve(inputs.size() * (window + 1));
+  for (size_t i = 0; i < inputs.size(); i++)
+    for (int k = 0; k <= window && fill(i); k++)
+      ;
+}
+
+/*
+  take the earliest record and read the next one of its input
+*/
+bool InputMerge::pop(merge_rec_t &r)
+{
+  if (heap.empty())
+    return false;
+  pop_heap(heap.begin(), heap.end(), merge_rec_after);
+  r = move(heap.back());
+  heap.pop_back();
+  fill(r.input);
+  if (r.ts < last_ts)
+    late += 1;
+  else
+    last_ts = r.ts;
+  return true;
+}
+
+/*
+  same as InputSource::get, but invalid queries are skipped
+*/
+trace_replay::DNSMsg *InputMerge::get()
+{
+  if (!started)
+    start();
+  if (direct)
+    return inputs[0].ins->get();
+  merge_rec_t r;
+  if (!pop(r))
+    return NULL;
+  return r.msg;
+}
@@ -19,10 +19,13 @@
 #define INPUT_SOURCE_HH
 #include <string>
 #include <fstream>
+#include <istream>
 #include "libtrace.h"
 #include "dbg.h"
 #include "dns_msg.pb.h"
+#include "input_decoder.hh"
 #include <unordered_map>
+#include <vector>
 
 #define INPUT_SRC_NONE     0x0000U
 #define INPUT_SRC_TRACE    0x0001U
@@ -42,8 +45,11 @@ private:
 
   unsigned int input_format = INPUT_SRC_NONE;
 
-  //text file
+  //text file, or raw stream: read through the decoder when it is
+  //stdin or compressed
   std::ifstream ifs;
+  InputDecoder *dec = NULL;
+  std::istream input{NULL};
   bool is_stdin = false;
   bool read_bytes (char *, size_t);
   trace_replay::DNSMsg *get_from_text();
@@ -59,4 +65,54 @@ private:
   void log_dbg(const char *);
 };
 
+//one input of a merged stream
+struct merge_input_t
+{
+  InputSource *ins = NULL;
+  std::string file;
+  int64_t offset_us = 0;  //added to each time after the rate
+  double rate = 1.0;      //query rate multiplier
+  int64_t base_us = -1;   //first time of the input, the rate scales from it
+};
+
+//a record waiting in the merge heap
+struct merge_rec_t
+{
+  int64_t ts;          //microseconds, offset and rate applied
+  uint64_t seq;        //read order, keeps records of equal time in order
+  int input;
+  trace_replay::DNSMsg *msg;
+};
+
+// merge of several inputs by time: a streaming k-way merge over one
+// heap. Each input keeps window + 1 records in the heap, so records
+// up to window places out of order in a file are put back in order.
+// Each input may be shifted by an offset and replayed at a multiple
+// of its rate, to superimpose traffic of several sites or days. The
+// input path is a list separated by commas, FILE[@OFFSET[:RATE]].
+
+class InputMerge {
+public:
+  InputMerge(std::string, std::string, int);
+  ~InputMerge();
+  trace_replay::DNSMsg *get();
+
+private:
+  pid_t my_pid;
+  int window;
+  uint64_t seq = 0;
+  uint64_t late = 0;       //records still out of order after the window
+  int64_t last_ts = -1;    //time of the last record returned
+  bool started = false;
+  bool direct = false;     //one plain input: no heap at all
+
+  std::vector<merge_input_t> inputs;
+  std::vector<merge_rec_t> heap;
+
+  void start();
+  bool fill(int);
+  int64_t adjust(merge_input_t &, int64_t);
+  bool pop(merge_rec_t &);
+};
+
 #endif //INPUT_SOURCE_HH
@@ -62,7 +62,9 @@ static bool ValidateNumClients(const char *flagname, int32_t num_clients) {
 
 DEFINE_string(input, "",
 	      "input format and path separated by colon."
-	      "e.g. trace:PATH, text:PATH, raw:PATH");
+	      "e.g. trace:PATH, text:PATH, raw:PATH."
+	      " The path may list inputs separated by commas, merged by time,"
+	      " each FILE[@OFFSET[:RATE]]. gzip, xz or zstd input is decompressed");
 DEFINE_validator(input, &ValidateInput);
 DEFINE_string(output, "", "output, file or '-' for stdout");
 DEFINE_string(address, "", "listening address");
@@ -78,6 +80,27 @@ DEFINE_int32(trace_limit, -1,
 	     "preload seconds of trace, used to control memory consumption."
 	     "default is none (0 or negative integer): read all in memory");
 DEFINE_validator(num_clients, &ValidateNumClients);
+static bool ValidateWorkerMap(const char *flagname, const string &s) {
+  return (s == "random" || s == "hash" || s == "load");
+}
+
+DEFINE_string(worker_map, "random",
+	      "client of a new source: random (or by filter), hash (consistent hash of the source,"
+	      " no state) or load (client with the fewest recent queries)");
+DEFINE_validator(worker_map, &ValidateWorkerMap);
+DEFINE_uint64(map_seed, 0, "seed of the hash worker_map");
+DEFINE_int32(max_client_buffer, 0,
+	     "KB of queries that may wait to be sent to a client before input is paused."
+	     "default is none (0)");
+DEFINE_int32(reorder, 0,
+	     "records of each input that may be out of order, put back in order"
+	     " when the inputs are merged. default is 0");
+DEFINE_int32(start_margin, 0,
+	     "synchronized start: clients hold their queries and all start this many ms"
+	     " after the preload, on clocks measured by pings. default is none (0)");
+DEFINE_double(preload, 0,
+	      "seconds of input sent to the clients before the start, with start_margin."
+	      " default is 0");
 DEFINE_bool(dry_run, false,
 	    "start controller without accepting connections. used to debug");
 
@@ -111,6 +134,8 @@ int main(int argc, char *argv[])
   VLOG(1) << "# address: " << FLAGS_address << ":" << FLAGS_port;
   VLOG(1) << "# trace_limit: " << FLAGS_trace_limit;
   VLOG(1) << "# filter: " << FLAGS_filter;
+  VLOG(1) << "# max_client_buffer: " << FLAGS_max_client_buffer << " KB";
+  VLOG(1) << "# worker_map: " << FLAGS_worker_map << " seed: " << FLAGS_map_seed;
 
   Filter client_filter;
   if (!FLAGS_filter.empty()) {
@@ -144,7 +169,10 @@ int main(int argc, char *argv[])
     my_pid = getpid();
     VLOG(2) << "[" << my_pid << "] postman [" << my_pid << "] is up";
     if (!FLAGS_dry_run) {
-      Postman cmd (FLAGS_output, FLAGS_address, FLAGS_port, FLAGS_num_clients, skt[1], client_filter);
+      Postman cmd (FLAGS_output, FLAGS_address, FLAGS_port, FLAGS_num_clients, skt[1], client_filter,
+		   FLAGS_worker_map, FLAGS_map_seed,
+		   (size_t)(FLAGS_max_client_buffer > 0 ? FLAGS_max_client_buffer : 0) * 1024,
+		   (FLAGS_start_margin > 0 ? FLAGS_start_margin : 0), FLAGS_preload);
       cmd.start();
     }
     VLOG(2) << "[" << my_pid << "] ends";
@@ -153,11 +181,9 @@ int main(int argc, char *argv[])
 
   //parent process: reader
   VLOG(2) << "[" << my_pid << "] create postman [" << child_pid << "]";
-  VLOG(2) << "[" << my_pid << "] wait for 3 seconds";
-  sleep(3);
 
   if (!FLAGS_dry_run) {
-    Reader rd (input_file, input_format, skt[0]);
+    Reader rd (input_file, input_format, skt[0], FLAGS_reorder);
     if (rd.unblock(POSTMAN_FLAG)) {
       rd.read_input(FLAGS_trace_limit);
     }
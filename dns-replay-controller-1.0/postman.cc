@@ -23,6 +23,7 @@
 #include <csignal>
 #include <err.h>
 #include "dns_util.hh"
+#include "utility.hh"
 
 #include <event2/listener.h>
 #include <event2/bufferevent.h>
@@ -45,7 +46,11 @@ using namespace std;
 
 const int random_seed = 1000;
 
-Postman::Postman(string ofn, string ip, int port, int n, int s, Filter &f)
+#define LOAD_DECAY_QUERIES 65536  //client loads are halved after this many queries
+#define PING_COUNT 5              //pings to measure the clock offset of a client
+
+Postman::Postman(string ofn, string ip, int port, int n, int s, Filter &f, string map, uint64_t seed,
+		 size_t max_buf, int margin, double pre)
 {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
   
@@ -74,6 +79,16 @@ Postman::Postman(string ofn, string ip, int port, int n, int s, Filter &f)
   uniform_filter = uniform_int_distribution<int>(0, kFilterTotalWeight-1);
   uniform_client = uniform_int_distribution<int>(0, num_clients-1);
 
+  //source mapping
+  worker_map = map;
+  map_seed = seed;
+  client_load.assign(num_clients, 0.0);
+  client_queries.assign(num_clients, 0);
+  client_srcs.resize(num_clients);
+  max_client_buffer = max_buf;
+  start_margin = margin;
+  preload = pre;
+
   //output file
   if (output_file.length() != 0 && output_file != "-") {
     out_fs.open(output_file);
@@ -135,6 +150,10 @@ void Postman::client_bevent_cb(int fd)
   if (client_fd2bev.find(fd) == client_fd2bev.end())
     errx(1, "[error] cannot find [%d] in record", fd);
   client_fd2bev.erase(fd);
+  if (client_full.erase(fd) && client_full.empty() && skt_bev)
+    bufferevent_enable(skt_bev, EV_READ); //do not wait for a closed client
+  if (client_ping.erase(fd))
+    check_pings();
 
   if (client_fd2src.find(fd) == client_fd2src.end())
     return;
@@ -215,8 +234,14 @@ void Postman::skt_read_cb(struct bufferevent *bev)
     //print_dns_pkt((uint8_t*)raw.data(), raw.size());
 
     //the first message is sent to all clients to sync time
+    double trace_current_ts = double(msg->seconds()) + double(msg->microseconds())/1000000.0;
     if (!done_sync_time) {
       msg->set_sync_time(true);
+      if (start_margin > 0) { //clients hold queries until the start instant
+	msg->set_start_time(0);
+	start_hold = true;
+	hold_trace_ts = trace_current_ts;
+      }
       msg_str.clear();
       if (!(msg->SerializeToString(&msg_str)))
 	err(1, "[error] serialize message fails");
@@ -230,8 +255,12 @@ void Postman::skt_read_cb(struct bufferevent *bev)
       VLOG(3) << "[" << my_pid << "] sent sync time message to all clients";
     }
 
+    if (start_hold && trace_current_ts - hold_trace_ts >= preload)
+      send_start();
+
     //the message is sent again as normal message
     msg->set_sync_time(false);
+    msg->clear_start_time();
     msg_str.clear();
     if (!(msg->SerializeToString(&msg_str)))
       err(1, "[error] serialize message fails");
@@ -249,6 +278,7 @@ void Postman::skt_read_cb(struct bufferevent *bev)
     uint32_t tmp_sz = htonl(msg_str.size());
     bufferevent_write(bev, &tmp_sz, sizeof(tmp_sz));
     bufferevent_write(bev, msg_str.data(), msg_str.size());
+    check_client_buffer(bev);
 
     //clean up
     delete msg;
@@ -258,6 +288,46 @@ void Postman::skt_read_cb(struct bufferevent *bev)
   } while(skt_buffer.size() > sizeof(uint32_t));
 }
 
+/*
+  stop reading input while the client has too much data waiting; the
+  reader then blocks on the full socket
+*/
+void Postman::check_client_buffer(struct bufferevent *bev)
+{
+  if (max_client_buffer == 0)
+    return;
+  if (evbuffer_get_length(bufferevent_get_output(bev)) <= max_client_buffer)
+    return;
+  int fd = bufferevent_getfd(bev);
+  if (client_full.count(fd))
+    return;
+  VLOG(2) << "[" << my_pid << "] client fd=" << fd << " is full, pause input";
+  client_full[fd] = true;
+  bufferevent_disable(skt_bev, EV_READ);
+  //called back when half of the data is sent
+  bufferevent_setwatermark(bev, EV_WRITE, max_client_buffer / 2, 0);
+  bufferevent_setcb(bev, client_read_cb_helper, client_write_cb_helper, client_bevent_cb_helper, this);
+}
+
+void Postman::client_write_cb_helper(struct bufferevent *bev, void *ctx)
+{
+  (static_cast<Postman *>(ctx))->client_write_cb(bev);
+}
+
+/*
+  the client has room again; read input when no client is full
+*/
+void Postman::client_write_cb(struct bufferevent *bev)
+{
+  int fd = bufferevent_getfd(bev);
+  bufferevent_setcb(bev, client_read_cb_helper, NULL, client_bevent_cb_helper, this);
+  if (!client_full.erase(fd))
+    return;
+  VLOG(2) << "[" << my_pid << "] client fd=" << fd << " has room";
+  if (client_full.empty())
+    bufferevent_enable(skt_bev, EV_READ);
+}
+
 /*
   input socket event helper
 */
@@ -286,6 +356,8 @@ void Postman::skt_event_cb(struct bufferevent *bev, short which)
   }
   if (err_msg.length() != 0) {
     LOG(ERROR) << "[" << my_pid << "] input fd=" << fd << " error:" << err_msg;
+    if (start_hold) //input shorter than the preload
+      send_start();
     bufferevent_free(bev);
   }
 }
@@ -346,6 +418,7 @@ void Postman::start()
   event_base_free(base);
 
   //final log for stats
+  report_clients();
   for (unsigned int i=0; i<client_fds.size(); i++) {
     if (!client_fd2src.count(client_fds[i])) {
       LOG(WARNING) << "cannot find fd=" << client_fds[i] << " in the record, cleaned up due to client close?";
@@ -375,6 +448,12 @@ void Postman::client_read_cb(struct bufferevent *bev)
   assert(data);
   memset(data, 0, len);
   bufferevent_read(bev, data, len);
+
+  if (client_ping.count(fd) && !client_ping[fd].done) { //pongs, not output
+    read_pong(fd, data, len);
+    delete[] data;
+    return;
+  }
   
   if (output_file.length() != 0) {
     if (out_fs.is_open())
@@ -434,6 +513,13 @@ void Postman::accept_conn_cb (struct evconnlistener *listener,
   //if all clients are connected, start to distribute the input data
   VLOG(3) << "[" << my_pid << "] total connected clients=" << client_fd2bev.size();
   if (!start_read_input && client_fd2bev.size() == num_clients) {
+    if (start_margin > 0) { //measure the clocks first
+      for (auto it : client_fd2bev) {
+	client_ping[it.first] = ping_t();
+	send_ping(it.second);
+      }
+      return;
+    }
     //read_input();
     string flag = POSTMAN_FLAG;
     write(skt, flag.c_str(), flag.length());
@@ -441,19 +527,128 @@ void Postman::accept_conn_cb (struct evconnlistener *listener,
   }
 }
 
-//return the client bev for this src ip
+//send a ping with our clock; the client answers with a pong line
+void Postman::send_ping(struct bufferevent *bev)
+{
+  trace_replay::DNSMsg msg;
+  msg.set_seconds(0);
+  msg.set_microseconds(0);
+  msg.set_tcp(false);
+  msg.set_ipv4(true);
+  msg.set_src_ip("");
+  msg.set_raw("");
+  msg.set_ping_time((int64_t)get_time_now("us"));
+  string msg_str;
+  if (!msg.SerializeToString(&msg_str))
+    err(1, "[error] serialize message fails");
+  uint32_t tmp_sz = htonl(msg_str.size());
+  bufferevent_write(bev, &tmp_sz, sizeof(tmp_sz));
+  bufferevent_write(bev, msg_str.data(), msg_str.size());
+  client_ping[bufferevent_getfd(bev)].sent += 1;
+}
+
+//pong lines "#pong PING_TIME CLIENT_TIME": the offset of the client
+//clock assumes the pong was taken half way through the round trip
+void Postman::read_pong(int fd, const char *data, size_t len)
+{
+  ping_t &p = client_ping[fd];
+  p.buf.append(data, len);
+  size_t nl;
+  while ((nl = p.buf.find('\n')) != string::npos) {
+    int64_t now = (int64_t)get_time_now("us");
+    long long t0 = 0, t1 = 0;
+    if (sscanf(p.buf.c_str(), "#pong %lld %lld", &t0, &t1) == 2) {
+      int64_t rtt = now - t0;
+      if (p.best_rtt < 0 || rtt < p.best_rtt) {
+	p.best_rtt = rtt;
+	p.offset = t1 - (t0 + now) / 2;
+      }
+      if (p.sent < PING_COUNT) {
+	send_ping(client_fd2bev[fd]);
+      } else {
+	p.done = true;
+	VLOG(1) << "[" << my_pid << "] client fd=" << fd << " clock offset=" << p.offset
+		<< "us rtt=" << p.best_rtt << "us";
+      }
+    } else {
+      LOG(WARNING) << "[" << my_pid << "] client fd=" << fd << " sent an invalid pong";
+    }
+    p.buf.erase(0, nl + 1);
+  }
+  check_pings();
+}
+
+//read input once the clocks of all clients are measured
+void Postman::check_pings()
+{
+  if (start_read_input || start_margin == 0)
+    return;
+  for (auto &it : client_ping)
+    if (!it.second.done)
+      return;
+  string flag = POSTMAN_FLAG;
+  write(skt, flag.c_str(), flag.length());
+  start_read_input = true;
+}
+
+//end the preload: all clients start start_margin ms from now, each
+//told the instant on its own clock
+void Postman::send_start()
+{
+  start_hold = false;
+  int64_t start_us = (int64_t)get_time_now("us") + (int64_t)start_margin * 1000;
+  trace_replay::DNSMsg msg;
+  msg.set_seconds(0);
+  msg.set_microseconds(0);
+  msg.set_tcp(false);
+  msg.set_ipv4(true);
+  msg.set_src_ip("");
+  msg.set_raw("");
+  msg.set_sync_time(true);
+  string msg_str;
+  for (auto it : client_fd2bev) {
+    msg.set_start_time(start_us + client_ping[it.first].offset);
+    msg_str.clear();
+    if (!msg.SerializeToString(&msg_str))
+      err(1, "[error] serialize message fails");
+    uint32_t tmp_sz = htonl(msg_str.size());
+    bufferevent_write(it.second, &tmp_sz, sizeof(tmp_sz));
+    bufferevent_write(it.second, msg_str.data(), msg_str.size());
+  }
+  VLOG(1) << "[" << my_pid << "] preload is sent, replay starts in " << start_margin << " ms";
+}
+
+//return the client bev for this src ip. A source keeps its client:
+//random and load remember the client picked for a new source, hash
+//computes it every time from the source and the seed, without state.
 struct bufferevent *Postman::rand_client(const char *src_ip)
 {
+  if (client_fd2bev.size() == 0) {
+    errx(1, "[error] no more clients left");
+  }
   string ip = src_ip;
-  if (client_src2fd.find(ip) == client_src2fd.end()) {
-    //not found, get one fd and bev based on client fileter or randomly
-    if (client_fd2bev.size() == 0) {
-      errx(1, "[error] no more clients left");
+  uint64_t h = hash_str(ip);
+  int idx = -1;
+  if (worker_map == "hash") {
+    //a closed client moves its sources to the next live one
+    uint64_t k = mix_seed(h, map_seed);
+    idx = jump_hash(k, client_fds.size());
+    while (!client_fd2bev.count(client_fds[idx])) {
+      k = mix_seed(k, map_seed + 1);
+      idx = jump_hash(k, client_fds.size());
     }
-    int idx = 0;
+  } else if (client_src2fd.find(ip) != client_src2fd.end()) {
+    for (unsigned int i = 0; i < client_fds.size(); i++)
+      if (client_fds[i] == client_src2fd[ip])
+	idx = i;
+  } else {
+    //not found, get one fd and bev based on client fileter, load or randomly
     if (client_filter.GetNumClients() != 0) { //client filter is set
       idx = client_filter.GetClientIndex(uniform_filter(mt_generator));
       VLOG(3) << "[" << my_pid << "] select client fd=" << client_fds[idx] <<" by filter";
+    } else if (worker_map == "load") {
+      idx = least_loaded_client();
+      VLOG(3) << "[" << my_pid << "] select client fd=" << client_fds[idx] <<" by load";
     } else {
       idx = uniform_client(mt_generator);
       VLOG(3) << "[" << my_pid << "] select client fd=" << client_fds[idx] <<" randomly";
@@ -465,5 +660,36 @@ struct bufferevent *Postman::rand_client(const char *src_ip)
     client_fd2src[client_fds[idx]].push_back(ip);
     VLOG(2) << "map: " << ip << " " << idx;
   }
-  return client_fd2bev[client_src2fd[ip]];
+
+  //recent load and totals of the clients
+  client_load[idx] += 1.0;
+  client_queries[idx] += 1;
+  hll_add(client_srcs[idx], h);
+  if (++map_queries % LOAD_DECAY_QUERIES == 0) {
+    for (double &l : client_load)
+      l /= 2;
+  }
+  return client_fd2bev[client_fds[idx]];
+}
+
+//live client with the lowest recent load
+int Postman::least_loaded_client()
+{
+  int idx = -1;
+  for (unsigned int i = 0; i < client_fds.size(); i++) {
+    if (!client_fd2bev.count(client_fds[i]))
+      continue;
+    if (idx < 0 || client_load[i] < client_load[idx])
+      idx = i;
+  }
+  return idx;
+}
+
+//log queries and distinct sources (estimated) of each client
+void Postman::report_clients()
+{
+  for (unsigned int i = 0; i < client_fds.size(); i++) {
+    VLOG(1) << "[" << my_pid << "] client id=" << i << " fd=" << client_fds[i]
+	    << " queries=" << client_queries[i] << " sources=" << (uint64_t)hll_count(client_srcs[i]);
+  }
 }
@@ -34,7 +34,8 @@
 
 class Postman{
 public:
-  Postman(std::string, std::string, int, int, int, Filter &);
+  Postman(std::string, std::string, int, int, int, Filter &, std::string, uint64_t, size_t,
+	  int, double);
   ~Postman();
   void start();
 
@@ -50,7 +51,7 @@ private:
   
   struct sockaddr_in listen_addr;
   struct event_base *base = NULL;
-  struct bufferevent *skt_bev;
+  struct bufferevent *skt_bev = NULL;
   
   std::string skt_buffer;
   std::string listen_ip;
@@ -62,19 +63,58 @@ private:
   std::unordered_map<int, struct bufferevent *> client_fd2bev; //index by (fd, bev)
   std::unordered_map<int, std::vector<std::string> > client_fd2src; //index by (fd, vector of src_ip)
 
+  //flow control: input is not read while a client has more than
+  //max_client_buffer bytes waiting to be sent to it
+  size_t max_client_buffer;
+  std::unordered_map<int, bool> client_full; //index by (fd, full)
+
   std::vector<int> client_fds;   //store a list of client fd
+
+  //synchronized start: the clock offset of each client is measured by
+  //pings before the input is read, then after the preload all clients
+  //get one start instant, each on its own clock
+  struct ping_t {
+    int sent = 0;
+    int64_t best_rtt = -1;   //microseconds, the offset of the fastest ping is kept
+    int64_t offset = 0;      //client clock minus ours, microseconds
+    bool done = false;
+    std::string buf;         //partial pong line
+  };
+  int start_margin;          //ms from the end of the preload to the start, 0 for none
+  double preload;            //seconds of trace sent before the start instant
+  bool start_hold = false;
+  double hold_trace_ts = 0.0;
+  std::unordered_map<int, ping_t> client_ping; //index by (fd, ping state)
+
+  //source mapping and the load of each client, by index in client_fds
+  std::string worker_map;        //random, hash or load
+  uint64_t map_seed;
+  std::vector<double> client_load;                //queries, decayed every LOAD_DECAY_QUERIES
+  std::vector<uint64_t> client_queries;
+  std::vector<std::vector<uint8_t> > client_srcs; //distinct sources, hyperloglog
+  uint64_t map_queries = 0;
   
   std::mt19937 mt_generator;
   std::uniform_int_distribution<int> uniform_client;
   std::uniform_int_distribution<int> uniform_filter;
 
   struct bufferevent *rand_client(const char *);
+  int least_loaded_client();
+  void report_clients();
+  void send_ping(struct bufferevent *);
+  void read_pong(int, const char *, size_t);
+  void check_pings();
+  void send_start();
   
   static void accept_conn_cb_helper(struct evconnlistener *, evutil_socket_t,
 				    struct sockaddr *, int, void *);
   void accept_conn_cb(struct evconnlistener *, evutil_socket_t,
 		      struct sockaddr *, int);
 
+  void check_client_buffer(struct bufferevent *);
+  static void client_write_cb_helper(struct bufferevent *, void *);
+  void client_write_cb(struct bufferevent *);
+
   static void client_read_cb_helper(struct bufferevent *, void *);
   void client_read_cb(struct bufferevent *);
 
@@ -37,7 +37,6 @@ using namespace std;
 
 #define MAX_BUF_SIZE    4096
 #define MIN_BUF_SIZE    64
-#define SLEEP_TIME      1.0
 
 static void signal_cb(evutil_socket_t sig, short what, void *arg)
 {
@@ -49,14 +48,14 @@ static void signal_cb(evutil_socket_t sig, short what, void *arg)
   event_base_loopexit(base, &delay);
 }
 
-Reader::Reader(string fn, string ft, int s)
+Reader::Reader(string fn, string ft, int s, int reorder)
 {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
   my_pid = getpid();
   input_file = fn;
   input_format = ft;
   skt = s;
-  ins = new InputSource(fn, ft);
+  ins = new InputMerge(fn, ft, reorder);
   assert(ins);
 }
 
@@ -95,16 +94,14 @@ void Reader::read_input(int l)
         trace_start_ts = trace_current_ts;
         real_start_ts = get_time_now("second");
       } else {
-	while (
-               (trace_current_ts - trace_start_ts)     //trace_ts_diff
-               -
-               (get_time_now("second") - real_start_ts)//real_ts_diff
-               >
-               (trace_limit + double(SLEEP_TIME))      //limit_ts
-               ) {
-	  warnx("go to sleep: %.6f", get_time_now("second"));
-          sleep(SLEEP_TIME); //wait for SLEEP_TIME
-        }
+	//sleep just until the query is within the limit
+	double ahead;
+	while ((ahead = (trace_current_ts - trace_start_ts)         //trace_ts_diff
+		- (get_time_now("second") - real_start_ts)         //real_ts_diff
+		- trace_limit) > 0.001) {
+	  VLOG(3) << "[" << my_pid << "] go to sleep for " << ahead << " seconds";
+	  usleep((useconds_t)(ahead * 1000000));
+	}
       }
     }
     
@@ -30,7 +30,7 @@
 
 class Reader {
 public:
-  Reader(std::string, std::string, int);
+  Reader(std::string, std::string, int, int);
   ~Reader();
   bool unblock(const char *);
   void read_input(int);
@@ -40,7 +40,7 @@ private:
   int trace_limit;
   pid_t my_pid;
 
-  InputSource *ins;
+  InputMerge *ins;
 
   std::string input_file;
   std::string input_format;
@@ -21,6 +21,7 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
 #include <sys/time.h>	/* gettimeofday */
 
 #define UTIL_MAX(a, b)  (((a) > (b)) ? (a) : (b))
@@ -45,5 +46,15 @@ std::string str_tolower(std::string);
 
 std::string fmt_str(std::string, std::string);
 
+uint64_t hash_str(const std::string &);
+
+int jump_hash(uint64_t, int);
+uint64_t mix_seed(uint64_t, uint64_t);
+
+#define HLL_BITS 10
+#define HLL_REGS (1U << HLL_BITS)
+void hll_add(std::vector<uint8_t> &, uint64_t);
+double hll_count(const std::vector<uint8_t> &);
+
 void die(const char *msg);
 #endif	//UTILITY_HH
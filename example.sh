@@ -54,7 +54,8 @@ cntlr_box="c.$dn"
 cntlr_addr="10.1.1.3"
 cntlr_port="10053"
 cntlr_input_type="raw"
-cntlr_input="xzcat $work_dir/input_trace/abc1.ldplayer.xz $work_dir/input_trace/abc2.ldplayer.xz $work_dir/input_trace/abc3.ldplayer.xz"
+# the controller decompresses the concatenated xz files itself
+cntlr_input="cat $work_dir/input_trace/abc1.ldplayer.xz $work_dir/input_trace/abc2.ldplayer.xz $work_dir/input_trace/abc3.ldplayer.xz"
 cntlr="ssh $cntlr_box"
 cntlr_hostname=`$cntlr "hostname -s"`
 